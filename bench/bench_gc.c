@@ -0,0 +1,311 @@
+/*
+ * Allocation benchmarks. Every workload runs once against the collector
+ * and once against plain malloc/free as a baseline, and prints one JSON
+ * object per line:
+ *
+ *   bench_gc [scale] [workload...]
+ *
+ * scale multiplies the amount of work (default 1). Workloads are fixed
+ * and seeded, so runs are comparable. Collector pauses are taken from the
+ * trace: the time between the begin and end events of each collection.
+ */
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "gc.h"
+
+typedef struct Allocator {
+    const char* name;
+    void* (*malloc)(size_t size);
+    void* (*realloc)(void* ptr, size_t size);
+    char* (*strdup)(const char* s);
+    void (*free)(void* ptr);
+} Allocator;
+
+static GarbageCollector* bench_gc;
+static size_t bench_allocs;
+static size_t bench_bytes;
+
+static void collect_pauses(GarbageCollector* gc);
+
+static void* gc_bench_malloc(size_t size) {
+    /* Drain the trace before the ring fills up */
+    if (bench_allocs % 4096 == 0) {
+        collect_pauses(bench_gc);
+    }
+    return gc_malloc(bench_gc, size);
+}
+static void* gc_bench_realloc(void* ptr, size_t size) { return gc_realloc(bench_gc, ptr, size); }
+static char* gc_bench_strdup(const char* s) { return gc_strdup(bench_gc, s); }
+static void gc_bench_free(void* ptr) { (void) ptr; }
+
+static const Allocator gc_allocator = { "gc", gc_bench_malloc, gc_bench_realloc, gc_bench_strdup, gc_bench_free };
+static const Allocator libc_allocator = { "malloc", malloc, realloc, strdup, free };
+
+static uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000u + (uint64_t) ts.tv_nsec;
+}
+
+static uint64_t rng_state;
+
+static uint64_t rng(void) {
+    rng_state ^= rng_state << 13;
+    rng_state ^= rng_state >> 7;
+    rng_state ^= rng_state << 17;
+    return rng_state;
+}
+
+static void* alloc(const Allocator* a, size_t size) {
+    bench_allocs++;
+    bench_bytes += size;
+    void* p = a->malloc(size);
+    memset(p, 0, size);
+    return p;
+}
+
+/* GCBench: short-lived trees of varying depth next to a long-lived one */
+typedef struct Tree {
+    struct Tree* left;
+    struct Tree* right;
+    size_t value;
+} Tree;
+
+static Tree* tree_make(const Allocator* a, int depth) {
+    Tree* t = alloc(a, sizeof(Tree));
+    if (depth > 0) {
+        t->left = tree_make(a, depth - 1);
+        t->right = tree_make(a, depth - 1);
+    }
+    return t;
+}
+
+static void tree_free(const Allocator* a, Tree* t) {
+    if (t) {
+        tree_free(a, t->left);
+        tree_free(a, t->right);
+        a->free(t);
+    }
+}
+
+static void bench_tree(const Allocator* a, size_t scale) {
+    Tree* long_lived = tree_make(a, 16);
+    for (size_t round = 0; round < scale; ++round) {
+        for (int depth = 4; depth <= 16; depth += 2) {
+            size_t iterations = (size_t) 1 << (18 - depth);
+            for (size_t i = 0; i < iterations; ++i) {
+                tree_free(a, tree_make(a, depth));
+            }
+        }
+    }
+    tree_free(a, long_lived);
+}
+
+/* Linked lists built and dropped */
+typedef struct Node {
+    struct Node* next;
+    size_t value;
+} Node;
+
+static void bench_list(const Allocator* a, size_t scale) {
+    for (size_t round = 0; round < 200 * scale; ++round) {
+        Node* head = NULL;
+        for (size_t i = 0; i < 10000; ++i) {
+            Node* n = alloc(a, sizeof(Node));
+            n->next = head;
+            n->value = i;
+            head = n;
+        }
+        while (head) {
+            Node* next = head->next;
+            a->free(head);
+            head = next;
+        }
+    }
+}
+
+/* Many small strings, a window of which stays alive */
+static void bench_strings(const Allocator* a, size_t scale) {
+    static const char* words[] = { "a", "garbage", "collector", "for", "the",
+                                   "c programming language", "mark and sweep" };
+    char* window[1024] = { NULL };
+    for (size_t i = 0; i < 2000000 * scale; ++i) {
+        size_t slot = rng() % 1024;
+        a->free(window[slot]);
+        window[slot] = a->strdup(words[rng() % (sizeof(words) / sizeof(*words))]);
+        bench_allocs++;
+        bench_bytes += strlen(window[slot]) + 1;
+    }
+    for (size_t i = 0; i < 1024; ++i) {
+        a->free(window[i]);
+    }
+}
+
+/* Large buffers, a few of which stay alive */
+static void bench_large(const Allocator* a, size_t scale) {
+    char* buffers[8] = { NULL };
+    for (size_t i = 0; i < 2000 * scale; ++i) {
+        size_t slot = rng() % 8;
+        a->free(buffers[slot]);
+        buffers[slot] = alloc(a, (64 << 10) + (rng() % (1 << 20)));
+    }
+    for (size_t i = 0; i < 8; ++i) {
+        a->free(buffers[i]);
+    }
+}
+
+/* Vectors grown by doubling with realloc */
+static void bench_vector(const Allocator* a, size_t scale) {
+    for (size_t round = 0; round < 2000 * scale; ++round) {
+        size_t capacity = 4;
+        size_t* v = alloc(a, capacity * sizeof(size_t));
+        for (size_t i = 0; i < 4096; ++i) {
+            if (i == capacity) {
+                capacity *= 2;
+                v = a->realloc(v, capacity * sizeof(size_t));
+                bench_allocs++;
+                bench_bytes += capacity * sizeof(size_t);
+            }
+            v[i] = i;
+        }
+        a->free(v);
+    }
+}
+
+/* Allocation with a deep stack of live pointers to scan */
+static size_t deep(const Allocator* a, size_t depth, size_t work) {
+    Node* n = alloc(a, sizeof(Node));
+    size_t sum;
+    if (depth == 0) {
+        sum = 0;
+        for (size_t i = 0; i < work; ++i) {
+            Node* m = alloc(a, sizeof(Node));
+            sum += (size_t) m & 1;
+            a->free(m);
+        }
+    } else {
+        sum = deep(a, depth - 1, work);
+    }
+    n->value = sum;
+    sum = n->value;
+    a->free(n);
+    return sum;
+}
+
+static void bench_deep_stack(const Allocator* a, size_t scale) {
+    for (size_t round = 0; round < 20 * scale; ++round) {
+        deep(a, 10000, 100000);
+    }
+}
+
+typedef struct Workload {
+    const char* name;
+    void (*run)(const Allocator* a, size_t scale);
+} Workload;
+
+static const Workload workloads[] = {
+    { "tree", bench_tree },
+    { "list", bench_list },
+    { "strings", bench_strings },
+    { "large", bench_large },
+    { "vector", bench_vector },
+    { "deep_stack", bench_deep_stack },
+};
+
+static int compare_u64(const void* x, const void* y) {
+    uint64_t a = *(const uint64_t*) x;
+    uint64_t b = *(const uint64_t*) y;
+    return a < b ? -1 : a > b;
+}
+
+/* Collection pauses from begin/end pairs in the trace */
+static uint64_t* pauses;
+static size_t npauses;
+static size_t pauses_capacity;
+static uint64_t pause_begin;
+
+static void collect_pauses(GarbageCollector* gc) {
+    GcTraceEvent events[256];
+    size_t n;
+    while ((n = gc_trace_drain(gc, events, 256))) {
+        for (size_t i = 0; i < n; ++i) {
+            if (events[i].type == GC_EVENT_BEGIN) {
+                pause_begin = events[i].time_ns;
+            } else if (events[i].type == GC_EVENT_END && pause_begin) {
+                if (npauses == pauses_capacity) {
+                    pauses_capacity = pauses_capacity ? 2 * pauses_capacity : 1024;
+                    pauses = realloc(pauses, pauses_capacity * sizeof(uint64_t));
+                }
+                pauses[npauses++] = events[i].time_ns - pause_begin;
+                pause_begin = 0;
+            }
+        }
+    }
+}
+
+static double percentile_us(double p) {
+    if (!npauses) {
+        return 0.0;
+    }
+    size_t i = (size_t) (p * (double) (npauses - 1) + 0.5);
+    return (double) pauses[i] / 1e3;
+}
+
+static void run(const Workload* w, const Allocator* a, size_t scale, void* bos) {
+    GarbageCollector gc;
+    if (a == &gc_allocator) {
+        GarbageCollectorOptions opts;
+        gc_options_init(&opts);
+        opts.trace_level = GC_TRACE_LEVEL_GC;
+        gc_start_opts(&gc, bos, &opts);
+        bench_gc = &gc;
+    }
+    bench_allocs = 0;
+    bench_bytes = 0;
+    npauses = 0;
+    pause_begin = 0;
+    rng_state = 0x9e3779b97f4a7c15u;
+    uint64_t start = now_ns();
+    w->run(a, scale);
+    double seconds = (double) (now_ns() - start) / 1e9;
+    GcStats stats;
+    memset(&stats, 0, sizeof(stats));
+    if (a == &gc_allocator) {
+        collect_pauses(&gc);
+        gc_get_stats(&gc, &stats);
+        gc_stop(&gc);
+        qsort(pauses, npauses, sizeof(uint64_t), compare_u64);
+    }
+    printf("{\"workload\":\"%s\",\"allocator\":\"%s\",\"scale\":%zu,\"seconds\":%.6f,"
+           "\"allocs\":%zu,\"bytes\":%zu,\"allocs_per_sec\":%.0f,\"mb_per_sec\":%.2f,"
+           "\"collections\":%zu,\"pause_p50_us\":%.3f,\"pause_p99_us\":%.3f,\"pause_max_us\":%.3f,"
+           "\"trace_dropped\":%llu}\n",
+           w->name, a->name, scale, seconds, bench_allocs, bench_bytes,
+           (double) bench_allocs / seconds, (double) bench_bytes / seconds / (1 << 20),
+           stats.collections, percentile_us(0.5), percentile_us(0.99),
+           npauses ? (double) pauses[npauses - 1] / 1e3 : 0.0,
+           (unsigned long long) stats.trace_dropped);
+    fflush(stdout);
+}
+
+int main(int argc, char** argv) {
+    void* bos = __builtin_frame_address(0);
+    size_t scale = argc > 1 ? (size_t) strtoul(argv[1], NULL, 10) : 1;
+    scale = scale ? scale : 1;
+    for (size_t i = 0; i < sizeof(workloads) / sizeof(*workloads); ++i) {
+        bool selected = argc <= 2;
+        for (int j = 2; j < argc; ++j) {
+            selected |= strcmp(argv[j], workloads[i].name) == 0;
+        }
+        if (selected) {
+            run(&workloads[i], &gc_allocator, scale, bos);
+            run(&workloads[i], &libc_allocator, scale, bos);
+        }
+    }
+    free(pauses);
+    return 0;
+}
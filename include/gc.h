@@ -7,31 +7,444 @@
 
 #define GC_TAG_NONE 0x0
 #define GC_TAG_ROOT 0x1
-#define GC_TAG_MARK 0x2
+#define GC_TAG_OLD 0x4
+#define GC_TAG_SAMPLED 0x8
+
+/*
+ * Conservative scanning strides. By default only pointer-aligned words are
+ * considered as candidate pointers; byte-granular scanning is kept for
+ * programs that store pointers at unaligned offsets.
+ */
+#define GC_SCAN_STRIDE_ALIGNED sizeof(void*)
+#define GC_SCAN_STRIDE_BYTES 1
+
+/*
+ * When destructors of dead objects run. Inline finalization runs them
+ * during the sweep. Deferred finalization queues them for
+ * gc_run_finalizers, and threaded finalization runs them on a dedicated
+ * finalizer thread.
+ */
+#define GC_FINALIZE_INLINE 0
+#define GC_FINALIZE_DEFERRED 1
+#define GC_FINALIZE_THREAD 2
+
+/*
+ * Pointer layout of a typed allocation. Bit i of the bitmap (bit i % w of
+ * bitmap[i / w], w being the bits of a uintptr_t) is set if the i-th
+ * pointer-sized word may hold a pointer. Objects larger than the layout
+ * are arrays of it, the layout repeats every `words` words. Layouts are
+ * not copied and have to outlive the objects using them. A layout of zero
+ * words describes pointer-free data.
+ */
+typedef struct GcLayout {
+    size_t words;                 // pointer-sized words covered by the bitmap
+    const uintptr_t* bitmap;      // words that may hold pointers
+} GcLayout;
+
+#define GC_LAYOUT_WORD(type, field) (offsetof(type, field) / sizeof(void*))
+#define GC_LAYOUT_WORDS(type) ((sizeof(type) + sizeof(void*) - 1) / sizeof(void*))
+
+/*
+ * Tracing. At GC_TRACE_LEVEL_GC the collector records collections, their
+ * phases and allocation map resizes as GcTraceEvents; GC_TRACE_LEVEL_ALL
+ * adds every allocation, free and swept page. Events go to per-thread
+ * rings without locking and are taken out with gc_trace_drain, or written
+ * to a file with gc_trace_write for the gc_trace_dump tool. A full ring
+ * drops new events (counted in GcStats.trace_dropped) rather than
+ * blocking. The arguments of an event are:
+ *
+ *   GC_EVENT_ALLOC, GC_EVENT_FREE   a = address, b = size
+ *   GC_EVENT_BEGIN                  a = 1 if minor, b = bytes in use
+ *   GC_EVENT_END                    a = bytes freed (0 if swept lazily), b = bytes in use
+ *   GC_EVENT_PHASE                  a = GC_PHASE_*, b = duration in nanoseconds
+ *   GC_EVENT_RESIZE                 a = old map capacity, b = new map capacity
+ */
+#define GC_TRACE_LEVEL_OFF 0
+#define GC_TRACE_LEVEL_GC 1
+#define GC_TRACE_LEVEL_ALL 2
+
+#define GC_EVENT_ALLOC 1
+#define GC_EVENT_FREE 2
+#define GC_EVENT_BEGIN 3
+#define GC_EVENT_END 4
+#define GC_EVENT_PHASE 5
+#define GC_EVENT_RESIZE 6
+
+#define GC_PHASE_STACK 0
+#define GC_PHASE_ROOTS 1
+#define GC_PHASE_MARK 2
+#define GC_PHASE_SWEEP 3
+#define GC_PHASE_RESIZE 4
+
+typedef struct GcTraceEvent {
+    uint64_t time_ns;             // monotonic clock at the end of the event
+    uint32_t thread;              // number of the emitting thread
+    uint16_t type;                // GC_EVENT_*
+    uint16_t reserved;
+    uint64_t a;                   // event arguments, see above
+    uint64_t b;
+} GcTraceEvent;
+
+#define GC_TRACE_MAGIC "GCTRACE1"
+
+/*
+ * Allocation recording. While gc_record_start is in effect, every
+ * allocation, reallocation, free and gc_run/gc_run_minor call is streamed
+ * to a file as a GcRecordEvent, together with the deaths of objects the
+ * collector reclaims and the pointer stores the program reports through
+ * gc_write_barrier. The gc_replay tool runs such a record against a fresh
+ * collector. Each event is stored as a type byte followed by varints and
+ * read back with gc_record_decode. The fields of an event are:
+ *
+ *   GC_RECORD_ALLOC      addr, a = size, b = GC_RECORD_ALLOC_* flags
+ *   GC_RECORD_REALLOC    addr = old address, a = new address, b = size
+ *   GC_RECORD_FREE       addr, freed by gc_free
+ *   GC_RECORD_DEATH      addr, reclaimed by the collector
+ *   GC_RECORD_EDGE       addr + a holds a pointer into the object at b
+ *   GC_RECORD_CLEAR      addr + a holds no heap pointer
+ *   GC_RECORD_RUN        a = 1 if minor
+ */
+#define GC_RECORD_ALLOC 1
+#define GC_RECORD_REALLOC 2
+#define GC_RECORD_FREE 3
+#define GC_RECORD_DEATH 4
+#define GC_RECORD_EDGE 5
+#define GC_RECORD_CLEAR 6
+#define GC_RECORD_RUN 7
+
+#define GC_RECORD_ALLOC_CALLOC 0x1
+#define GC_RECORD_ALLOC_ATOMIC 0x2
+#define GC_RECORD_ALLOC_TYPED 0x4
+#define GC_RECORD_ALLOC_DTOR 0x8
+#define GC_RECORD_ALLOC_STATIC 0x10
+
+typedef struct GcRecordEvent {
+    uint8_t type;                 // GC_RECORD_*
+    uint64_t addr;                // event arguments, see above
+    uint64_t a;
+    uint64_t b;
+} GcRecordEvent;
+
+#define GC_RECORD_MAGIC "GCRECRD1"
+
+/*
+ * Heap dumps, see gc_heap_dump. A dump is a GcDumpHeader followed by two
+ * arrays at the file offsets the header gives: one GcDumpObject for every
+ * allocation, in no particular order, and the references of all objects,
+ * the start addresses of the objects they point into. The references of
+ * an object are refs[obj.refs] to refs[obj.refs + obj.nrefs - 1]. All
+ * fields are in native byte order and 8-byte aligned, so a dump can be
+ * mapped and used in place.
+ */
+#define GC_DUMP_MAGIC "GCHEAP01"
+
+#define GC_DUMP_ROOT 0x1          // referenced from a stack, register, root range or static object
+#define GC_DUMP_ATOMIC 0x2        // allocated without pointers, has no references
+#define GC_DUMP_TYPED 0x4         // references found through its layout
+
+typedef struct GcDumpHeader {
+    char magic[8];                // GC_DUMP_MAGIC
+    uint64_t nobjects;            // entries of the object array
+    uint64_t nrefs;               // entries of the reference array
+    uint64_t objects;             // file offset of the object array
+    uint64_t refs;                // file offset of the reference array
+    uint64_t heap_used;           // bytes in slots and blocks handed out
+    uint64_t heap_committed;      // bytes obtained from the system
+} GcDumpHeader;
+
+typedef struct GcDumpObject {
+    uint64_t addr;                // start of the object
+    uint64_t size;                // requested size in bytes
+    uint64_t dtor;                // address of the destructor, 0 for none
+    uint64_t refs;                // index of the first reference
+    uint64_t nrefs;               // number of references
+    uint8_t tag;                  // GC_TAG_* bits
+    uint8_t flags;                // GC_DUMP_* bits
+    uint8_t reserved[6];
+} GcDumpObject;
+
+/*
+ * Collector statistics, see gc_get_stats. Times are in nanoseconds and
+ * cumulative since gc_start unless noted otherwise. A pause is a call
+ * that collects on behalf of the program: a full or minor collection, a
+ * gc_step or an allocation assisting an incremental mark. Bucket i of the
+ * pause histogram counts pauses of less than 2^i microseconds that did
+ * not fit a lower bucket; the last bucket takes all longer ones.
+ */
+#define GC_STATS_PAUSE_BUCKETS 24
+#define GC_STATS_PROBE_BUCKETS 16
+
+typedef struct GcStats {
+    size_t collections;           // completed marks, major and minor
+    size_t minor_collections;     // completed minor marks
+    size_t pauses;                // pauses recorded in the histogram
+    uint64_t pause_total_ns;      // time spent in pauses
+    uint64_t pause_max_ns;        // longest pause
+    uint64_t pause_histogram[GC_STATS_PAUSE_BUCKETS]; // pauses by duration
+    uint64_t roots_ns;            // scanning roots, root ranges and cards
+    uint64_t stack_ns;            // scanning stacks and registers
+    uint64_t mark_ns;             // tracing the heap
+    uint64_t sweep_ns;            // sweeping, eager or lazy
+    uint64_t resize_ns;           // resizing the allocation map after sweeps
+    size_t allocated_bytes;       // bytes allocated since gc_start
+    size_t allocated_objects;     // objects allocated since gc_start
+    size_t freed_bytes;           // bytes reclaimed by sweeps
+    size_t freed_objects;         // objects reclaimed by sweeps
+    /* Filled in by gc_get_stats */
+    size_t live_bytes;            // bytes in use, not yet known to be dead
+    size_t live_objects;          // objects in the allocation map
+    double allocation_rate;       // bytes allocated per second since gc_start
+    double map_load;              // allocation map load factor
+    size_t map_probes[GC_STATS_PROBE_BUCKETS]; // map entries by distance from their home slot
+    size_t map_max_probe;         // longest distance from the home slot
+    uint64_t trace_dropped;       // trace events lost to full rings
+} GcStats;
 
 struct AllocationMap;
+struct Heap;
+struct Worklist;
+struct MarkPool;
+struct FinalizerQueue;
+struct ThreadRegistry;
+struct RootSet;
+struct RootRanges;
+struct Pacer;
+struct Tracer;
+struct Recorder;
+struct Profiler;
 
 typedef struct GarbageCollector {
     struct AllocationMap* allocs; // allocation map
+    struct Heap* heap;            // size-class heap backing all allocations
+    struct Worklist* worklist;    // explicit mark stack
+    struct MarkPool* mark_pool;   // parallel mark workers, NULL when marking serially
+    struct FinalizerQueue* finalizers; // deferred destructors, NULL when finalizing inline
+    struct ThreadRegistry* threads; // registered mutator threads and the collector lock
+    struct Pacer* pacer;          // heap goal that triggers the next collection
+    struct RootSet* roots;        // objects made static, tagged GC_TAG_ROOT
+    struct RootRanges* root_ranges; // memory outside the heap scanned for pointers
+    bool scan_data_segments;      // data and BSS segments are root ranges
     bool paused;                  // (temporarily) switch gc on/off
     void *bos;                    // bottom of stack
     size_t min_size;
+    size_t scan_stride;           // distance between candidate pointers
+    bool lazy_sweep;              // reclaim dead objects on demand after marking
+    bool thread_cache;            // registered threads allocate from thread caches
+    bool generational;            // collect the young generation separately
+    unsigned int promote_age;     // survived collections before promotion
+    bool minor;                   // the current collection is minor
+    size_t old_bytes;             // bytes in the old generation
+    size_t major_limit;           // old generation size that triggers a major collection
+    double sweep_factor;          // map load that triggers a collection, 0 to pace by bytes
+    bool incremental;             // mark in slices instead of stopping for a full collection
+    bool marking;                 // an incremental mark is in progress
+    size_t swept_objects;         // objects freed by the current or last sweep
+    size_t swept_bytes;           // bytes freed by the current or last sweep
+    GcStats stats;                // counters behind gc_get_stats
+    int trace_level;              // GC_TRACE_LEVEL_*
+    struct Tracer* tracer;        // per-thread trace rings
+    uint64_t start_ns;            // when the collector was started
+    struct Recorder* recorder;    // allocation record, NULL until recording starts
+    struct Profiler* profiler;    // sampled allocation sites, NULL until profiling starts
 } GarbageCollector;
 
+typedef struct GarbageCollectorOptions {
+    size_t initial_capacity;      // initial allocation map capacity
+    size_t min_capacity;          // allocation map never shrinks below this
+    double downsize_load_factor;  // shrink the map below this load factor
+    double upsize_load_factor;    // grow the map above this load factor
+    double heap_growth;           // collect once the heap grew by this factor over the live bytes
+    size_t min_heap;              // heap size below which collections are not triggered
+    double gc_cpu_fraction;       // target share of time spent collecting, 0 for none
+    size_t scan_stride;           // GC_SCAN_STRIDE_ALIGNED or GC_SCAN_STRIDE_BYTES
+    size_t mark_stack_limit;      // max queued objects before rescanning, 0 for no limit
+    size_t mark_threads;          // threads marking in parallel, 1 marks serially
+    bool lazy_sweep;              // sweep pages as the allocator needs them
+    int finalizer_mode;           // GC_FINALIZE_INLINE, _DEFERRED or _THREAD
+    bool thread_cache;            // lock-free gc_malloc/gc_calloc from per-thread caches
+    bool generational;            // minor collections of young objects
+    unsigned int promote_age;     // collections an object survives before it gets old
+    bool incremental;             // incremental marking driven by gc_step and allocation
+    size_t large_object_threshold; // objects above this size are mapped from the system
+    bool scan_data_segments;      // scan the data and BSS segments of all loaded objects
+    int trace_level;              // GC_TRACE_LEVEL_* to start with
+    size_t profile_interval;      // mean bytes between sampled allocations, 0 disables profiling
+} GarbageCollectorOptions;
+
 extern GarbageCollector gc;  // Global garbage collector for all
                             // single-threaded applications
 
 /*
- * Starting, stopping, pausing, resuming and running the GC.
+ * Starting, stopping, pausing, resuming and running the GC. The start
+ * functions return false, with errno set to ENOMEM, if the collector could
+ * not be set up; gc must not be used or stopped then.
  */
-void gc_start(GarbageCollector* gc, void* bos);
-void gc_start_ext(GarbageCollector* gc, void* bos, size_t initial_size, size_t min_size,
+void gc_options_init(GarbageCollectorOptions* opts);
+bool gc_start(GarbageCollector* gc, void* bos);
+bool gc_start_opts(GarbageCollector* gc, void* bos, const GarbageCollectorOptions* opts);
+bool gc_start_ext(GarbageCollector* gc, void* bos, size_t initial_size, size_t min_size,
                   double downsize_load_factor, double upsize_load_factor, double sweep_factor);
 size_t gc_stop(GarbageCollector* gc);
 void gc_pause(GarbageCollector* gc);
 void gc_resume(GarbageCollector* gc);
 size_t gc_run(GarbageCollector* gc);
 
+/*
+ * Collections are paced by heap bytes. Once a cycle has completed, the
+ * next one starts when the bytes in use exceed those that survived it by
+ * the heap_growth factor (1.0 by default, as GOGC=100), but not before
+ * min_heap bytes are in use. With gc_cpu_fraction set, the goal is raised
+ * further whenever collecting took more than that share of the time.
+ *
+ * gc_start_ext does not pace by bytes: it collects whenever the allocation
+ * map is filled beyond sweep_factor (0.5 if not positive).
+ */
+
+/*
+ * Roots besides the stacks and registers. gc_add_root_range registers
+ * [start, start + len) to be scanned for pointers on every collection,
+ * until it is removed again with the same arguments. With
+ * scan_data_segments, the writable data segments (globals, .data and
+ * .bss) of the executable and all shared libraries are scanned as well
+ * (Linux only). Objects referenced from globals then do not have to be
+ * made static.
+ */
+bool gc_add_root_range(GarbageCollector* gc, void* start, size_t len);
+void gc_remove_root_range(GarbageCollector* gc, void* start, size_t len);
+
+/*
+ * In generational mode, objects are promoted to the old generation after
+ * surviving promote_age collections. Collections triggered by allocation
+ * are minor: they only trace and reclaim young objects, until the old
+ * generation has doubled since the last major collection. gc_run always
+ * runs a major collection, gc_run_minor a minor one.
+ *
+ * Minor collections find pointers from old to young objects through a
+ * card table, so every store of a pointer into a heap object has to be
+ * followed by gc_write_barrier(gc, obj, &obj->field) in this mode.
+ */
+size_t gc_run_minor(GarbageCollector* gc);
+void gc_write_barrier(GarbageCollector* gc, void* obj, void* field);
+
+/*
+ * In incremental mode, collections triggered by allocation only queue the
+ * roots. The mark advances by a few objects on every allocation and by
+ * gc_step(gc, budget_ns), which marks for about budget_ns nanoseconds and
+ * then sweeps lazily with what is left. When nothing is pending, gc_step
+ * starts a new cycle. It returns true while the cycle has work left.
+ *
+ * Stores into heap objects during the mark have to be followed by
+ * gc_write_barrier, as in generational mode. The stacks are scanned once
+ * more with the world stopped when marking finishes.
+ */
+bool gc_step(GarbageCollector* gc, uint64_t budget_ns);
+
+/*
+ * Threads other than the one that started the collector have to register
+ * before they use it and unregister before they exit. bos is the bottom of
+ * the thread's stack, as for gc_start. Only the stacks and registers of
+ * registered threads are scanned; collections stop all of them while
+ * marking.
+ *
+ * With thread caches, gc_malloc and gc_calloc of small objects take a
+ * thread's cached free slots without locking. Such objects are published
+ * to the collector when the thread refills its cache or calls gc_free,
+ * gc_realloc or gc_make_static, and are always treated as live until
+ * then. Only the allocating thread may free or reallocate them before
+ * they are published.
+ */
+bool gc_register_thread(GarbageCollector* gc, void* bos);
+void gc_unregister_thread(GarbageCollector* gc);
+
+/*
+ * With lazy sweeping, gc_run only marks and dead objects are reclaimed as
+ * allocations need their space. gc_sweep_step sweeps up to budget pages
+ * and returns true while pages are left, so idle loops can finish the work.
+ */
+bool gc_sweep_step(GarbageCollector* gc, size_t budget);
+
+/*
+ * With deferred or threaded finalization, the sweep only unlinks dead
+ * objects that have a destructor. Their memory goes back to the heap once
+ * the destructor has completed, at the next allocation, collection or
+ * gc_run_finalizers call, never earlier. gc_run_finalizers runs all
+ * queued destructors on the calling thread and returns their number;
+ * gc_stop runs any that are left. Destructors on the finalizer thread run
+ * concurrently with the program and must not call into the collector.
+ */
+size_t gc_run_finalizers(GarbageCollector* gc);
+
+/*
+ * Copies the collector statistics into stats. The counters are kept on
+ * every collection; the map statistics walk the allocation map, so this
+ * is meant to be polled, not called in a tight loop.
+ */
+void gc_get_stats(GarbageCollector* gc, GcStats* stats);
+
+/*
+ * gc_set_trace_level changes what is traced at runtime. gc_trace_drain
+ * moves up to max events into events and returns their number, events
+ * of one thread in order. gc_trace_write drains all events into the file
+ * descriptor fd, after the GC_TRACE_MAGIC header if the file is empty,
+ * and returns the number of events written.
+ */
+void gc_set_trace_level(GarbageCollector* gc, int level);
+size_t gc_trace_drain(GarbageCollector* gc, GcTraceEvent* events, size_t max);
+size_t gc_trace_write(GarbageCollector* gc, int fd);
+
+/*
+ * gc_record_start writes the GC_RECORD_MAGIC header to fd and records
+ * from then on, until gc_record_stop flushes the record and returns the
+ * number of events in it; gc_stop flushes an open record as well. Events
+ * of all threads are serialized through a lock, so recording is meant
+ * for capturing workloads, not for production runs. gc_record_decode
+ * decodes the event at the start of data and returns its size, or 0 at
+ * the end of the record; last is the previous address, 0 before the
+ * first event.
+ */
+bool gc_record_start(GarbageCollector* gc, int fd);
+uint64_t gc_record_stop(GarbageCollector* gc);
+size_t gc_record_decode(const void* data, size_t len, uintptr_t* last, GcRecordEvent* event);
+
+/*
+ * gc_heap_dump writes a heap dump to fd, which has to be a regular file.
+ * It finishes a pending sweep, so the dump holds what survived the last
+ * collection plus what was allocated since, and drops an incremental
+ * mark in progress. References are found by the scan the mark uses,
+ * conservatively or through the layout. Objects are streamed to the file
+ * as they are scanned, so dumping needs no memory in proportion to the
+ * heap; other registered threads stay stopped until all of them are
+ * written. Allocations still pending in other threads' caches are not
+ * included. Returns false if the file could not be written. The
+ * gc_heap_analyze tool computes dominators and retained sizes.
+ */
+bool gc_heap_dump(GarbageCollector* gc, int fd);
+
+/*
+ * Heap profiles, as written by gc_profile_write. Folded stacks are one
+ * line per allocation site, outermost frame first and separated by ';',
+ * followed by the estimated bytes in use, as flamegraph.pl reads them.
+ * GC_PROFILE_PPROF is the legacy heap_v2 text format pprof reads with the
+ * executable to symbolize it.
+ */
+#define GC_PROFILE_FOLDED 0
+#define GC_PROFILE_PPROF 1
+
+/*
+ * Sampling heap profiler. With an interval set, allocations are sampled
+ * on average once every that many bytes and the backtrace of each sample
+ * is kept with it until it is freed or swept, along with whether it ever
+ * survived a collection. Allocations that are not sampled only count down
+ * a counter, so with an interval of 512 KiB, as tcmalloc samples, the
+ * overhead stays well below 1%. gc_set_profile_interval starts profiling, or
+ * stops it with 0, keeping the samples taken so far. gc_profile_write
+ * writes the sites of the samples in use in a GC_PROFILE_* format and
+ * returns false if fd could not be written or profiling never started.
+ * The innermost frames of every site are the collector's own.
+ */
+void gc_set_profile_interval(GarbageCollector* gc, size_t bytes);
+bool gc_profile_write(GarbageCollector* gc, int fd, int format);
+
 /*
  * Allocating and deallocating memory.
  */
@@ -44,9 +457,20 @@ void* gc_realloc(GarbageCollector* gc, void* ptr, size_t size);
 void gc_free(GarbageCollector* gc, void* ptr);
 
 /*
- * Lifecycle management
+ * Typed allocations are only scanned where their layout has pointers, and
+ * atomic ones (pointer-free data such as strings or pixel buffers) are not
+ * scanned at all. Reallocating keeps the layout. gc_strdup allocates
+ * atomic strings.
+ */
+void* gc_malloc_typed(GarbageCollector* gc, size_t size, const GcLayout* layout);
+void* gc_malloc_atomic(GarbageCollector* gc, size_t size);
+
+/*
+ * Lifecycle management. Static objects are live until gc_unmake_static
+ * or gc_free, whether or not they are referenced.
  */
 void* gc_make_static(GarbageCollector* gc, void* ptr);
+void gc_unmake_static(GarbageCollector* gc, void* ptr);
 
 /*
  * Helper functions and stdlib replacements.
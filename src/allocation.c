@@ -8,8 +8,10 @@ Allocation* gc_allocation_new(void* ptr, size_t size, void (*dtor)(void*)) {
     a->ptr = ptr;
     a->size = size;
     a->tag = GC_TAG_NONE;
+    a->age = 0;
+    a->probe = 0;
     a->dtor = dtor;
-    a->next = NULL;
+    a->layout = NULL;
     return a;
 }
 
@@ -2,12 +2,17 @@
 #define ALLOCATION_H
 
 #include <stddef.h>
+
+struct GcLayout;
+
 typedef struct Allocation {
     void* ptr;                // mem pointer
     size_t size;              // allocated size in bytes
     char tag;                 // the tag for mark-and-sweep
+    unsigned char age;        // collections survived while young
+    unsigned int probe;       // distance from the home slot in the allocation map
     void (*dtor)(void*);      // destructor
-    struct Allocation* next;  // separate chaining
+    const struct GcLayout* layout; // pointer layout, NULL to scan conservatively
 } Allocation;
 
 Allocation* gc_allocation_new(void* ptr, size_t size, void (*dtor)(void*));
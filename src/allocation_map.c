@@ -4,25 +4,13 @@
 #include <stdlib.h>
 #include "allocation.h"
 #include "allocation_map.h"
+#include "gc.h"
 #include "log.h"
 
-bool is_prime(size_t n) {
-    if (n <= 3)
-        return n > 1;
-    else if (n % 2==0 || n % 3==0)
-        return false;
-    else {
-        for (size_t i=5; i*i<=n; i+=6) {
-            if (n % i == 0 || n%(i + 2) == 0)
-                return false;
-        }
-        return true;
-    }
-}
-
-size_t next_prime(size_t n) {
-    while (!is_prime(n)) ++n;
-    return n;
+size_t next_pow2(size_t n) {
+    size_t p = 1;
+    while (p < n) p <<= 1;
+    return p;
 }
 
 double gc_allocation_map_load_factor(AllocationMap* am) {
@@ -31,139 +19,157 @@ double gc_allocation_map_load_factor(AllocationMap* am) {
 
 AllocationMap* gc_allocation_map_new(size_t min_capacity,
         size_t capacity,
-        double sweep_factor,
         double downsize_factor,
         double upsize_factor) {
     AllocationMap* am = (AllocationMap*) malloc(sizeof(AllocationMap));
-    am->min_capacity = next_prime(min_capacity);
-    am->capacity = next_prime(capacity);
+    if (!am) {
+        return NULL;
+    }
+    am->min_capacity = next_pow2(min_capacity);
+    am->capacity = next_pow2(capacity);
     if (am->capacity < am->min_capacity) am->capacity = am->min_capacity;
-    am->sweep_factor = sweep_factor;
-    am->sweep_limit = (int) (sweep_factor * am->capacity);
     am->downsize_factor = downsize_factor;
     am->upsize_factor = upsize_factor;
-    am->allocs = (Allocation**) calloc(am->capacity, sizeof(Allocation*));
+    am->allocs = (Allocation*) calloc(am->capacity, sizeof(Allocation));
+    if (!am->allocs) {
+        free(am);
+        return NULL;
+    }
     am->size = 0;
     LOG_DEBUG("Created allocation map (cap=%ld, siz=%ld)", am->capacity, am->size);
     return am;
 }
 
 void gc_allocation_map_delete(AllocationMap* am) {
-    // Iterate over the map
     LOG_DEBUG("Deleting allocation map (cap=%ld, siz=%ld)",
               am->capacity, am->size);
-    Allocation *alloc, *tmp;
-    for (size_t i = 0; i < am->capacity; ++i) {
-        if ((alloc = am->allocs[i])) {
-            // Make sure to follow the chain inside a bucket
-            while (alloc) {
-                tmp = alloc;
-                alloc = alloc->next;
-                // free the management structure
-                gc_allocation_delete(tmp);
-            }
-        }
-    }
     free(am->allocs);
     free(am);
 }
 
+/*
+ * Heap pointers share their low (alignment) and high (region) bits, so mix
+ * all bits into the low ones before masking (murmur3 finalizer).
+ */
 size_t gc_hash(void *ptr) {
-    return ((uintptr_t)ptr) >> 3;
+    uint64_t h = (uint64_t) (uintptr_t) ptr;
+    h ^= h >> 33;
+    h *= 0xff51afd7ed558ccdULL;
+    h ^= h >> 33;
+    return (size_t) h;
+}
+
+/*
+ * Robin Hood insertion of a record that is known not to be in the map.
+ * Returns the slot the record ended up in.
+ */
+static Allocation* gc_allocation_map_insert(Allocation* allocs,
+        size_t capacity,
+        Allocation entry) {
+    size_t mask = capacity - 1;
+    size_t index = gc_hash(entry.ptr) & mask;
+    Allocation* placed = NULL;
+    entry.probe = 0;
+    while (allocs[index].ptr) {
+        if (allocs[index].probe < entry.probe) {
+            // steal the slot from the richer entry and carry on with it
+            Allocation tmp = allocs[index];
+            allocs[index] = entry;
+            entry = tmp;
+            if (!placed) placed = &allocs[index];
+        }
+        index = (index + 1) & mask;
+        entry.probe++;
+    }
+    allocs[index] = entry;
+    return placed ? placed : &allocs[index];
 }
 
 void gc_allocation_map_resize(AllocationMap* am, size_t new_capacity) {
-    if (new_capacity <= am->min_capacity) {
+    if (new_capacity < am->min_capacity ||
+        am->size >= GC_ALLOCATION_MAP_MAX_LOAD * new_capacity) {
         return;
     }
 
     LOG_DEBUG("Resizing allocation map (cap=%ld, siz=%ld) -> (cap=%ld)",
               am->capacity, am->size, new_capacity);
-    Allocation** resized_allocs = calloc(new_capacity, sizeof(Allocation*));
+    Allocation* resized_allocs = calloc(new_capacity, sizeof(Allocation));
+    if (!resized_allocs) {
+        LOG_WARNING("Failed to resize allocation map to cap=%zu", new_capacity);
+        return;
+    }
 
     for (size_t i = 0; i < am->capacity; ++i) {
-        Allocation* alloc = am->allocs[i];
-        while (alloc) {
-            Allocation* next_alloc = alloc->next;
-            size_t new_index = gc_hash(alloc->ptr) % new_capacity;
-            alloc->next = resized_allocs[new_index];
-            resized_allocs[new_index] = alloc;
-            alloc = next_alloc;
+        if (am->allocs[i].ptr) {
+            gc_allocation_map_insert(resized_allocs, new_capacity, am->allocs[i]);
         }
     }
     free(am->allocs);
     am->capacity = new_capacity;
     am->allocs = resized_allocs;
-    am->sweep_limit = am->size + am->sweep_factor * (am->capacity - am->size);
 }
 
 bool gc_allocation_map_resize_to_fit(AllocationMap* am) {
     double load_factor = gc_allocation_map_load_factor(am);
-    if (load_factor > am->upsize_factor) {
+    /* Open addressing needs free slots, so grow at the maximum load no
+     * matter what the configured upsize factor says. */
+    if (load_factor > am->upsize_factor || load_factor >= GC_ALLOCATION_MAP_MAX_LOAD) {
         LOG_DEBUG("Load factor %0.3g > %0.3g. Triggering upsize.",
                   load_factor, am->upsize_factor);
-        gc_allocation_map_resize(am, next_prime(am->capacity * 2));
+        gc_allocation_map_resize(am, am->capacity * 2);
         return true;
     }
     if (load_factor < am->downsize_factor) {
         LOG_DEBUG("Load factor %0.3g < %0.3g. Triggering downsize.",
                   load_factor, am->downsize_factor);
-        gc_allocation_map_resize(am, next_prime(am->capacity / 2));
+        gc_allocation_map_resize(am, am->capacity / 2);
         return true;
     }
     return false;
 }
 
 Allocation* gc_allocation_map_get(AllocationMap* am, void* ptr) {
-    size_t index = gc_hash(ptr) % am->capacity;
-    Allocation* cur = am->allocs[index];
-    while(cur) {
+    size_t mask = am->capacity - 1;
+    size_t index = gc_hash(ptr) & mask;
+    for (unsigned int probe = 0; ; ++probe) {
+        Allocation* cur = &am->allocs[index];
+        if (!cur->ptr || cur->probe < probe) {
+            // an empty slot or a richer entry ends the probe sequence
+            return NULL;
+        }
         if (cur->ptr == ptr) {
             return cur;
         }
-        cur = cur->next;
+        index = (index + 1) & mask;
     }
-    return NULL;
 }
 
 Allocation* gc_allocation_map_put(AllocationMap* am,
         void* ptr,
         size_t size,
         void (*dtor)(void*)) {
-    size_t index = gc_hash(ptr) % am->capacity;
-    LOG_DEBUG("PUT request for allocation ix=%ld", index);
-    Allocation* alloc = gc_allocation_new(ptr, size, dtor);
-    Allocation* cur = am->allocs[index];
-    Allocation* prev = NULL;
+    Allocation* alloc = gc_allocation_map_get(am, ptr);
     /* Upsert if ptr is already known (e.g. dtor update). */
-    while(cur != NULL) {
-        if (cur->ptr == ptr) {
-            // found it
-            alloc->next = cur->next;
-            if (!prev) {
-                // position 0
-                am->allocs[index] = alloc;
-            } else {
-                // in the list
-                prev->next = alloc;
-            }
-            gc_allocation_delete(cur);
-            LOG_DEBUG("AllocationMap Upsert at ix=%ld", index);
-            return alloc;
-
-        }
-        prev = cur;
-        cur = cur->next;
+    if (alloc) {
+        alloc->size = size;
+        alloc->tag = GC_TAG_NONE;
+        alloc->age = 0;
+        alloc->dtor = dtor;
+        alloc->layout = NULL;
+        LOG_DEBUG("AllocationMap Upsert at ix=%ld", alloc - am->allocs);
+        return alloc;
     }
-    cur = am->allocs[index];
-    alloc->next = cur;
-    am->allocs[index] = alloc;
+    /* Make room first so the new record stays where it is put */
     am->size++;
-    LOG_DEBUG("AllocationMap insert at ix=%ld", index);
-    void* p = alloc->ptr;
-    if (gc_allocation_map_resize_to_fit(am)) {
-        alloc = gc_allocation_map_get(am, p);
+    gc_allocation_map_resize_to_fit(am);
+    if (am->size >= am->capacity) {
+        // could not grow and there would be no empty slot left
+        am->size--;
+        return NULL;
     }
+    Allocation entry = { .ptr = ptr, .size = size, .tag = GC_TAG_NONE, .age = 0, .dtor = dtor };
+    alloc = gc_allocation_map_insert(am->allocs, am->capacity, entry);
+    LOG_DEBUG("AllocationMap insert at ix=%ld", alloc - am->allocs);
     return alloc;
 }
 
@@ -171,30 +177,34 @@ void gc_allocation_map_remove(AllocationMap* am,
                                      void* ptr,
                                      bool allow_resize) {
     // ignores unknown keys
-    size_t index = gc_hash(ptr) % am->capacity;
-    Allocation* cur = am->allocs[index];
-    Allocation* prev = NULL;
-    Allocation* next;
-    while(cur != NULL) {
-        next = cur->next;
-        if (cur->ptr == ptr) {
-            // found it
-            if (!prev) {
-                // first item in list
-                am->allocs[index] = cur->next;
-            } else {
-                // not the first item in the list
-                prev->next = cur->next;
-            }
-            gc_allocation_delete(cur);
-            am->size--;
-        } else {
-            // move on
-            prev = cur;
-        }
-        cur = next;
+    Allocation* cur = gc_allocation_map_get(am, ptr);
+    if (!cur) {
+        return;
     }
+    gc_allocation_map_remove_at(am, cur);
     if (allow_resize) {
         gc_allocation_map_resize_to_fit(am);
     }
 }
+
+/*
+ * Removes a record found by gc_allocation_map_get without hashing its
+ * pointer again, and never resizes. The sweeper unlinks dead records this
+ * way and makes a single resize decision once the cycle is done.
+ */
+void gc_allocation_map_remove_at(AllocationMap* am, Allocation* alloc) {
+    /* Backward shift deletion: pull the following entries of the probe
+     * sequence one slot closer to their home slot. */
+    size_t mask = am->capacity - 1;
+    size_t index = alloc - am->allocs;
+    size_t next = (index + 1) & mask;
+    while (am->allocs[next].ptr && am->allocs[next].probe > 0) {
+        am->allocs[index] = am->allocs[next];
+        am->allocs[index].probe--;
+        index = next;
+        next = (next + 1) & mask;
+    }
+    am->allocs[index].ptr = NULL;
+    am->allocs[index].probe = 0;
+    am->size--;
+}
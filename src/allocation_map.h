@@ -5,24 +5,31 @@
 #include <stdbool.h>
 #include <stddef.h>
 
+/*
+ * Open-addressing hash map from pointers to their allocation records. The
+ * records are stored inline and placed by Robin Hood probing, so a lookup
+ * walks a short run of adjacent slots. Slots with a NULL ptr are empty.
+ *
+ * Pointers to records are only valid until the next put or remove, since
+ * both may move records around.
+ */
+#define GC_ALLOCATION_MAP_MAX_LOAD 0.9
+
 typedef struct AllocationMap {
     size_t capacity;
     size_t min_capacity;
     double downsize_factor;
     double upsize_factor;
-    double sweep_factor;
-    size_t sweep_limit;
     size_t size;
-    Allocation** allocs;
+    Allocation* allocs;
 } AllocationMap;
 
-
+size_t next_pow2(size_t n);
 
 double gc_allocation_map_load_factor(AllocationMap* am);
 
 AllocationMap* gc_allocation_map_new(size_t min_capacity,
     size_t capacity,
-    double sweep_factor,
     double downsize_factor,
     double upsize_factor);
 
@@ -43,4 +50,6 @@ void gc_allocation_map_remove(AllocationMap* am,
     void* ptr,
     bool allow_resize);
 
+void gc_allocation_map_remove_at(AllocationMap* am, Allocation* alloc);
+
 #endif
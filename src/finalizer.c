@@ -0,0 +1,148 @@
+#include <pthread.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include "finalizer.h"
+#include "log.h"
+
+/*
+ * Runs the destructor of one pending object. Returns false if there was
+ * none. Must be called with the lock held; the lock is dropped while the
+ * destructor runs.
+ */
+static bool gc_finalizer_queue_run_one(FinalizerQueue* q) {
+    if (!q->npending) {
+        return false;
+    }
+    Finalizable f = q->pending[--q->npending];
+    pthread_mutex_unlock(&q->lock);
+    LOG_DEBUG("Finalizing %p", f.ptr);
+    f.dtor(f.ptr);
+    pthread_mutex_lock(&q->lock);
+    /* Room was reserved on push, see gc_finalizer_queue_push */
+    q->done[q->ndone] = f.ptr;
+    __atomic_store_n(&q->ndone, q->ndone + 1, __ATOMIC_RELEASE);
+    return true;
+}
+
+static void* gc_finalizer_thread(void* arg) {
+    FinalizerQueue* q = (FinalizerQueue*) arg;
+    pthread_mutex_lock(&q->lock);
+    for (;;) {
+        while (!q->npending && !q->shutdown) {
+            pthread_cond_wait(&q->wake, &q->lock);
+        }
+        /* Drain the queue before honoring a shutdown request */
+        if (!gc_finalizer_queue_run_one(q)) {
+            break;
+        }
+    }
+    pthread_mutex_unlock(&q->lock);
+    return NULL;
+}
+
+FinalizerQueue* gc_finalizer_queue_new(bool threaded) {
+    FinalizerQueue* q = (FinalizerQueue*) calloc(1, sizeof(FinalizerQueue));
+    if (!q) {
+        return NULL;
+    }
+    pthread_mutex_init(&q->lock, NULL);
+    pthread_cond_init(&q->wake, NULL);
+    if (threaded) {
+        if (pthread_create(&q->thread, NULL, gc_finalizer_thread, q) != 0) {
+            LOG_WARNING("Failed to start finalizer thread, finalizing on demand%s", "");
+        } else {
+            q->threaded = true;
+        }
+    }
+    return q;
+}
+
+/*
+ * Stops the finalizer thread once all pending destructors have run.
+ */
+void gc_finalizer_queue_stop(FinalizerQueue* q) {
+    if (!q->threaded) {
+        return;
+    }
+    pthread_mutex_lock(&q->lock);
+    q->shutdown = true;
+    pthread_cond_signal(&q->wake);
+    pthread_mutex_unlock(&q->lock);
+    pthread_join(q->thread, NULL);
+    q->threaded = false;
+}
+
+void gc_finalizer_queue_delete(FinalizerQueue* q) {
+    gc_finalizer_queue_stop(q);
+    pthread_cond_destroy(&q->wake);
+    pthread_mutex_destroy(&q->lock);
+    free(q->pending);
+    free(q->done);
+    free(q);
+}
+
+/*
+ * Queues a dead object for finalization. Returns false if the queue could
+ * not grow, in which case the caller has to finalize the object itself.
+ */
+bool gc_finalizer_queue_push(FinalizerQueue* q, void* ptr, void (*dtor)(void*)) {
+    pthread_mutex_lock(&q->lock);
+    /* Reserve a done slot for every outstanding object, so that finished
+     * destructors never have to allocate */
+    if (q->outstanding == q->capacity) {
+        size_t capacity = q->capacity ? q->capacity * 2 : 64;
+        Finalizable* pending = (Finalizable*) realloc(q->pending, capacity * sizeof(Finalizable));
+        if (pending) {
+            q->pending = pending;
+        }
+        void** done = pending ? (void**) realloc(q->done, capacity * sizeof(void*)) : NULL;
+        if (!done) {
+            pthread_mutex_unlock(&q->lock);
+            return false;
+        }
+        q->done = done;
+        q->capacity = capacity;
+    }
+    q->pending[q->npending].ptr = ptr;
+    q->pending[q->npending].dtor = dtor;
+    q->npending++;
+    q->outstanding++;
+    pthread_cond_signal(&q->wake);
+    pthread_mutex_unlock(&q->lock);
+    return true;
+}
+
+/*
+ * Runs all pending destructors on the calling thread. Returns the number
+ * of objects finalized.
+ */
+size_t gc_finalizer_queue_run(FinalizerQueue* q) {
+    size_t count = 0;
+    pthread_mutex_lock(&q->lock);
+    while (gc_finalizer_queue_run_one(q)) {
+        count++;
+    }
+    pthread_mutex_unlock(&q->lock);
+    return count;
+}
+
+/*
+ * Hands every finalized object to release. Returns the number of objects
+ * reclaimed.
+ */
+size_t gc_finalizer_queue_reclaim(FinalizerQueue* q, void (*release)(void* ctx, void* ptr), void* ctx) {
+    /* Cheap unlocked check first, this runs on every allocation */
+    if (!__atomic_load_n(&q->ndone, __ATOMIC_ACQUIRE)) {
+        return 0;
+    }
+    pthread_mutex_lock(&q->lock);
+    size_t count = q->ndone;
+    for (size_t i = 0; i < count; ++i) {
+        release(ctx, q->done[i]);
+    }
+    __atomic_store_n(&q->ndone, 0, __ATOMIC_RELEASE);
+    q->outstanding -= count;
+    pthread_mutex_unlock(&q->lock);
+    return count;
+}
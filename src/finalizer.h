@@ -0,0 +1,42 @@
+#ifndef FINALIZER_H
+#define FINALIZER_H
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+/*
+ * Queue of dead objects whose destructors have not run yet. The sweeper
+ * pushes objects instead of finalizing them inline; their destructors run
+ * on the finalizer thread (if any) or in gc_finalizer_queue_run. Finalized
+ * objects are collected on a done list until the owner of the heap takes
+ * them back with gc_finalizer_queue_reclaim, since the heap itself is not
+ * shared with the finalizer thread.
+ */
+typedef struct Finalizable {
+    void* ptr;                // dead object
+    void (*dtor)(void*);      // its destructor
+} Finalizable;
+
+typedef struct FinalizerQueue {
+    pthread_mutex_t lock;
+    pthread_cond_t wake;      // signals new work (or shutdown) to the thread
+    Finalizable* pending;     // objects waiting for their destructor
+    size_t npending;
+    void** done;              // finalized objects waiting to be reclaimed
+    size_t ndone;
+    size_t capacity;          // capacity of both pending and done
+    size_t outstanding;       // pushed but not yet reclaimed
+    pthread_t thread;
+    bool threaded;            // a finalizer thread is running
+    bool shutdown;
+} FinalizerQueue;
+
+FinalizerQueue* gc_finalizer_queue_new(bool threaded);
+void gc_finalizer_queue_stop(FinalizerQueue* q);
+void gc_finalizer_queue_delete(FinalizerQueue* q);
+bool gc_finalizer_queue_push(FinalizerQueue* q, void* ptr, void (*dtor)(void*));
+size_t gc_finalizer_queue_run(FinalizerQueue* q);
+size_t gc_finalizer_queue_reclaim(FinalizerQueue* q, void (*release)(void* ctx, void* ptr), void* ctx);
+
+#endif
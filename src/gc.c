@@ -6,17 +6,35 @@
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
+#include <unistd.h>
 #include "allocation.h"
 #include "allocation_map.h"
-
-#undef LOGLEVEL
-#define LOGLEVEL LOGLEVEL_INFO
+#include "finalizer.h"
+#include "heap.h"
+#include "mark_pool.h"
+#include "pacer.h"
+#include "profile.h"
+#include "record.h"
+#include "roots.h"
+#include "thread_registry.h"
+#include "trace.h"
+#include "worklist.h"
 
 /*
  * The size of a pointer, no matter the architecture (i love C).
  */
 #define PTRSIZE sizeof(char*)
 
+/*
+ * Conservative scanning reads across stack frames and their redzones on
+ * purpose, so keep the address sanitizer out of the scanning loops.
+ */
+#if defined(__GNUC__) || defined(__clang__)
+#define GC_NO_SANITIZE __attribute__((no_sanitize_address))
+#else
+#define GC_NO_SANITIZE
+#endif
+
 static void** allocated_blocks = NULL;
 static size_t allocated_count = 0;
 
@@ -31,288 +49,1961 @@ GarbageCollector gc; // global GC object
 #define __builtin_frame_address(x)  ((void)(x), _AddressOfReturnAddress())
 #endif
 
-static void* gc_mcalloc(size_t count, size_t size) {
-    if (!count) return malloc(size);
-    return calloc(count, size);
+/*
+ * Number of pages swept per allocation while a lazy sweep is pending and
+ * the allocation map is above its sweep limit.
+ */
+#define GC_LAZY_SWEEP_BUDGET 4
+
+/*
+ * Thread caches are refilled with about GC_THREAD_CACHE_BYTES worth of
+ * slots, but never more than GC_THREAD_CACHE_BATCH at a time.
+ */
+#define GC_THREAD_CACHE_BYTES 4096
+#define GC_THREAD_CACHE_BATCH 64
+
+/*
+ * In generational mode, a major collection runs once the old generation
+ * has doubled since the last one, but not before it reaches this size.
+ */
+#define GC_MIN_MAJOR_LIMIT ((size_t) 1 << 20)
+
+/*
+ * Collections are not triggered before the heap reaches this size.
+ */
+#define GC_MIN_HEAP ((size_t) 4 << 20)
+
+/*
+ * While an incremental mark is running, every allocated byte pays for
+ * scanning GC_MARK_ASSIST_RATIO bytes of marked objects, so the mark
+ * finishes before the heap can outgrow it. gc_step looks at the clock
+ * after every GC_STEP_CLOCK_INTERVAL scanned objects.
+ */
+#define GC_MARK_ASSIST_RATIO 4
+#define GC_STEP_CLOCK_INTERVAL 64
+
+/*
+ * Objects are scanned at most GC_MARK_CHUNK bytes at a time, the rest is
+ * queued again. A huge array cannot hold up a mark step or a worker.
+ */
+#define GC_MARK_CHUNK ((size_t) 16 << 10)
+
+static void gc_mark_range_parallel(void* ctx, MarkPool* pool, size_t worker, WorkItem* item);
+
+/*
+ * Layout of objects without any pointers.
+ */
+static const GcLayout gc_layout_atomic = { 0, NULL };
+static void gc_sweep_for(GarbageCollector* gc, size_t size);
+static size_t gc_sweep_finish(GarbageCollector* gc);
+static bool gc_sweep_pages(GarbageCollector* gc, size_t budget);
+static size_t gc_collect(GarbageCollector* gc, bool minor);
+static void gc_mark_begin(GarbageCollector* gc);
+static void gc_mark_assist(GarbageCollector* gc, size_t size);
+
+/*
+ * Every public entry point holds the collector lock. It is recursive, so
+ * destructors and internal calls may re-enter the API.
+ */
+static inline void gc_lock(GarbageCollector* gc) {
+    pthread_mutex_lock(&gc->threads->lock);
+}
+
+static inline void gc_unlock(GarbageCollector* gc) {
+    pthread_mutex_unlock(&gc->threads->lock);
+}
+
+static bool gc_needs_collect(GarbageCollector* gc) {
+    return gc->heap->used >= gc->pacer->goal
+           || (gc->sweep_factor > 0.0
+               && (double) gc->allocs->size > gc->sweep_factor * (double) gc->allocs->capacity);
+}
+
+static bool gc_sweep_pending(GarbageCollector* gc) {
+    return gc->heap->unswept > 0;
+}
+
+/*
+ * Accounts the time since start_ns to a phase and returns the current
+ * time, which may start the next phase.
+ */
+static uint64_t gc_phase_done(GarbageCollector* gc, int phase, uint64_t start_ns) {
+    uint64_t now = gc_pacer_now();
+    uint64_t ns = now - start_ns;
+    switch (phase) {
+    case GC_PHASE_STACK: gc->stats.stack_ns += ns; break;
+    case GC_PHASE_ROOTS: gc->stats.roots_ns += ns; break;
+    case GC_PHASE_MARK: gc->stats.mark_ns += ns; break;
+    case GC_PHASE_SWEEP: gc->stats.sweep_ns += ns; break;
+    default: gc->stats.resize_ns += ns; break;
+    }
+    GC_TRACE_PHASE(gc, phase, ns);
+    return now;
+}
+
+/*
+ * Records a pause that started at start_ns and ends now.
+ */
+static void gc_stats_pause(GarbageCollector* gc, uint64_t start_ns) {
+    uint64_t ns = gc_pacer_now() - start_ns;
+    GcStats* stats = &gc->stats;
+    stats->pauses++;
+    stats->pause_total_ns += ns;
+    if (ns > stats->pause_max_ns) {
+        stats->pause_max_ns = ns;
+    }
+    size_t bucket = 0;
+    for (uint64_t us = ns / 1000; us && bucket < GC_STATS_PAUSE_BUCKETS - 1; us >>= 1) {
+        bucket++;
+    }
+    stats->pause_histogram[bucket]++;
+}
+
+static void gc_sweep_begin(GarbageCollector* gc) {
+    gc->swept_objects = 0;
+    gc->swept_bytes = 0;
+    gc_heap_sweep_begin(gc->heap);
 }
 
-static bool gc_needs_sweep(GarbageCollector* gc) {
-    return gc->allocs->size > gc->allocs->sweep_limit;
+static void gc_release_finalized(void* ctx, void* ptr) {
+    gc_heap_free((Heap*) ctx, ptr);
+}
+
+/*
+ * Returns the memory of objects whose deferred destructors have completed
+ * to the heap.
+ */
+static void gc_reclaim_finalized(GarbageCollector* gc) {
+    if (gc->finalizers) {
+        gc_finalizer_queue_reclaim(gc->finalizers, gc_release_finalized, gc->heap);
+    }
+}
+
+static void gc_maybe_collect(GarbageCollector* gc) {
+    gc_reclaim_finalized(gc);
+    /* Check if the heap reached the pacer's goal and we need to clean up.
+     * A pending lazy sweep is pushed forward before a new cycle is started. */
+    if (gc_needs_collect(gc) && !gc->paused && !gc->marking) {
+        if (gc_sweep_pending(gc)) {
+            bool timed = gc_pacer_clock_start(gc->pacer);
+            gc_sweep_pages(gc, GC_LAZY_SWEEP_BUDGET);
+            gc_pacer_clock_stop(gc->pacer, timed);
+        } else {
+            /* Collect the nursery until the old generation outgrows its limit */
+            bool minor = gc->generational && gc->old_bytes < gc->major_limit;
+            if (!minor && gc->incremental) {
+                /* Allocations advance the mark from here on */
+                bool timed = gc_pacer_clock_start(gc->pacer);
+                gc_mark_begin(gc);
+                gc_pacer_clock_stop(gc->pacer, timed);
+                return;
+            }
+            size_t freed_mem = gc_collect(gc, minor);
+            LOG_DEBUG("Garbage collection cleaned up %lu bytes.", freed_mem);
+        }
+    }
+}
+
+/*
+ * Counts an allocation against a sampling countdown, the thread cache's
+ * or the profiler's own if no cache is given, and records it with the
+ * profiler when it runs out. A cache redraws its countdown the first time
+ * it sees a profiler epoch, so a new cache or a new interval starts at a
+ * random distance rather than at whatever the countdown held before.
+ * Returns whether the allocation is to be tagged GC_TAG_SAMPLED.
+ */
+static inline bool gc_profile_alloc(GarbageCollector* gc, ThreadCache* tc, void* ptr,
+                                    size_t size) {
+    Profiler* prof = __atomic_load_n(&gc->profiler, __ATOMIC_ACQUIRE);
+    if (!prof) {
+        return false;
+    }
+    int64_t* countdown = &prof->countdown;
+    if (tc) {
+        uint32_t epoch = __atomic_load_n(&prof->epoch, __ATOMIC_RELAXED);
+        if (tc->profile_epoch != epoch) {
+            tc->profile_epoch = epoch;
+            tc->profile_countdown = gc_profiler_next(prof);
+        }
+        countdown = &tc->profile_countdown;
+    }
+    if (!gc_profiler_due(prof, countdown, size)) {
+        return false;
+    }
+    *countdown = gc_profiler_next(prof);
+    return gc_profiler_sample(prof, ptr, size);
 }
 
-static void* gc_allocate(GarbageCollector* gc, size_t count, size_t size, void(*dtor)(void*)) {
+static void* gc_allocate(GarbageCollector* gc, size_t count, size_t size, void(*dtor)(void*),
+                         const GcLayout* layout) {
     /* Allocation logic that generalizes over malloc/calloc. */
 
-    /* Check if we reached the high-water mark and need to clean up */
-    if (gc_needs_sweep(gc) && !gc->paused) {
-        size_t freed_mem = gc_run(gc);
-        LOG_DEBUG("Garbage collection cleaned up %lu bytes.", freed_mem);
+    gc_maybe_collect(gc);
+    size_t alloc_size = size;
+    if (count) {
+        if (size && count > SIZE_MAX / size) {
+            errno = ENOMEM;
+            return NULL;
+        }
+        alloc_size = count * size;
     }
-    /* With cleanup out of the way, attempt to allocate memory */
-    void* ptr = gc_mcalloc(count, size);
-    size_t alloc_size = count ? count * size : size;
+    if (gc->marking && !gc->paused) {
+        gc_mark_assist(gc, alloc_size);
+    }
+    /* Reclaim dead objects of the requested size before taking fresh pages */
+    if (gc_sweep_pending(gc)) {
+        gc_sweep_for(gc, alloc_size);
+    }
+    /* With cleanup out of the way, carve the object out of the heap */
+    void* ptr = gc_heap_alloc(gc->heap, alloc_size);
 
     /* If allocation fails, force an out-of-policy run to free some memory and try again. */
     if (!ptr && !gc->paused && (errno == EAGAIN || errno == ENOMEM)) {
-        gc_run(gc);
-        ptr = gc_mcalloc(count, size);
+        gc_collect(gc, false);
+        ptr = gc_heap_alloc(gc->heap, alloc_size);
     }
-    /* Start managing the memory we received from the system */
+    /* Start managing the memory we received from the heap */
     if (ptr) {
         LOG_DEBUG("Allocated %zu bytes at %p", alloc_size, (void*) ptr);
+        /* Slots are recycled, so always hand out zeroed memory. This also
+         * keeps stale pointers from being picked up by the conservative scan.
+         * Mapped blocks are zero already, writing them would commit them. */
+        if (!gc_heap_page_of(ptr)->mapped) {
+            memset(ptr, 0, alloc_size);
+        }
+        size_t capacity = gc->allocs->capacity;
         Allocation* alloc = gc_allocation_map_put(gc->allocs, ptr, alloc_size, dtor);
+        if (gc->allocs->capacity != capacity) {
+            GC_TRACE_RESIZE(gc, capacity, gc->allocs->capacity);
+        }
         /* Deal with metadata allocation failure */
         if (alloc) {
+            GC_TRACE_ALLOC(gc, ptr, alloc_size);
             LOG_DEBUG("Managing %zu bytes at %p", alloc_size, (void*) alloc->ptr);
+            gc->stats.allocated_bytes += alloc_size;
+            gc->stats.allocated_objects++;
+            alloc->layout = layout;
+            if (gc_profile_alloc(gc, NULL, ptr, alloc_size)) {
+                alloc->tag |= GC_TAG_SAMPLED;
+            }
+            /* Objects allocated during an incremental mark, or in pages
+             * the pending sweep has not reached yet, are allocated marked.
+             * The sweeper clears the mark. */
+            if (gc->marking || gc_heap_page_of(ptr)->unswept) {
+                gc_heap_mark(ptr);
+            }
             ptr = alloc->ptr;
         } else {
             /* We failed to allocate the metadata, fail cleanly. */
-            free(ptr);
+            gc_heap_free(gc->heap, ptr);
             ptr = NULL;
         }
     }
     return ptr;
 }
 
+/*
+ * Moves the allocations a thread made from its cache into the allocation
+ * map. Must be called by the owning thread with the lock held.
+ */
+static void gc_thread_cache_publish(GarbageCollector* gc, ThreadCache* tc) {
+    for (size_t i = 0; i < tc->npending; ++i) {
+        Allocation* pending = &tc->pending[i];
+        Allocation* alloc = gc_allocation_map_put(gc->allocs, pending->ptr, pending->size,
+                                                  pending->dtor);
+        if (!alloc) {
+            LOG_CRITICAL("Failed to publish allocation %p, leaking it", pending->ptr);
+            continue;
+        }
+        alloc->tag |= pending->tag & GC_TAG_SAMPLED;
+        gc->stats.allocated_bytes += pending->size;
+        gc->stats.allocated_objects++;
+        if (gc->marking || gc_heap_page_of(alloc->ptr)->unswept) {
+            gc_heap_mark(alloc->ptr);
+        }
+    }
+    tc->npending = 0;
+}
+
+/*
+ * Publishes the calling thread's pending allocations, so that they can be
+ * looked up in the allocation map.
+ */
+static void gc_thread_cache_sync(GarbageCollector* gc) {
+    GcThread* t = gc_current_thread;
+    if (t && t->registry == gc->threads) {
+        gc_thread_cache_publish(gc, &t->cache);
+    }
+}
+
+/*
+ * Publishes a thread's pending allocations and gives its free slots back
+ * to the heap. Must be called with the lock held.
+ */
+static void gc_thread_cache_flush(GarbageCollector* gc, ThreadCache* tc) {
+    gc_thread_cache_publish(gc, tc);
+    for (unsigned int i = 0; i < GC_HEAP_NUM_CLASSES; ++i) {
+        while (tc->free[i]) {
+            void* slot = tc->free[i];
+            tc->free[i] = *(void**) slot;
+            gc_heap_free(gc->heap, slot);
+        }
+    }
+}
+
+/*
+ * Takes a batch of free slots of a size class from the heap. This is the
+ * only place where thread-cached allocation takes the lock, and also where
+ * it triggers collections.
+ */
+static void gc_thread_cache_refill(GarbageCollector* gc, ThreadCache* tc, unsigned int size_class) {
+    gc_lock(gc);
+    gc_thread_cache_publish(gc, tc);
+    gc_maybe_collect(gc);
+    size_t obj_size = gc->heap->classes[size_class].obj_size;
+    size_t batch = GC_THREAD_CACHE_BYTES / obj_size;
+    batch = batch < 1 ? 1 : batch > GC_THREAD_CACHE_BATCH ? GC_THREAD_CACHE_BATCH : batch;
+    if (gc->marking && !gc->paused) {
+        gc_mark_assist(gc, batch * obj_size);
+    }
+    if (gc_sweep_pending(gc)) {
+        gc_sweep_for(gc, obj_size);
+    }
+    for (size_t i = 0; i < batch; ++i) {
+        void* slot = gc_heap_alloc(gc->heap, obj_size);
+        if (!slot) {
+            break;
+        }
+        *(void**) slot = tc->free[size_class];
+        tc->free[size_class] = slot;
+    }
+    gc_unlock(gc);
+}
+
+/*
+ * Allocation fast path for registered threads. Carves the object out of
+ * the thread's cache and records it as pending, without taking the lock or
+ * writing shared memory. Returns NULL if the slow path has to take over.
+ */
+static void* gc_thread_cache_alloc(GarbageCollector* gc, size_t count, size_t size,
+                                   void(*dtor)(void*)) {
+    GcThread* t = gc_current_thread;
+    if (!gc->thread_cache || !t || t->registry != gc->threads) {
+        return NULL;
+    }
+    size_t alloc_size = size;
+    if (count) {
+        if (size && count > SIZE_MAX / size) {
+            return NULL;
+        }
+        alloc_size = count * size;
+    }
+    if (alloc_size > GC_HEAP_MAX_SMALL_SIZE) {
+        return NULL;
+    }
+    ThreadCache* tc = &t->cache;
+    unsigned int size_class = gc_heap_size_class(alloc_size);
+    if (!tc->free[size_class] || tc->npending == GC_THREAD_CACHE_PENDING) {
+        gc_thread_cache_refill(gc, tc, size_class);
+        if (!tc->free[size_class]) {
+            return NULL;
+        }
+    }
+    void* ptr = tc->free[size_class];
+    tc->free[size_class] = *(void**) ptr;
+    memset(ptr, 0, alloc_size);
+    Allocation* pending = &tc->pending[tc->npending];
+    pending->ptr = ptr;
+    pending->size = alloc_size;
+    pending->dtor = dtor;
+    pending->tag = gc_profile_alloc(gc, tc, ptr, alloc_size)
+                   ? GC_TAG_SAMPLED : GC_TAG_NONE;
+    /* A collection interrupting us scans pending allocations up to
+     * npending, so the entry has to be complete first */
+    __atomic_signal_fence(__ATOMIC_RELEASE);
+    tc->npending++;
+    GC_TRACE_ALLOC(gc, ptr, alloc_size);
+    return ptr;
+}
+
+/*
+ * Looks up the allocation starting exactly at ptr. The page map rejects
+ * pointers that are not heap objects before the allocation map is hashed.
+ */
+static Allocation* gc_find_alloc(GarbageCollector* gc, void* ptr) {
+    if (gc_heap_object_start(gc->heap, ptr) != ptr) {
+        return NULL;
+    }
+    return gc_allocation_map_get(gc->allocs, ptr);
+}
+
+/*
+ * Records an allocation for gc_replay, if it succeeded.
+ */
+static inline void gc_record_alloc(GarbageCollector* gc, void* ptr, size_t size,
+                                   void(*dtor)(void*), unsigned int flags) {
+    if (ptr) {
+        GC_RECORD(gc, GC_RECORD_ALLOC, ptr, size, flags | (dtor ? GC_RECORD_ALLOC_DTOR : 0));
+    }
+}
+
 static void gc_make_root(GarbageCollector* gc, void* ptr) {
-    Allocation* alloc = gc_allocation_map_get(gc->allocs, ptr);
-    if (alloc) {
+    Allocation* alloc = gc_find_alloc(gc, ptr);
+    if (!alloc || (alloc->tag & GC_TAG_ROOT)) {
+        return;
+    }
+    if (gc_root_set_add(gc->roots, ptr)) {
         alloc->tag |= GC_TAG_ROOT;
+    } else {
+        LOG_CRITICAL("Failed to make %p static", ptr);
     }
 }
 
 void* gc_malloc_ext(GarbageCollector* gc, size_t size, void(*dtor)(void*)) {
-    return gc_allocate(gc, 0, size, dtor);
+    void* ptr = gc_thread_cache_alloc(gc, 0, size, dtor);
+    if (ptr) {
+        gc_record_alloc(gc, ptr, size, dtor, 0);
+        return ptr;
+    }
+    gc_lock(gc);
+    ptr = gc_allocate(gc, 0, size, dtor, NULL);
+    gc_record_alloc(gc, ptr, size, dtor, 0);
+    gc_unlock(gc);
+    return ptr;
 }
 
 void* gc_malloc(GarbageCollector* gc, size_t size) {
     return gc_malloc_ext(gc, size, NULL);
 }
 
+void* gc_malloc_typed(GarbageCollector* gc, size_t size, const GcLayout* layout) {
+    gc_lock(gc);
+    void* ptr = gc_allocate(gc, 0, size, NULL, layout);
+    gc_record_alloc(gc, ptr, size, NULL,
+                    layout == &gc_layout_atomic ? GC_RECORD_ALLOC_ATOMIC : GC_RECORD_ALLOC_TYPED);
+    gc_unlock(gc);
+    return ptr;
+}
+
+void* gc_malloc_atomic(GarbageCollector* gc, size_t size) {
+    return gc_malloc_typed(gc, size, &gc_layout_atomic);
+}
+
 void* gc_malloc_static(GarbageCollector* gc, size_t size, void(*dtor)(void*)) {
-    void* ptr = gc_malloc_ext(gc, size, dtor);
+    gc_lock(gc);
+    void* ptr = gc_allocate(gc, 0, size, dtor, NULL);
     gc_make_root(gc, ptr);
+    gc_record_alloc(gc, ptr, size, dtor, GC_RECORD_ALLOC_STATIC);
+    gc_unlock(gc);
     return ptr;
 }
 
 void* gc_make_static(GarbageCollector* gc, void* ptr) {
+    gc_lock(gc);
+    gc_thread_cache_sync(gc);
     gc_make_root(gc, ptr);
+    gc_unlock(gc);
     return ptr;
 }
 
+void gc_unmake_static(GarbageCollector* gc, void* ptr) {
+    gc_lock(gc);
+    Allocation* alloc = gc_find_alloc(gc, ptr);
+    if (alloc && (alloc->tag & GC_TAG_ROOT)) {
+        alloc->tag &= ~GC_TAG_ROOT;
+        gc_root_set_remove(gc->roots, ptr);
+    }
+    gc_unlock(gc);
+}
+
 void* gc_calloc_ext(GarbageCollector* gc, size_t count, size_t size,
                     void(*dtor)(void*)) {
-    return gc_allocate(gc, count, size, dtor);
+    void* ptr = gc_thread_cache_alloc(gc, count, size, dtor);
+    if (ptr) {
+        gc_record_alloc(gc, ptr, count * size, dtor, GC_RECORD_ALLOC_CALLOC);
+        return ptr;
+    }
+    gc_lock(gc);
+    ptr = gc_allocate(gc, count, size, dtor, NULL);
+    gc_record_alloc(gc, ptr, count * size, dtor, GC_RECORD_ALLOC_CALLOC);
+    gc_unlock(gc);
+    return ptr;
 }
 
 void* gc_calloc(GarbageCollector* gc, size_t count, size_t size) {
     return gc_calloc_ext(gc, count, size, NULL);
 }
 
-void* gc_realloc(GarbageCollector* gc, void* p, size_t size) {
-    Allocation* alloc = gc_allocation_map_get(gc->allocs, p);
+static void* gc_reallocate(GarbageCollector* gc, void* p, size_t size) {
+    Allocation* alloc = gc_find_alloc(gc, p);
     if (p && !alloc) {
         // the user passed an unknown pointer
         errno = EINVAL;
         return NULL;
     }
-    void* q = realloc(p, size);
-    if (!q) {
-        // realloc failed but p is still valid
-        return NULL;
-    }
     if (!p) {
         // allocation, not reallocation
-        Allocation* alloc = gc_allocation_map_put(gc->allocs, q, size, NULL);
-        return alloc->ptr;
+        return gc_allocate(gc, 0, size, NULL, NULL);
     }
-    if (p == q) {
-        // successful reallocation w/o copy
+    if (size <= gc_heap_usable_size(p)) {
+        // the slot is large enough, reallocate w/o copy
+        gc_heap_resize(gc->heap, p, size);
+        if (alloc->tag & GC_TAG_OLD) {
+            gc->old_bytes = gc->old_bytes - alloc->size + size;
+        }
         alloc->size = size;
-    } else {
-        // successful reallocation w/ copy
-        void (*dtor)(void*) = alloc->dtor;
-        gc_allocation_map_remove(gc->allocs, p, true);
-        gc_allocation_map_put(gc->allocs, q, size, dtor);
+        return p;
+    }
+    // reallocation w/ copy, p stays valid if this fails
+    size_t old_size = alloc->size;
+    void (*dtor)(void*) = alloc->dtor;
+    const GcLayout* layout = alloc->layout;
+    void* q = gc_allocate(gc, 0, size, dtor, layout);
+    if (!q) {
+        return NULL;
+    }
+    /* the allocation may have collected and promoted p, or moved its record */
+    char tag = gc_find_alloc(gc, p)->tag;
+    memcpy(q, p, old_size);
+    if (tag & GC_TAG_ROOT) {
+        /* the slot of p is reused, so the add cannot fail */
+        gc_root_set_remove(gc->roots, p);
+        gc_root_set_add(gc->roots, q);
+        gc_allocation_map_get(gc->allocs, q)->tag |= GC_TAG_ROOT;
+    }
+    if (gc->marking) {
+        /* q was allocated marked, but the copy bypassed the write barrier */
+        gc_worklist_push(gc->worklist, q, size, layout);
+    }
+    if (tag & GC_TAG_OLD) {
+        /* q starts out young */
+        gc->old_bytes -= old_size;
+    }
+    if (tag & GC_TAG_SAMPLED) {
+        gc_profiler_free(gc->profiler, p);
+    }
+    gc_allocation_map_remove(gc->allocs, p, true);
+    gc_heap_free(gc->heap, p);
+    return q;
+}
+
+void* gc_realloc(GarbageCollector* gc, void* p, size_t size) {
+    gc_lock(gc);
+    gc_thread_cache_sync(gc);
+    void* q = gc_reallocate(gc, p, size);
+    if (!p) {
+        gc_record_alloc(gc, q, size, NULL, 0);
+    } else if (q) {
+        GC_RECORD(gc, GC_RECORD_REALLOC, p, (uintptr_t) q, size);
     }
+    gc_unlock(gc);
     return q;
 }
 
 void gc_free(GarbageCollector* gc, void* ptr) {
-    Allocation* alloc = gc_allocation_map_get(gc->allocs, ptr);
+    gc_lock(gc);
+    gc_thread_cache_sync(gc);
+    Allocation* alloc = gc_find_alloc(gc, ptr);
     if (alloc) {
+        GC_TRACE_FREE(gc, ptr, alloc->size);
+        GC_RECORD(gc, GC_RECORD_FREE, ptr, 0, 0);
         if (alloc->dtor) {
             alloc->dtor(ptr);
         }
-        free(ptr);
+        if (alloc->tag & GC_TAG_OLD) {
+            gc->old_bytes -= alloc->size;
+        }
+        if (alloc->tag & GC_TAG_ROOT) {
+            gc_root_set_remove(gc->roots, ptr);
+        }
+        if (alloc->tag & GC_TAG_SAMPLED) {
+            gc_profiler_free(gc->profiler, ptr);
+        }
         gc_allocation_map_remove(gc->allocs, ptr, true);
+        gc_heap_free(gc->heap, ptr);
     } else {
         LOG_WARNING("Ignoring request to free unknown pointer %p", (void*) ptr);
     }
+    gc_unlock(gc);
 }
 
 
-void gc_start_ext(GarbageCollector* gc,
-    void* bos,
-    size_t initial_capacity,
-    size_t min_capacity,
-    double downsize_load_factor,
-    double upsize_load_factor,
-    double sweep_factor) {
+void gc_options_init(GarbageCollectorOptions* opts)
+{
+    opts->initial_capacity = 1024;
+    opts->min_capacity = 1024;
+    opts->downsize_load_factor = 0.2;
+    opts->upsize_load_factor = 0.8;
+    opts->heap_growth = 1.0;
+    opts->min_heap = GC_MIN_HEAP;
+    opts->gc_cpu_fraction = 0.0;
+    opts->scan_stride = GC_SCAN_STRIDE_ALIGNED;
+    opts->mark_stack_limit = 0;
+    opts->mark_threads = 1;
+    opts->lazy_sweep = false;
+    opts->finalizer_mode = GC_FINALIZE_INLINE;
+    opts->thread_cache = false;
+    opts->generational = false;
+    opts->promote_age = 2;
+    opts->incremental = false;
+    opts->large_object_threshold = GC_HEAP_MMAP_THRESHOLD;
+    opts->scan_data_segments = false;
+    opts->trace_level = GC_TRACE_LEVEL_OFF;
+    opts->profile_interval = 0;
+}
+
+/*
+ * Deletes the parts of the collector that exist, once it is stopped or
+ * when starting it failed halfway.
+ */
+static void gc_release(GarbageCollector* gc)
+{
+    if (gc->finalizers) {
+        gc_finalizer_queue_delete(gc->finalizers);
+    }
+    if (gc->allocs) {
+        gc_allocation_map_delete(gc->allocs);
+    }
+    if (gc->heap) {
+        gc_heap_delete(gc->heap);
+    }
+    if (gc->worklist) {
+        gc_worklist_delete(gc->worklist);
+    }
+    if (gc->mark_pool) {
+        gc_mark_pool_delete(gc->mark_pool);
+    }
+    if (gc->threads) {
+        gc_thread_registry_delete(gc->threads);
+    }
+    if (gc->pacer) {
+        gc_pacer_delete(gc->pacer);
+    }
+    if (gc->roots) {
+        gc_root_set_delete(gc->roots);
+    }
+    if (gc->tracer) {
+        gc_tracer_delete(gc->tracer);
+    }
+    if (gc->root_ranges) {
+        gc_root_ranges_delete(gc->root_ranges);
+    }
+    if (gc->profiler) {
+        gc_profiler_delete(gc->profiler);
+        gc->profiler = NULL;
+    }
+}
 
-    double downsize_limit = downsize_load_factor > 0.0 ? downsize_load_factor : 0.2;
-    double upsize_limit = upsize_load_factor > 0.0 ? upsize_load_factor : 0.8;
-    sweep_factor = sweep_factor > 0.0 ? sweep_factor : 0.5;
+bool gc_start_opts(GarbageCollector* gc, void* bos, const GarbageCollectorOptions* opts)
+{
+    double downsize_limit = opts->downsize_load_factor > 0.0 ? opts->downsize_load_factor : 0.2;
+    double upsize_limit = opts->upsize_load_factor > 0.0 ? opts->upsize_load_factor : 0.8;
+    double heap_growth = opts->heap_growth > 0.0 ? opts->heap_growth : 1.0;
+    size_t min_capacity = opts->min_capacity;
+    size_t initial_capacity = opts->initial_capacity;
     gc->paused = false;
     gc->bos = bos;
+    gc->min_size = min_capacity;
+    gc->lazy_sweep = opts->lazy_sweep;
+    gc->thread_cache = opts->thread_cache;
+    gc->generational = opts->generational;
+    gc->promote_age = opts->promote_age ? opts->promote_age : 1;
+    gc->incremental = opts->incremental;
+    gc->marking = false;
+    gc->swept_objects = 0;
+    gc->swept_bytes = 0;
+    memset(&gc->stats, 0, sizeof(GcStats));
+    gc->tracer = gc_tracer_new();
+    gc->trace_level = gc->tracer ? opts->trace_level : GC_TRACE_LEVEL_OFF;
+    gc->start_ns = gc_pacer_now();
+    gc->recorder = NULL;
+    gc->profiler = opts->profile_interval ? gc_profiler_new(opts->profile_interval) : NULL;
+    gc->minor = false;
+    gc->old_bytes = 0;
+    gc->major_limit = GC_MIN_MAJOR_LIMIT;
+    gc->sweep_factor = 0.0;
+    gc->heap = gc_heap_new();
+    gc->pacer = gc_pacer_new(heap_growth, opts->min_heap, opts->gc_cpu_fraction);
+    gc->roots = gc_root_set_new();
+    gc->root_ranges = gc_root_ranges_new();
+    gc->scan_data_segments = opts->scan_data_segments;
+    gc->threads = gc_thread_registry_new();
+    gc->worklist = gc_worklist_new(256, opts->mark_stack_limit ? opts->mark_stack_limit : SIZE_MAX);
     initial_capacity = initial_capacity < min_capacity ? min_capacity : initial_capacity;
     gc->allocs = gc_allocation_map_new(min_capacity, initial_capacity,
-                                       sweep_factor, downsize_limit, upsize_limit);
+                                       downsize_limit, upsize_limit);
+    gc->mark_pool = NULL;
+    gc->finalizers = NULL;
+    if (!gc->heap || !gc->pacer || !gc->roots || !gc->root_ranges || !gc->threads
+        || !gc->worklist || !gc->allocs || !gc_thread_register(gc->threads, bos)) {
+        LOG_CRITICAL("Failed to start the garbage collector%s", "");
+        gc_release(gc);
+        errno = ENOMEM;
+        return false;
+    }
+    gc->heap->mmap_threshold = opts->large_object_threshold;
+    /* Without these, marking is serial and destructors run inline */
+    if (opts->mark_threads > 1) {
+        gc->mark_pool = gc_mark_pool_new(opts->mark_threads, gc_mark_range_parallel, gc);
+    }
+    if (opts->finalizer_mode != GC_FINALIZE_INLINE) {
+        gc->finalizers = gc_finalizer_queue_new(opts->finalizer_mode == GC_FINALIZE_THREAD);
+    }
+    /* Any power of two up to the pointer size is a valid stride */
+    size_t stride = opts->scan_stride;
+    gc->scan_stride = (stride && stride <= PTRSIZE && !(stride & (stride - 1)))
+                      ? stride : GC_SCAN_STRIDE_ALIGNED;
     LOG_DEBUG("Created new garbage collector (cap=%ld, siz=%ld).", gc->allocs->capacity,
               gc->allocs->size);
+    return true;
 }
 
-void gc_start(GarbageCollector* gc, void* bos) {
-    gc_start_ext(gc, bos, 1024, 1024, 0.2, 0.8, 0.5);
-}
+bool gc_start_ext(GarbageCollector* gc,
+    void* bos,
+    size_t initial_capacity,
+    size_t min_capacity,
+    double downsize_load_factor,
+    double upsize_load_factor,
+    double sweep_factor) {
 
-void gc_pause(GarbageCollector* gc)
-{
-    gc->paused = true;
+    GarbageCollectorOptions opts;
+    gc_options_init(&opts);
+    opts.initial_capacity = initial_capacity;
+    opts.min_capacity = min_capacity;
+    opts.downsize_load_factor = downsize_load_factor;
+    opts.upsize_load_factor = upsize_load_factor;
+    /* the map's load alone triggers collections */
+    opts.min_heap = SIZE_MAX;
+    if (!gc_start_opts(gc, bos, &opts)) {
+        return false;
+    }
+    gc->sweep_factor = sweep_factor > 0.0 ? sweep_factor : 0.5;
+    return true;
 }
 
-void gc_resume(GarbageCollector* gc)
-{
-    gc->paused = false;
+bool gc_start(GarbageCollector* gc, void* bos) {
+    GarbageCollectorOptions opts;
+    gc_options_init(&opts);
+    return gc_start_opts(gc, bos, &opts);
 }
 
-void gc_mark_alloc(GarbageCollector* gc, void* ptr)
+bool gc_register_thread(GarbageCollector* gc, void* bos)
 {
-    Allocation* alloc = gc_allocation_map_get(gc->allocs, ptr);
-    /* Mark if alloc exists and is not tagged already, otherwise skip */
-    if (alloc && !(alloc->tag & GC_TAG_MARK)) {
-        LOG_DEBUG("Marking allocation (ptr=%p)", ptr);
-        alloc->tag |= GC_TAG_MARK;
-        /* Iterate over allocation contents and mark them as well */
-        LOG_DEBUG("Checking allocation (ptr=%p, size=%lu) contents", ptr, alloc->size);
-        for (char* p = (char*) alloc->ptr;
-                p <= (char*) alloc->ptr + alloc->size - PTRSIZE;
-                ++p) {
-            LOG_DEBUG("Checking allocation (ptr=%p) @%lu with value %p",
-                      ptr, p-((char*) alloc->ptr), *(void**)p);
-            gc_mark_alloc(gc, *(void**)p);
-        }
-    }
+    return gc_thread_register(gc->threads, bos);
 }
 
-void gc_mark_stack(GarbageCollector* gc)
+void gc_unregister_thread(GarbageCollector* gc)
 {
-    LOG_DEBUG("Marking the stack (gc@%p) in increments of %ld \n", (void*) gc, sizeof(char));
-    void *tos = __builtin_frame_address(0);
-    void *bos = gc->bos;
-    printf("Top of stack is %p, bottom is %p \n", tos, bos);
-    /* The stack grows towards smaller memory addresses, hence we scan tos->bos.
-     * Stop scanning once the distance between tos & bos is too small to hold a valid pointer */
-    for (char* p = tos; p >= (char*)bos + PTRSIZE; p--) {
-         gc_mark_alloc(gc, *(void**)p);
+    gc_lock(gc);
+    GcThread* t = gc_thread_current(gc->threads);
+    if (t) {
+        gc_thread_cache_flush(gc, &t->cache);
     }
+    gc_thread_unregister(gc->threads);
+    gc_unlock(gc);
 }
 
-void gc_mark_roots(GarbageCollector* gc)
+void gc_get_stats(GarbageCollector* gc, GcStats* stats)
 {
-    LOG_DEBUG("Marking roots%s", "");
+    gc_lock(gc);
+    *stats = gc->stats;
+    stats->live_bytes = gc->heap->used;
+    stats->live_objects = gc->allocs->size;
+    uint64_t elapsed = gc_pacer_now() - gc->start_ns;
+    stats->allocation_rate = elapsed ? (double) stats->allocated_bytes * 1e9 / (double) elapsed : 0.0;
+    stats->map_load = gc_allocation_map_load_factor(gc->allocs);
+    stats->trace_dropped = gc->tracer ? gc_tracer_dropped(gc->tracer) : 0;
     for (size_t i = 0; i < gc->allocs->capacity; ++i) {
-        Allocation* chunk = gc->allocs->allocs[i];
-        while (chunk) {
-            if (chunk->tag & GC_TAG_ROOT) {
-                LOG_DEBUG("Marking root @ %p", chunk->ptr);
-                gc_mark_alloc(gc, chunk->ptr);
+        Allocation* alloc = &gc->allocs->allocs[i];
+        if (alloc->ptr) {
+            size_t probe = alloc->probe;
+            stats->map_probes[probe < GC_STATS_PROBE_BUCKETS ? probe : GC_STATS_PROBE_BUCKETS - 1]++;
+            if (probe > stats->map_max_probe) {
+                stats->map_max_probe = probe;
             }
-            chunk = chunk->next;
         }
     }
+    gc_unlock(gc);
 }
 
-void gc_mark(GarbageCollector* gc)
+void gc_set_trace_level(GarbageCollector* gc, int level)
 {
-    /* Note: We only look at the stack and the heap, and ignore BSS. */
-    LOG_DEBUG("Initiating GC mark (gc@%p)", (void*) gc);
-    /* Scan the heap for roots */
-    gc_mark_roots(gc);
-    /* Dump registers onto stack and scan the stack */
-    void (*volatile _mark_stack)(GarbageCollector*) = gc_mark_stack;
-    jmp_buf ctx;
-    memset(&ctx, 0, sizeof(jmp_buf));
-    setjmp(ctx);
-    _mark_stack(gc);
+    gc_lock(gc);
+    if (gc->tracer) {
+        gc->trace_level = level;
+    }
+    gc_unlock(gc);
 }
 
-size_t gc_sweep(GarbageCollector* gc)
+size_t gc_trace_drain(GarbageCollector* gc, GcTraceEvent* events, size_t max)
 {
-    LOG_DEBUG("Initiating GC sweep (gc@%p)", (void*) gc);
+    return gc->tracer ? gc_tracer_drain(gc->tracer, events, max) : 0;
+}
+
+size_t gc_trace_write(GarbageCollector* gc, int fd)
+{
+    if (lseek(fd, 0, SEEK_END) == 0
+        && write(fd, GC_TRACE_MAGIC, sizeof(GC_TRACE_MAGIC) - 1) != sizeof(GC_TRACE_MAGIC) - 1) {
+        return 0;
+    }
+    GcTraceEvent events[256];
     size_t total = 0;
-    for (size_t i = 0; i < gc->allocs->capacity; ++i) {
-        Allocation* chunk = gc->allocs->allocs[i];
-        Allocation* next = NULL;
-        /* Iterate over separate chaining */
-        while (chunk) {
-            if (chunk->tag & GC_TAG_MARK) {
-                LOG_DEBUG("Found used allocation %p (ptr=%p)", (void*) chunk, (void*) chunk->ptr);
-                /* unmark */
-                chunk->tag &= ~GC_TAG_MARK;
-                chunk = chunk->next;
-            } else {
-                LOG_DEBUG("Found unused allocation %p (%lu bytes @ ptr=%p)", (void*) chunk, chunk->size, (void*) chunk->ptr);
-                /* no reference to this chunk, hence delete it */
-                total += chunk->size;
-                if (chunk->dtor) {
-                    chunk->dtor(chunk->ptr);
-                }
-                free(chunk->ptr);
-                /* and remove it from the bookkeeping */
-                next = chunk->next;
-                gc_allocation_map_remove(gc->allocs, chunk->ptr, false);
-                chunk = next;
-            }
+    size_t n;
+    while ((n = gc_trace_drain(gc, events, 256))) {
+        if (write(fd, events, n * sizeof(GcTraceEvent)) != (ssize_t) (n * sizeof(GcTraceEvent))) {
+            LOG_WARNING("Failed to write %zu trace events", n);
+            break;
         }
+        total += n;
     }
-    gc_allocation_map_resize_to_fit(gc->allocs);
     return total;
 }
 
-void gc_unroot_roots(GarbageCollector* gc)
+bool gc_record_start(GarbageCollector* gc, int fd)
 {
-    LOG_DEBUG("Unmarking roots%s", "");
-    for (size_t i = 0; i < gc->allocs->capacity; ++i) {
-        Allocation* chunk = gc->allocs->allocs[i];
-        while (chunk) {
-            if (chunk->tag & GC_TAG_ROOT) {
-                chunk->tag &= ~GC_TAG_ROOT;
-            }
-            chunk = chunk->next;
-        }
+    gc_lock(gc);
+    if (!gc->recorder) {
+        __atomic_store_n(&gc->recorder, gc_recorder_new(), __ATOMIC_RELEASE);
     }
+    bool started = gc->recorder && gc_recorder_start(gc->recorder, fd);
+    gc_unlock(gc);
+    return started;
 }
 
-size_t gc_stop(GarbageCollector* gc)
+uint64_t gc_record_stop(GarbageCollector* gc)
 {
-    gc_unroot_roots(gc);
-    size_t collected = gc_sweep(gc);
-    gc_allocation_map_delete(gc->allocs);
-    return collected;
+    gc_lock(gc);
+    uint64_t events = gc->recorder ? gc_recorder_stop(gc->recorder) : 0;
+    gc_unlock(gc);
+    return events;
 }
 
-size_t gc_run(GarbageCollector* gc)
+void gc_set_profile_interval(GarbageCollector* gc, size_t bytes)
 {
-    LOG_DEBUG("Initiating GC run (gc@%p)", (void*) gc);
-    gc_mark(gc);
-    return gc_sweep(gc);
+    gc_lock(gc);
+    if (gc->profiler) {
+        gc_profiler_set_interval(gc->profiler, bytes);
+    } else if (bytes) {
+        __atomic_store_n(&gc->profiler, gc_profiler_new(bytes), __ATOMIC_RELEASE);
+    }
+    gc_unlock(gc);
+}
+
+bool gc_profile_write(GarbageCollector* gc, int fd, int format)
+{
+    gc_lock(gc);
+    bool written = gc->profiler && gc_profiler_write(gc->profiler, fd, format);
+    gc_unlock(gc);
+    return written;
+}
+
+bool gc_add_root_range(GarbageCollector* gc, void* start, size_t len)
+{
+    gc_lock(gc);
+    bool added = gc_root_ranges_add(gc->root_ranges, start, len, false);
+    gc_unlock(gc);
+    return added;
+}
+
+void gc_remove_root_range(GarbageCollector* gc, void* start, size_t len)
+{
+    gc_lock(gc);
+    if (!gc_root_ranges_remove(gc->root_ranges, start, len)) {
+        LOG_WARNING("Ignoring request to remove unknown root range %p", start);
+    }
+    gc_unlock(gc);
+}
+
+void gc_pause(GarbageCollector* gc)
+{
+    gc->paused = true;
+}
+
+void gc_resume(GarbageCollector* gc)
+{
+    gc->paused = false;
+}
+
+/*
+ * Reads the candidate pointer stored at p. Only byte-granular scanning can
+ * hit unaligned addresses, so the aligned stride loads the word directly.
+ */
+GC_NO_SANITIZE static inline void* gc_load_candidate(GarbageCollector* gc, char* p)
+{
+    if (gc->scan_stride == GC_SCAN_STRIDE_ALIGNED) {
+        return *(void**) p;
+    }
+    void* candidate;
+    memcpy(&candidate, p, sizeof(candidate));
+    return candidate;
+}
+
+/*
+ * Whether the contents of an allocation can hold pointers at all.
+ */
+static inline bool gc_has_pointers(Allocation* alloc)
+{
+    return alloc->size >= PTRSIZE && !(alloc->layout && !alloc->layout->words);
+}
+
+/*
+ * The allocation a candidate pointer points into, if any. The page map
+ * resolves interior pointers and rejects non-heap words before the
+ * allocation map is hashed.
+ */
+static inline Allocation* gc_candidate_alloc(GarbageCollector* gc, void* ptr)
+{
+    void* start = gc_heap_object_start(gc->heap, ptr);
+    return start ? gc_allocation_map_get(gc->allocs, start) : NULL;
+}
+
+/*
+ * Marks the allocation ptr points into, if any, and queues its contents for
+ * scanning. Objects too small to hold a pointer are never queued.
+ */
+static inline void gc_mark_candidate(GarbageCollector* gc, void* ptr)
+{
+    Allocation* alloc = gc_candidate_alloc(gc, ptr);
+    /* Mark if alloc exists and is not marked already, otherwise skip. Minor
+     * collections treat the old generation as live and do not trace it. */
+    if (alloc && !(gc->minor && (alloc->tag & GC_TAG_OLD)) && !gc_heap_mark(alloc->ptr)) {
+        LOG_DEBUG("Marking allocation (ptr=%p)", ptr);
+        if (gc_has_pointers(alloc)) {
+            gc_worklist_push(gc->worklist, alloc->ptr, alloc->size, alloc->layout);
+        }
+    }
+}
+
+static void gc_mark_range(GarbageCollector* gc, char* start, size_t size)
+{
+    LOG_DEBUG("Checking allocation (ptr=%p, size=%lu) contents", (void*) start, size);
+    /* Heap objects are granule aligned, so stepping by the stride from
+     * the object start visits exactly the aligned words */
+    char* end = start + size - PTRSIZE;
+    for (char* p = start; p <= end; p += gc->scan_stride) {
+        gc_mark_candidate(gc, gc_load_candidate(gc, p));
+    }
+}
+
+/*
+ * Index of the next word at or after i that the layout marks as a pointer,
+ * or layout->words if there is none.
+ */
+static inline size_t gc_layout_next(const GcLayout* layout, size_t i)
+{
+    const size_t bits = sizeof(uintptr_t) * 8;
+    while (i < layout->words) {
+        uintptr_t word = layout->bitmap[i / bits] >> (i % bits);
+        if (word) {
+            i += (size_t) __builtin_ctzll((unsigned long long) word);
+            return i < layout->words ? i : layout->words;
+        }
+        i = (i / bits + 1) * bits;
+    }
+    return layout->words;
+}
+
+/*
+ * Scans a typed object, which repeats its layout for every element. Only
+ * the words the layout marks as pointers are loaded.
+ */
+static void gc_mark_layout(GarbageCollector* gc, char* start, size_t size, const GcLayout* layout)
+{
+    size_t words = size / PTRSIZE;
+    for (size_t base = 0; base < words; base += layout->words) {
+        for (size_t i = gc_layout_next(layout, 0); i < layout->words && base + i < words;
+             i = gc_layout_next(layout, i + 1)) {
+            gc_mark_candidate(gc, *(void**) (start + (base + i) * PTRSIZE));
+        }
+    }
+}
+
+static inline void gc_mark_object(GarbageCollector* gc, char* start, size_t size,
+                                  const GcLayout* layout)
+{
+    if (layout) {
+        gc_mark_layout(gc, start, size, layout);
+    } else {
+        gc_mark_range(gc, start, size);
+    }
+}
+
+/*
+ * Length of the first chunk of a work item. Typed objects are split at
+ * element boundaries, so the layout lines up with every chunk.
+ */
+static inline size_t gc_chunk_size(size_t size, const GcLayout* layout)
+{
+    if (size <= GC_MARK_CHUNK) {
+        return size;
+    }
+    size_t chunk = GC_MARK_CHUNK;
+    if (layout) {
+        size_t element = layout->words * PTRSIZE;
+        chunk = element >= GC_MARK_CHUNK ? element : GC_MARK_CHUNK / element * element;
+    }
+    return chunk < size ? chunk : size;
+}
+
+/*
+ * Bytes to scan for a chunk of the given length. Conservative scans at
+ * byte stride also have to check the words straddling the chunk's end.
+ */
+static inline size_t gc_chunk_scan_size(GarbageCollector* gc, size_t chunk, const GcLayout* layout)
+{
+    return layout ? chunk : chunk - gc->scan_stride + PTRSIZE;
+}
+
+/*
+ * Scans the first chunk of a work item and queues the rest. Returns the
+ * number of bytes scanned.
+ */
+static size_t gc_mark_item(GarbageCollector* gc, WorkItem* item)
+{
+    size_t chunk = gc_chunk_size(item->size, item->layout);
+    if (chunk == item->size) {
+        gc_mark_object(gc, item->ptr, item->size, item->layout);
+        return chunk;
+    }
+    gc_worklist_push(gc->worklist, item->ptr + chunk, item->size - chunk, item->layout);
+    gc_mark_object(gc, item->ptr, gc_chunk_scan_size(gc, chunk, item->layout), item->layout);
+    return chunk;
+}
+
+/*
+ * Parallel counterpart of gc_mark_candidate. Workers race for the mark bit,
+ * so it is set atomically and only the worker that set it queues the object.
+ */
+static inline void gc_mark_candidate_parallel(GarbageCollector* gc, MarkPool* pool,
+                                              size_t worker, void* ptr)
+{
+    Allocation* alloc = gc_candidate_alloc(gc, ptr);
+    if (!alloc || (gc->minor && (alloc->tag & GC_TAG_OLD))) {
+        return;
+    }
+    if (!gc_heap_mark_atomic(alloc->ptr) && gc_has_pointers(alloc)) {
+        gc_mark_pool_push(pool, worker, alloc->ptr, alloc->size, alloc->layout);
+    }
+}
+
+static void gc_mark_range_parallel(void* ctx, MarkPool* pool, size_t worker, WorkItem* item)
+{
+    GarbageCollector* gc = (GarbageCollector*) ctx;
+    const GcLayout* layout = item->layout;
+    size_t size = gc_chunk_size(item->size, layout);
+    if (size < item->size) {
+        /* Other workers may steal the rest */
+        gc_mark_pool_push(pool, worker, item->ptr + size, item->size - size, layout);
+        size = gc_chunk_scan_size(gc, size, layout);
+    }
+    if (layout) {
+        size_t words = size / PTRSIZE;
+        for (size_t base = 0; base < words; base += layout->words) {
+            for (size_t i = gc_layout_next(layout, 0); i < layout->words && base + i < words;
+                 i = gc_layout_next(layout, i + 1)) {
+                gc_mark_candidate_parallel(gc, pool, worker,
+                                           *(void**) (item->ptr + (base + i) * PTRSIZE));
+            }
+        }
+        return;
+    }
+    char* end = item->ptr + size - PTRSIZE;
+    for (char* p = item->ptr; p <= end; p += gc->scan_stride) {
+        gc_mark_candidate_parallel(gc, pool, worker, gc_load_candidate(gc, p));
+    }
+}
+
+/*
+ * Scans queued objects until the mark stack is empty, spreading the work
+ * over the mark pool if there is one. If the stack could not hold
+ * everything, some marked objects were never scanned; find them by
+ * rescanning every marked allocation until no push is dropped anymore.
+ */
+static void gc_mark_drain(GarbageCollector* gc)
+{
+    uint64_t start = gc_pacer_now();
+    Worklist* wl = gc->worklist;
+    WorkItem item;
+    if (gc->mark_pool && wl->size && !gc_mark_pool_run(gc->mark_pool, wl)) {
+        wl->overflowed = true;
+    }
+    while (gc_worklist_pop(wl, &item)) {
+        gc_mark_item(gc, &item);
+    }
+    while (wl->overflowed) {
+        LOG_INFO("Mark stack overflowed, rescanning the heap (cap=%zu)", wl->capacity);
+        wl->overflowed = false;
+        wl->overflows++;
+        for (size_t i = 0; i < gc->allocs->capacity; ++i) {
+            Allocation* chunk = &gc->allocs->allocs[i];
+            if (chunk->ptr && gc_heap_is_marked(chunk->ptr) && gc_has_pointers(chunk)) {
+                /* Whole objects, chunks could overflow the stack again */
+                gc_mark_object(gc, chunk->ptr, chunk->size, chunk->layout);
+                while (gc_worklist_pop(wl, &item)) {
+                    gc_mark_item(gc, &item);
+                }
+            }
+        }
+    }
+    gc_phase_done(gc, GC_PHASE_MARK, start);
+}
+
+void gc_mark_alloc(GarbageCollector* gc, void* ptr)
+{
+    gc_mark_candidate(gc, ptr);
+    gc_mark_drain(gc);
+}
+
+/*
+ * Scans the stack range [tos, bos], starting at the first stride-aligned
+ * slot.
+ */
+GC_NO_SANITIZE static void gc_mark_stack_range(GarbageCollector* gc, void* tos, void* bos)
+{
+    uintptr_t mask = (uintptr_t) gc->scan_stride - 1;
+    char* start = (char*) (((uintptr_t) tos + mask) & ~mask);
+    for (char* p = start; p <= (char*) bos; p += gc->scan_stride) {
+        gc_mark_candidate(gc, gc_load_candidate(gc, p));
+    }
+}
+
+/*
+ * Queues everything referenced from the stacks and registers of the
+ * calling thread and of all suspended threads.
+ */
+GC_NO_SANITIZE static void gc_scan_stacks(GarbageCollector* gc)
+{
+    LOG_DEBUG("Marking the stack (gc@%p) in increments of %zu \n", (void*) gc, gc->scan_stride);
+    void *tos = __builtin_frame_address(0);
+    GcThread* self = gc_thread_current(gc->threads);
+    void *bos = self ? self->bos : gc->bos;
+    LOG_DEBUG("Top of stack is %p, bottom is %p", tos, bos);
+    /* The stack grows towards smaller memory addresses, hence we scan the
+     * range between tos and bos */
+    gc_mark_stack_range(gc, tos, bos);
+    /* Other threads are suspended in a signal handler, their registers are
+     * in the signal frame on their stack and in the saved jmp_buf */
+    for (GcThread* t = gc->threads->threads; t; t = t->next) {
+        if (t->suspended) {
+            gc_mark_stack_range(gc, t->tos, t->bos);
+            gc_mark_stack_range(gc, (char*) &t->regs, (char*) &t->regs + sizeof(jmp_buf) - PTRSIZE);
+        }
+    }
+}
+
+void gc_mark_stack(GarbageCollector* gc)
+{
+    gc_scan_stacks(gc);
+    gc_mark_drain(gc);
+}
+
+/*
+ * Scans the old objects in a dirty card for pointers to young objects. The
+ * card stays dirty as long as it holds such pointers, since the young
+ * objects may not be promoted by this collection.
+ */
+static bool gc_mark_card(GarbageCollector* gc, char* lo, char* hi)
+{
+    bool young = false;
+    char* p = lo;
+    while (p < hi) {
+        void* obj_start = gc_heap_object_start(gc->heap, p);
+        Allocation* obj = obj_start ? gc_allocation_map_get(gc->allocs, obj_start) : NULL;
+        char* end = hi;
+        if (obj) {
+            end = (char*) obj->ptr + obj->size < hi ? (char*) obj->ptr + obj->size : hi;
+        }
+        if (!obj || !(obj->tag & GC_TAG_OLD) || !gc_has_pointers(obj)) {
+            /* Free slot, young or pointer-free object, skip to the next slot */
+            HeapPage* page = gc_heap_page_of(p);
+            size_t slot = page->size_class == GC_HEAP_LARGE_CLASS ? page->block_size : page->obj_size;
+            char* next = page->slots + ((size_t) (p - page->slots) / slot + 1) * slot;
+            p = next < hi ? next : hi;
+            continue;
+        }
+        /* Heap objects are granule aligned, step from the object start */
+        char* q = (char*) obj->ptr + ((size_t) (p - (char*) obj->ptr) + gc->scan_stride - 1)
+                  / gc->scan_stride * gc->scan_stride;
+        for (; q + PTRSIZE <= end; q += gc->scan_stride) {
+            void* start = gc_heap_object_start(gc->heap, gc_load_candidate(gc, q));
+            Allocation* target = start ? gc_allocation_map_get(gc->allocs, start) : NULL;
+            if (target && !(target->tag & GC_TAG_OLD)) {
+                young = true;
+                gc_mark_candidate(gc, start);
+            }
+        }
+        p = end;
+    }
+    return young;
+}
+
+static void gc_mark_card_pages(GarbageCollector* gc, HeapPage* page)
+{
+    for (; page; page = page->next) {
+        if (page->size_class == GC_HEAP_LARGE_CLASS) {
+            if (page->cards[0]) {
+                page->cards[0] = gc_mark_card(gc, page->slots, page->slots + page->obj_size);
+            }
+            continue;
+        }
+        for (size_t i = 0; i < GC_HEAP_CARDS; ++i) {
+            if (page->cards[i]) {
+                char* lo = (char*) page + (i << GC_HEAP_CARD_SHIFT);
+                char* hi = lo + GC_HEAP_CARD_SIZE;
+                lo = lo < page->slots ? page->slots : lo;
+                page->cards[i] = lo < hi && gc_mark_card(gc, lo, hi);
+            }
+        }
+    }
+}
+
+/*
+ * Queues the young objects referenced from dirty cards, the remembered set
+ * of minor collections.
+ */
+static void gc_scan_cards(GarbageCollector* gc)
+{
+    LOG_DEBUG("Marking dirty cards%s", "");
+    for (unsigned int i = 0; i < GC_HEAP_NUM_CLASSES; ++i) {
+        gc_mark_card_pages(gc, gc->heap->classes[i].partial);
+        gc_mark_card_pages(gc, gc->heap->classes[i].full);
+    }
+    gc_mark_card_pages(gc, gc->heap->large);
+}
+
+static void gc_scan_roots(GarbageCollector* gc)
+{
+    LOG_DEBUG("Marking %zu roots", gc->roots->size);
+    for (size_t i = 0; i < gc->roots->size; ++i) {
+        LOG_DEBUG("Marking root @ %p", gc->roots->roots[i]);
+        gc_mark_candidate(gc, gc->roots->roots[i]);
+    }
+}
+
+void gc_mark_roots(GarbageCollector* gc)
+{
+    gc_scan_roots(gc);
+    gc_mark_drain(gc);
+}
+
+/*
+ * Scans the registered root ranges like stacks. Data segments hold
+ * instrumented globals, hence no sanitizer.
+ */
+GC_NO_SANITIZE static void gc_scan_root_ranges(GarbageCollector* gc)
+{
+    RootRanges* rr = gc->root_ranges;
+    for (size_t i = 0; i < rr->size; ++i) {
+        RootRange* range = &rr->ranges[i];
+        if (range->end - range->start >= (ptrdiff_t) PTRSIZE) {
+            gc_mark_stack_range(gc, range->start, range->end - PTRSIZE);
+        }
+    }
+}
+
+/*
+ * Queues everything the mutator reaches directly: stacks, registers,
+ * pending thread cache allocations and roots. Nothing is traced yet.
+ */
+static void gc_scan_all_roots(GarbageCollector* gc)
+{
+    /* Dump registers onto stack and scan the stack. This comes first, so
+     * that the registers do not hold heap pointers left behind by the
+     * other root scans. */
+    uint64_t start = gc_pacer_now();
+    void (*volatile _scan_stacks)(GarbageCollector*) = gc_scan_stacks;
+    jmp_buf ctx;
+    memset(&ctx, 0, sizeof(jmp_buf));
+    setjmp(ctx);
+    _scan_stacks(gc);
+    /* Allocations still pending in thread caches are not in the map yet.
+     * They are live, so scan them like roots. Objects smaller than a
+     * pointer cannot hold one. */
+    for (GcThread* t = gc->threads->threads; t; t = t->next) {
+        for (size_t i = 0; i < t->cache.npending; ++i) {
+            Allocation* pending = &t->cache.pending[i];
+            if (pending->size >= PTRSIZE) {
+                gc_mark_range(gc, pending->ptr, pending->size);
+            }
+        }
+    }
+    uint64_t stacks_done = gc_phase_done(gc, GC_PHASE_STACK, start);
+    /* Registered ranges and data segments */
+    gc_scan_root_ranges(gc);
+    /* Scan the heap for roots */
+    gc_scan_roots(gc);
+    gc_phase_done(gc, GC_PHASE_ROOTS, stacks_done);
+}
+
+typedef struct WorldStop {
+    size_t limit;             // mark stack limit while the world runs
+    size_t overflows;         // mark stack overflows before the stop
+    bool stopped;             // other threads were suspended
+} WorldStop;
+
+/*
+ * Suspends all other mutator threads. Suspended threads may hold the
+ * malloc lock, so the mark stacks must not grow until gc_world_start. If
+ * they overflow, they are grown for the next cycle once the world runs
+ * again.
+ */
+static void gc_world_stop(GarbageCollector* gc, WorldStop* ws)
+{
+    /* Libraries may come and go. The loader lock may be held by any
+     * thread, so look for their segments while the world still runs. */
+    if (gc->scan_data_segments) {
+        gc_root_ranges_find_segments(gc->root_ranges);
+    }
+    /* Suspended threads may hold the malloc lock, so the trace ring of
+     * this thread has to exist before */
+    if (gc->trace_level) {
+        gc_tracer_attach(gc->tracer);
+    }
+    Worklist* wl = gc->worklist;
+    ws->limit = wl->limit;
+    ws->overflows = wl->overflows;
+    gc_thread_stop_world(gc->threads);
+    ws->stopped = gc->threads->nstopped > 0;
+    if (ws->stopped) {
+        wl->limit = wl->capacity;
+        if (gc->mark_pool) {
+            gc->mark_pool->fixed = true;
+        }
+    }
+}
+
+static void gc_world_start(GarbageCollector* gc, WorldStop* ws)
+{
+    Worklist* wl = gc->worklist;
+    gc_thread_start_world(gc->threads);
+    if (ws->stopped) {
+        wl->limit = ws->limit;
+        if (gc->mark_pool) {
+            gc->mark_pool->fixed = false;
+        }
+        if (wl->overflows != ws->overflows) {
+            gc_worklist_grow(wl);
+            if (gc->mark_pool) {
+                gc_mark_pool_reserve(gc->mark_pool);
+            }
+        }
+    }
+}
+
+void gc_mark(GarbageCollector* gc)
+{
+    LOG_DEBUG("Initiating GC mark (gc@%p)", (void*) gc);
+    /* Marks left over from the previous cycle must be cleared first */
+    gc_sweep_finish(gc);
+    WorldStop ws;
+    gc_world_stop(gc, &ws);
+    gc_scan_all_roots(gc);
+    /* Old objects written to since the last minor collection */
+    if (gc->minor) {
+        uint64_t start = gc_pacer_now();
+        gc_scan_cards(gc);
+        gc_phase_done(gc, GC_PHASE_ROOTS, start);
+    }
+    gc_mark_drain(gc);
+    gc_world_start(gc, &ws);
+    gc->stats.collections++;
+    gc->stats.minor_collections += gc->minor;
+}
+
+/*
+ * Starts an incremental mark. The world is only stopped to queue the
+ * roots; tracing from them is left to gc_step and allocation assists.
+ */
+static void gc_mark_begin(GarbageCollector* gc)
+{
+    LOG_DEBUG("Starting incremental mark (gc@%p)", (void*) gc);
+    gc_sweep_finish(gc);
+    GC_TRACE_BEGIN(gc, 0, gc->heap->used);
+    gc->minor = false;
+    WorldStop ws;
+    gc_world_stop(gc, &ws);
+    gc_scan_all_roots(gc);
+    gc_world_start(gc, &ws);
+    __atomic_store_n(&gc->marking, true, __ATOMIC_RELAXED);
+}
+
+/*
+ * Scans queued objects until about work bytes have been scanned, or until
+ * the clock passes deadline_ns if that is not 0. The mutator may have
+ * freed a queued object since it was marked, so the object of every item
+ * is looked up again before it is scanned. Returns true once the mark stack is empty.
+ */
+static bool gc_mark_increment(GarbageCollector* gc, size_t work, uint64_t deadline_ns)
+{
+    uint64_t begin = gc_pacer_now();
+    Worklist* wl = gc->worklist;
+    WorkItem item;
+    size_t scanned = 0;
+    bool done = false;
+    for (size_t n = 1; ; ++n) {
+        if (!gc_worklist_pop(wl, &item)) {
+            done = true;
+            break;
+        }
+        void* start = gc_heap_object_start(gc->heap, item.ptr);
+        Allocation* alloc = start ? gc_allocation_map_get(gc->allocs, start) : NULL;
+        if (alloc && item.ptr + item.size <= (char*) alloc->ptr + alloc->size) {
+            scanned += gc_mark_item(gc, &item);
+        }
+        if (scanned >= work) {
+            break;
+        }
+        if (deadline_ns && n % GC_STEP_CLOCK_INTERVAL == 0 && gc_pacer_now() >= deadline_ns) {
+            break;
+        }
+    }
+    gc_phase_done(gc, GC_PHASE_MARK, begin);
+    if (done && wl->overflowed) {
+        /* Recovering from overflow rescans the heap in one go */
+        gc_mark_drain(gc);
+    }
+    return done;
+}
+
+/*
+ * Completes an incremental mark. The stacks and registers are not covered
+ * by the write barrier, so they are scanned again with the world stopped
+ * before marking is over. The sweep is always lazy.
+ */
+static void gc_mark_finish(GarbageCollector* gc)
+{
+    LOG_DEBUG("Finishing incremental mark (gc@%p)", (void*) gc);
+    gc_mark_increment(gc, SIZE_MAX, 0);
+    WorldStop ws;
+    gc_world_stop(gc, &ws);
+    gc_scan_all_roots(gc);
+    gc_mark_drain(gc);
+    gc_world_start(gc, &ws);
+    __atomic_store_n(&gc->marking, false, __ATOMIC_RELAXED);
+    gc->stats.collections++;
+    gc_sweep_begin(gc);
+    GC_TRACE_END(gc, 0, gc->heap->used);
+    gc->major_limit = 2 * gc->old_bytes > GC_MIN_MAJOR_LIMIT ? 2 * gc->old_bytes : GC_MIN_MAJOR_LIMIT;
+}
+
+static void gc_mark_assist(GarbageCollector* gc, size_t size)
+{
+    uint64_t start = gc_pacer_now();
+    bool timed = gc_pacer_clock_start(gc->pacer);
+    size_t work = size > SIZE_MAX / GC_MARK_ASSIST_RATIO ? SIZE_MAX : size * GC_MARK_ASSIST_RATIO;
+    if (gc_mark_increment(gc, work, 0)) {
+        gc_mark_finish(gc);
+    }
+    gc_pacer_clock_stop(gc->pacer, timed);
+    gc_stats_pause(gc, start);
+}
+
+/*
+ * Drops an unfinished incremental mark and its marks.
+ */
+static void gc_mark_abort(GarbageCollector* gc)
+{
+    gc->worklist->size = 0;
+    gc->worklist->overflowed = false;
+    gc_heap_clear_marks(gc->heap);
+    __atomic_store_n(&gc->marking, false, __ATOMIC_RELAXED);
+}
+
+bool gc_step(GarbageCollector* gc, uint64_t budget_ns)
+{
+    gc_lock(gc);
+    gc_thread_cache_sync(gc);
+    gc_reclaim_finalized(gc);
+    bool timed = gc_pacer_clock_start(gc->pacer);
+    uint64_t start = gc_pacer_now();
+    uint64_t deadline = start + budget_ns;
+    if (!gc->marking && !gc_sweep_pending(gc)) {
+        gc_mark_begin(gc);
+    }
+    if (gc->marking && gc_mark_increment(gc, SIZE_MAX, deadline)) {
+        gc_mark_finish(gc);
+    }
+    /* Spend what is left of the budget on the sweep */
+    while (!gc->marking && gc_sweep_pages(gc, 1) && gc_pacer_now() < deadline) {
+    }
+    bool pending = gc->marking || gc_sweep_pending(gc);
+    gc_pacer_clock_stop(gc->pacer, timed);
+    gc_stats_pause(gc, start);
+    gc_unlock(gc);
+    return pending;
+}
+
+/*
+ * Frees the unmarked objects of a page and clears the marks of the others.
+ * Every slot costs a single map lookup: dead records are unlinked where
+ * they were found, and the dead slots of a small page go back to its free
+ * list in one batch.
+ */
+static size_t gc_sweep_page(GarbageCollector* gc, HeapPage* page)
+{
+    uint64_t start = gc_pacer_now();
+    size_t total = 0;
+    void* first = NULL;
+    void* last = NULL;
+    size_t nfreed = 0;
+    size_t nslots = page->size_class == GC_HEAP_LARGE_CLASS ? 1 - page->nfree : page->nslots;
+    for (size_t i = 0; i < nslots; ++i) {
+        void* ptr = page->slots + i * page->obj_size;
+        Allocation* chunk = gc_allocation_map_get(gc->allocs, ptr);
+        if (!chunk || (gc->minor && (chunk->tag & GC_TAG_OLD))) {
+            continue;
+        }
+        if (gc_heap_is_marked(ptr)) {
+            LOG_DEBUG("Found used allocation %p (ptr=%p)", (void*) chunk, (void*) chunk->ptr);
+            /* marks are cleared with the whole page once it is swept */
+            if (chunk->tag & GC_TAG_SAMPLED) {
+                gc_profiler_survived(gc->profiler, ptr);
+            }
+            if (gc->generational && !(chunk->tag & GC_TAG_OLD) && ++chunk->age >= gc->promote_age) {
+                /* The promoted object may point to young objects, which
+                 * minor collections now only find through its cards */
+                chunk->tag |= GC_TAG_OLD;
+                gc->old_bytes += chunk->size;
+                gc_heap_dirty_cards(ptr, chunk->size);
+            }
+        } else {
+            if (chunk->tag & GC_TAG_OLD) {
+                gc->old_bytes -= chunk->size;
+            }
+            LOG_DEBUG("Found unused allocation %p (%lu bytes @ ptr=%p)", (void*) chunk, chunk->size, (void*) chunk->ptr);
+            /* no reference to this chunk, hence delete it */
+            total += chunk->size;
+            GC_TRACE_FREE(gc, ptr, chunk->size);
+            GC_RECORD(gc, GC_RECORD_DEATH, ptr, 0, 0);
+            if (chunk->tag & GC_TAG_SAMPLED) {
+                gc_profiler_free(gc->profiler, ptr);
+            }
+            gc->swept_objects++;
+            gc->stats.freed_objects++;
+            /* remove it from the bookkeeping before the destructor may
+             * change the map, then return the slot to the heap */
+            void (*dtor)(void*) = chunk->dtor;
+            gc_allocation_map_remove_at(gc->allocs, chunk);
+            /* Deferred destructors keep the slot until they have run */
+            bool deferred = dtor && gc->finalizers
+                            && gc_finalizer_queue_push(gc->finalizers, ptr, dtor);
+            if (dtor && !deferred) {
+                dtor(ptr);
+            }
+            if (deferred) {
+                continue;
+            }
+            if (page->size_class == GC_HEAP_LARGE_CLASS) {
+                gc_heap_free(gc->heap, ptr);
+            } else {
+                *(void**) ptr = first;
+                first = ptr;
+                last = last ? last : ptr;
+                nfreed++;
+            }
+        }
+    }
+    if (nfreed) {
+        gc_heap_free_slots(gc->heap, page, first, last, nfreed);
+    }
+    gc->swept_bytes += total;
+    gc->stats.freed_bytes += total;
+    gc_heap_sweep_done(gc->heap, page);
+    gc_phase_done(gc, GC_PHASE_SWEEP, start);
+    return total;
+}
+
+/*
+ * Called once the sweep has visited every page. What is left in the heap
+ * survived the cycle and sets the goal for the next one.
+ */
+static void gc_sweep_complete(GarbageCollector* gc)
+{
+    LOG_DEBUG("Swept %zu objects (%zu bytes)", gc->swept_objects, gc->swept_bytes);
+    uint64_t start = gc_pacer_now();
+    size_t capacity = gc->allocs->capacity;
+    gc_allocation_map_resize_to_fit(gc->allocs);
+    gc_phase_done(gc, GC_PHASE_RESIZE, start);
+    if (gc->allocs->capacity != capacity) {
+        GC_TRACE_RESIZE(gc, capacity, gc->allocs->capacity);
+    }
+    gc_pacer_cycle_done(gc->pacer, gc->heap->used);
+}
+
+/*
+ * Sweeps pages of the size class serving size until one of them has a
+ * free slot, so the allocation can reuse dead memory.
+ */
+static void gc_sweep_for(GarbageCollector* gc, size_t size)
+{
+    if (size > GC_HEAP_MAX_SMALL_SIZE) {
+        HeapPage* page;
+        size_t freed = 0;
+        while (freed < size && (page = gc_heap_sweep_next(gc->heap, GC_HEAP_LARGE_CLASS))) {
+            freed += gc_sweep_page(gc, page);
+        }
+    } else {
+        unsigned int size_class = gc_heap_size_class(size);
+        HeapPage* page;
+        while (!gc->heap->classes[size_class].partial
+               && (page = gc_heap_sweep_next(gc->heap, size_class))) {
+            gc_sweep_page(gc, page);
+        }
+    }
+    if (!gc_sweep_pending(gc)) {
+        gc_sweep_complete(gc);
+    }
+}
+
+static bool gc_sweep_pages(GarbageCollector* gc, size_t budget)
+{
+    for (unsigned int i = 0; i <= GC_HEAP_LARGE_CLASS && budget; ++i) {
+        HeapPage* page;
+        while (budget && (page = gc_heap_sweep_next(gc->heap, i))) {
+            gc_sweep_page(gc, page);
+            budget--;
+        }
+    }
+    if (gc_sweep_pending(gc)) {
+        return true;
+    }
+    gc_sweep_complete(gc);
+    return false;
+}
+
+bool gc_sweep_step(GarbageCollector* gc, size_t budget)
+{
+    gc_lock(gc);
+    bool pending = gc_sweep_pages(gc, budget);
+    gc_unlock(gc);
+    return pending;
+}
+
+/*
+ * Completes a pending lazy sweep, returning the number of bytes freed.
+ */
+static size_t gc_sweep_finish(GarbageCollector* gc)
+{
+    if (!gc_sweep_pending(gc)) {
+        return 0;
+    }
+    size_t total = 0;
+    for (unsigned int i = 0; i <= GC_HEAP_LARGE_CLASS; ++i) {
+        HeapPage* page;
+        while ((page = gc_heap_sweep_next(gc->heap, i))) {
+            total += gc_sweep_page(gc, page);
+        }
+    }
+    gc_sweep_complete(gc);
+    return total;
+}
+
+size_t gc_sweep(GarbageCollector* gc)
+{
+    LOG_DEBUG("Initiating GC sweep (gc@%p)", (void*) gc);
+    size_t total = gc_sweep_finish(gc);
+    gc_sweep_begin(gc);
+    return total + gc_sweep_finish(gc);
+}
+
+void gc_unroot_roots(GarbageCollector* gc)
+{
+    LOG_DEBUG("Unmarking roots%s", "");
+    for (size_t i = 0; i < gc->roots->size; ++i) {
+        gc_allocation_map_get(gc->allocs, gc->roots->roots[i])->tag &= ~GC_TAG_ROOT;
+    }
+    gc->roots->size = 0;
+}
+
+size_t gc_run_finalizers(GarbageCollector* gc)
+{
+    if (!gc->finalizers) {
+        return 0;
+    }
+    /* Destructors run without the lock, other threads keep allocating */
+    size_t count = gc_finalizer_queue_run(gc->finalizers);
+    gc_lock(gc);
+    gc_reclaim_finalized(gc);
+    gc_unlock(gc);
+    return count;
+}
+
+size_t gc_stop(GarbageCollector* gc)
+{
+    if (gc->recorder) {
+        /* the final sweep is not part of the program's record */
+        gc_recorder_delete(gc->recorder);
+        gc->recorder = NULL;
+    }
+    if (gc->marking) {
+        gc_mark_abort(gc);
+    }
+    for (GcThread* t = gc->threads->threads; t; t = t->next) {
+        gc_thread_cache_flush(gc, &t->cache);
+    }
+    gc_unroot_roots(gc);
+    /* Finish a pending minor sweep, then sweep everything */
+    gc_sweep_finish(gc);
+    gc->minor = false;
+    size_t collected = gc_sweep(gc);
+    if (gc->finalizers) {
+        /* Let the finalizer thread drain its queue, then finish the rest */
+        gc_finalizer_queue_stop(gc->finalizers);
+        gc_run_finalizers(gc);
+    }
+    gc_release(gc);
+    return collected;
+}
+
+/*
+ * Runs a collection. Minor collections only reclaim young objects and
+ * treat the old generation as live.
+ */
+static size_t gc_collect(GarbageCollector* gc, bool minor)
+{
+    LOG_DEBUG("Initiating GC run (gc@%p, minor=%d)", (void*) gc, minor);
+    gc_lock(gc);
+    uint64_t start = gc_pacer_now();
+    bool timed = gc_pacer_clock_start(gc->pacer);
+    gc_reclaim_finalized(gc);
+    if (gc->marking) {
+        /* Finish tracing what the incremental mark has queued, its marks
+         * stay valid. Minor collections would leave old objects marked. */
+        gc_mark_increment(gc, SIZE_MAX, 0);
+        __atomic_store_n(&gc->marking, false, __ATOMIC_RELAXED);
+        minor = false;
+    }
+    /* A pending sweep still belongs to the previous collection */
+    gc_sweep_finish(gc);
+    GC_TRACE_BEGIN(gc, minor, gc->heap->used);
+    gc->minor = minor;
+    gc_mark(gc);
+    size_t collected = 0;
+    if (gc->lazy_sweep) {
+        /* Dead objects are reclaimed as the allocator needs their space */
+        gc_sweep_begin(gc);
+    } else {
+        collected = gc_sweep(gc);
+    }
+    if (!minor) {
+        gc->major_limit = 2 * gc->old_bytes > GC_MIN_MAJOR_LIMIT ? 2 * gc->old_bytes : GC_MIN_MAJOR_LIMIT;
+    }
+    GC_TRACE_END(gc, collected, gc->heap->used);
+    gc_pacer_clock_stop(gc->pacer, timed);
+    gc_stats_pause(gc, start);
+    gc_unlock(gc);
+    return collected;
+}
+
+size_t gc_run(GarbageCollector* gc)
+{
+    GC_RECORD(gc, GC_RECORD_RUN, 0, 0, 0);
+    return gc_collect(gc, false);
+}
+
+size_t gc_run_minor(GarbageCollector* gc)
+{
+    GC_RECORD(gc, GC_RECORD_RUN, 0, 1, 0);
+    return gc_collect(gc, gc->generational);
+}
+
+/*
+ * Heap dumps are written straight to their file through two small
+ * buffers, one for each array. Both arrays are placed when the dump
+ * starts, the reference array right behind the last object, so neither
+ * has to be held in memory.
+ */
+#define GC_DUMP_BATCH 512
+
+typedef struct HeapDump {
+    int fd;
+    bool failed;              // a write failed, the dump is useless
+    uint64_t objects_at;      // file offset of the next batch of objects
+    uint64_t refs_at;         // file offset of the next batch of references
+    uint64_t nobjects;        // objects written or buffered
+    uint64_t nrefs;           // references written or buffered
+    size_t nobject_buf;       // objects in object_buf
+    size_t nref_buf;          // references in ref_buf
+    GcDumpObject object_buf[GC_DUMP_BATCH];
+    uint64_t ref_buf[GC_DUMP_BATCH];
+} HeapDump;
+
+static void gc_dump_write(HeapDump* dump, const void* buf, size_t len, uint64_t at)
+{
+    size_t done = 0;
+    while (done < len && !dump->failed) {
+        ssize_t n = pwrite(dump->fd, (const char*) buf + done, len - done, (off_t) (at + done));
+        if (n <= 0) {
+            /* reported once the world runs again, a stopped thread may
+             * hold the stream lock */
+            dump->failed = true;
+        } else {
+            done += (size_t) n;
+        }
+    }
+}
+
+static void gc_dump_flush_objects(HeapDump* dump)
+{
+    gc_dump_write(dump, dump->object_buf, dump->nobject_buf * sizeof(GcDumpObject), dump->objects_at);
+    dump->objects_at += dump->nobject_buf * sizeof(GcDumpObject);
+    dump->nobject_buf = 0;
+}
+
+static void gc_dump_flush_refs(HeapDump* dump)
+{
+    gc_dump_write(dump, dump->ref_buf, dump->nref_buf * sizeof(uint64_t), dump->refs_at);
+    dump->refs_at += dump->nref_buf * sizeof(uint64_t);
+    dump->nref_buf = 0;
+}
+
+static inline void gc_dump_ref(GarbageCollector* gc, HeapDump* dump, void* candidate)
+{
+    Allocation* target = gc_candidate_alloc(gc, candidate);
+    if (target) {
+        if (dump->nref_buf == GC_DUMP_BATCH) {
+            gc_dump_flush_refs(dump);
+        }
+        dump->ref_buf[dump->nref_buf++] = (uintptr_t) target->ptr;
+        dump->nrefs++;
+    }
+}
+
+/*
+ * Writes the record of an allocation followed by its references. The
+ * words scanned are those gc_mark_object would scan.
+ */
+GC_NO_SANITIZE static void gc_dump_alloc(GarbageCollector* gc, HeapDump* dump, Allocation* alloc)
+{
+    if (dump->nobject_buf == GC_DUMP_BATCH) {
+        gc_dump_flush_objects(dump);
+    }
+    GcDumpObject* obj = &dump->object_buf[dump->nobject_buf++];
+    memset(obj, 0, sizeof(GcDumpObject));
+    obj->addr = (uintptr_t) alloc->ptr;
+    obj->size = alloc->size;
+    obj->dtor = (uintptr_t) alloc->dtor;
+    obj->refs = dump->nrefs;
+    obj->tag = (uint8_t) alloc->tag;
+    obj->flags = (gc_heap_is_marked(alloc->ptr) ? GC_DUMP_ROOT : 0)
+                 | (!alloc->layout ? 0 : alloc->layout->words ? GC_DUMP_TYPED : GC_DUMP_ATOMIC);
+    dump->nobjects++;
+    if (!gc_has_pointers(alloc)) {
+        return;
+    }
+    /* only the reference buffer is flushed while the record is open */
+    char* start = (char*) alloc->ptr;
+    const GcLayout* layout = alloc->layout;
+    if (layout) {
+        size_t words = alloc->size / PTRSIZE;
+        for (size_t base = 0; base < words; base += layout->words) {
+            for (size_t i = gc_layout_next(layout, 0); i < layout->words && base + i < words;
+                 i = gc_layout_next(layout, i + 1)) {
+                gc_dump_ref(gc, dump, *(void**) (start + (base + i) * PTRSIZE));
+            }
+        }
+    } else {
+        char* end = start + alloc->size - PTRSIZE;
+        for (char* p = start; p <= end; p += gc->scan_stride) {
+            gc_dump_ref(gc, dump, gc_load_candidate(gc, p));
+        }
+    }
+    obj->nrefs = dump->nrefs - obj->refs;
+}
+
+bool gc_heap_dump(GarbageCollector* gc, int fd)
+{
+    HeapDump* dump = (HeapDump*) malloc(sizeof(HeapDump));
+    if (!dump) {
+        return false;
+    }
+    gc_lock(gc);
+    gc_thread_cache_sync(gc);
+    /* The mark bits are borrowed to flag the objects the roots reference */
+    if (gc->marking) {
+        gc_mark_abort(gc);
+    }
+    gc_sweep_finish(gc);
+    gc->minor = false;
+    /* The world stays stopped until every object is written, so no thread
+     * changes or frees one while it is read */
+    WorldStop ws;
+    gc_world_stop(gc, &ws);
+    gc_scan_all_roots(gc);
+    gc->worklist->size = 0;
+    gc->worklist->overflowed = false;
+
+    GcDumpHeader header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, GC_DUMP_MAGIC, sizeof(header.magic));
+    header.objects = sizeof(GcDumpHeader);
+    header.refs = header.objects + gc->allocs->size * sizeof(GcDumpObject);
+    header.heap_used = gc->heap->used;
+    header.heap_committed = gc->heap->committed;
+    dump->fd = fd;
+    dump->failed = false;
+    dump->objects_at = header.objects;
+    dump->refs_at = header.refs;
+    dump->nobjects = 0;
+    dump->nrefs = 0;
+    dump->nobject_buf = 0;
+    dump->nref_buf = 0;
+    for (size_t i = 0; i < gc->allocs->capacity; ++i) {
+        Allocation* alloc = &gc->allocs->allocs[i];
+        if (alloc->ptr) {
+            gc_dump_alloc(gc, dump, alloc);
+        }
+    }
+    gc_dump_flush_objects(dump);
+    gc_dump_flush_refs(dump);
+    gc_world_start(gc, &ws);
+    gc_heap_clear_marks(gc->heap);
+    gc_unlock(gc);
+
+    header.nobjects = dump->nobjects;
+    header.nrefs = dump->nrefs;
+    gc_dump_write(dump, &header, sizeof(header), 0);
+    bool written = !dump->failed;
+    if (!written) {
+        LOG_WARNING("Failed to write the heap dump to fd %d", fd);
+    }
+    free(dump);
+    return written;
+}
+
+void gc_write_barrier(GarbageCollector* gc, void* obj, void* field)
+{
+    HeapPage* page = gc_page_map_lookup(gc->heap->page_map, obj);
+    if (page) {
+        if (page->size_class == GC_HEAP_LARGE_CLASS) {
+            page->cards[0] = 1;
+        } else {
+            page->cards[((uintptr_t) field & (GC_HEAP_PAGE_SIZE - 1)) >> GC_HEAP_CARD_SHIFT] = 1;
+        }
+    }
+    if (gc_recording(gc)) {
+        void* target = gc_heap_object_start(gc->heap, *(void**) field);
+        if (target) {
+            GC_RECORD(gc, GC_RECORD_EDGE, obj, (char*) field - (char*) obj, (uintptr_t) target);
+        } else {
+            GC_RECORD(gc, GC_RECORD_CLEAR, obj, (char*) field - (char*) obj, 0);
+        }
+    }
+    /* obj may have been scanned by the incremental mark already, so the
+     * stored pointer is shaded before the mark can miss it */
+    if (__atomic_load_n(&gc->marking, __ATOMIC_RELAXED)) {
+        gc_lock(gc);
+        if (gc->marking) {
+            gc_mark_candidate(gc, *(void**) field);
+        }
+        gc_unlock(gc);
+    }
 }
 
 char* gc_strdup (GarbageCollector* gc, const char* s)
 {
     size_t len = strlen(s) + 1;
-    void *new = gc_malloc(gc, len);
+    void *new = gc_malloc_atomic(gc, len);
 
     if (new == NULL) {
         return NULL;
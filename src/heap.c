@@ -0,0 +1,438 @@
+#include <errno.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include "heap.h"
+#include "log.h"
+
+#if defined(_MSC_VER)
+#include <malloc.h>
+#define gc_heap_system_alloc(size) _aligned_malloc((size), GC_HEAP_PAGE_SIZE)
+#define gc_heap_system_free(ptr) _aligned_free(ptr)
+#define gc_heap_map(size) NULL
+#define gc_heap_unmap(ptr, size) ((void) (ptr), (void) (size))
+#define gc_heap_discard(ptr, size) ((void) (ptr), (void) (size))
+#else
+#include <sys/mman.h>
+#define gc_heap_system_free(ptr) free(ptr)
+
+/*
+ * Allocates size bytes aligned to the heap page size. Unlike aligned_alloc,
+ * posix_memalign takes sizes that are not a multiple of the alignment.
+ */
+static void* gc_heap_system_alloc(size_t size) {
+    void* ptr;
+    return posix_memalign(&ptr, GC_HEAP_PAGE_SIZE, size) == 0 ? ptr : NULL;
+}
+
+/*
+ * Maps size bytes aligned to the heap page size. The mapping is made one
+ * page larger and the misaligned head and tail are unmapped again.
+ */
+static void* gc_heap_map(size_t size) {
+    size_t length = size + GC_HEAP_PAGE_SIZE;
+    char* p = (char*) mmap(NULL, length, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (p == (char*) MAP_FAILED) {
+        return NULL;
+    }
+    char* start = (char*) (((uintptr_t) p + GC_HEAP_PAGE_SIZE - 1) & ~(uintptr_t) (GC_HEAP_PAGE_SIZE - 1));
+    if (start > p) {
+        munmap(p, (size_t) (start - p));
+    }
+    if (start + size < p + length) {
+        munmap(start + size, (size_t) (p + length - start - size));
+    }
+    return start;
+}
+
+#define gc_heap_unmap(ptr, size) munmap((ptr), (size))
+#define gc_heap_discard(ptr, size) madvise((ptr), (size), MADV_DONTNEED)
+#endif
+
+/*
+ * Size classes are multiples of the granule up to 128 bytes and then four
+ * classes per power of two up to 2 KiB. Above, each class fills a page
+ * with one slot less than the one before, up to GC_HEAP_MAX_SMALL_SIZE.
+ */
+static size_t gc_heap_class_size(unsigned int size_class) {
+    if (size_class < 8) {
+        return GC_HEAP_GRANULE * (size_class + 1);
+    }
+    if (size_class >= GC_HEAP_MEDIUM_CLASS) {
+        size_t nslots = GC_HEAP_MEDIUM_SLOTS - (size_class - GC_HEAP_MEDIUM_CLASS);
+        return ((GC_HEAP_PAGE_SIZE - GC_HEAP_HEADER_SIZE) / nslots) & ~(GC_HEAP_GRANULE - 1);
+    }
+    unsigned int k = size_class - 8;
+    unsigned int b = 7 + k / 4;
+    return ((size_t) 1 << b) + (k % 4 + 1) * ((size_t) 1 << (b - 2));
+}
+
+unsigned int gc_heap_size_class(size_t size) {
+    if (size <= 128) {
+        return size ? (unsigned int) ((size - 1) / GC_HEAP_GRANULE) : 0;
+    }
+    if (size > gc_heap_class_size(GC_HEAP_MEDIUM_CLASS - 1)) {
+        /* the most slots of the rounded size that fit a page */
+        size_t granules = (size + GC_HEAP_GRANULE - 1) & ~(GC_HEAP_GRANULE - 1);
+        size_t nslots = (GC_HEAP_PAGE_SIZE - GC_HEAP_HEADER_SIZE) / granules;
+        nslots = nslots > GC_HEAP_MEDIUM_SLOTS ? GC_HEAP_MEDIUM_SLOTS : nslots;
+        return GC_HEAP_MEDIUM_CLASS + GC_HEAP_MEDIUM_SLOTS - (unsigned int) nslots;
+    }
+    size_t s = size - 1;
+    unsigned int b = (unsigned int) (sizeof(unsigned long long) * 8 - 1
+                                     - __builtin_clzll((unsigned long long) s));
+    return 8 + (b - 7) * 4 + (unsigned int) ((s >> (b - 2)) & 3);
+}
+
+static void gc_heap_list_push(HeapPage** list, HeapPage* page) {
+    page->prev = NULL;
+    page->next = *list;
+    if (*list) {
+        (*list)->prev = page;
+    }
+    *list = page;
+}
+
+static void gc_heap_list_unlink(HeapPage** list, HeapPage* page) {
+    if (page->prev) {
+        page->prev->next = page->next;
+    } else {
+        *list = page->next;
+    }
+    if (page->next) {
+        page->next->prev = page->prev;
+    }
+    page->next = page->prev = NULL;
+}
+
+static void gc_heap_release(Heap* heap, HeapPage* page) {
+    gc_page_map_clear(heap->page_map, page, page->block_size);
+    heap->committed -= page->block_size;
+    if (!page->mapped) {
+        gc_heap_system_free(page);
+    } else if (heap->ncached < GC_HEAP_LARGE_CACHE) {
+        /* Keep the header page, the payload goes back to the system */
+        gc_heap_discard((char*) page + GC_HEAP_PAGE_SIZE, page->block_size - GC_HEAP_PAGE_SIZE);
+        page->next = heap->large_cache;
+        heap->large_cache = page;
+        heap->ncached++;
+    } else {
+        gc_heap_unmap(page, page->block_size);
+    }
+}
+
+static void gc_heap_list_release(Heap* heap, HeapPage* page) {
+    while (page) {
+        HeapPage* next = page->next;
+        gc_heap_release(heap, page);
+        page = next;
+    }
+}
+
+Heap* gc_heap_new(void) {
+    Heap* heap = (Heap*) calloc(1, sizeof(Heap));
+    if (!heap) {
+        return NULL;
+    }
+    heap->page_map = gc_page_map_new();
+    if (!heap->page_map) {
+        free(heap);
+        return NULL;
+    }
+    for (unsigned int i = 0; i < GC_HEAP_NUM_CLASSES; ++i) {
+        heap->classes[i].obj_size = gc_heap_class_size(i);
+    }
+    heap->mmap_threshold = GC_HEAP_MMAP_THRESHOLD;
+    return heap;
+}
+
+void gc_heap_delete(Heap* heap) {
+    LOG_DEBUG("Deleting heap (committed=%zu)", heap->committed);
+    for (unsigned int i = 0; i < GC_HEAP_NUM_CLASSES; ++i) {
+        gc_heap_list_release(heap, heap->classes[i].partial);
+        gc_heap_list_release(heap, heap->classes[i].full);
+    }
+    gc_heap_list_release(heap, heap->large);
+    while (heap->large_cache) {
+        HeapPage* next = heap->large_cache->next;
+        gc_heap_unmap(heap->large_cache, heap->large_cache->block_size);
+        heap->large_cache = next;
+    }
+    gc_page_map_delete(heap->page_map);
+    free(heap);
+}
+
+static HeapPage* gc_heap_page_new(Heap* heap, unsigned int size_class) {
+    HeapPage* page = (HeapPage*) gc_heap_system_alloc(GC_HEAP_PAGE_SIZE);
+    if (!page) {
+        errno = ENOMEM;
+        return NULL;
+    }
+    if (!gc_page_map_set(heap->page_map, page, GC_HEAP_PAGE_SIZE, page)) {
+        gc_heap_system_free(page);
+        errno = ENOMEM;
+        return NULL;
+    }
+    HeapClass* c = &heap->classes[size_class];
+    page->slots = (char*) page + GC_HEAP_HEADER_SIZE;
+    page->obj_size = c->obj_size;
+    page->obj_recip = (uint32_t) ((((uint64_t) 1 << 32) + c->obj_size - 1) / c->obj_size);
+    page->block_size = GC_HEAP_PAGE_SIZE;
+    page->nslots = (GC_HEAP_PAGE_SIZE - GC_HEAP_HEADER_SIZE) / c->obj_size;
+    page->nfree = page->nslots;
+    page->size_class = size_class;
+    page->unswept = false;
+    page->mapped = false;
+    page->sweep_next = NULL;
+    memset(page->cards, 0, sizeof(page->cards));
+    gc_heap_unmark_page(page);
+    /* Thread the free list through the slots in address order */
+    page->free_list = NULL;
+    for (size_t i = page->nslots; i > 0; --i) {
+        void* slot = page->slots + (i - 1) * page->obj_size;
+        *(void**) slot = page->free_list;
+        page->free_list = slot;
+    }
+    gc_heap_list_push(&c->partial, page);
+    c->npages++;
+    heap->committed += page->block_size;
+    LOG_DEBUG("Created heap page %p (class=%u, obj_size=%zu, slots=%zu)",
+              (void*) page, size_class, page->obj_size, page->nslots);
+    return page;
+}
+
+/*
+ * Takes a cached block that fits block_size bytes without wasting more
+ * than half of it.
+ */
+static HeapPage* gc_heap_large_cached(Heap* heap, size_t block_size) {
+    for (HeapPage** link = &heap->large_cache; *link; link = &(*link)->next) {
+        HeapPage* block = *link;
+        if (block->block_size >= block_size && block->block_size / 2 <= block_size) {
+            *link = block->next;
+            heap->ncached--;
+            return block;
+        }
+    }
+    return NULL;
+}
+
+static void* gc_heap_alloc_large(Heap* heap, size_t size) {
+    if (size > SIZE_MAX - GC_HEAP_HEADER_SIZE - GC_HEAP_PAGE_SIZE) {
+        errno = ENOMEM;
+        return NULL;
+    }
+    bool mapped = size > heap->mmap_threshold;
+    /* Mappings span whole pages, blocks from the system allocator only
+     * take what the object needs */
+    size_t align = mapped ? GC_HEAP_PAGE_SIZE : GC_HEAP_GRANULE;
+    size_t block_size = (GC_HEAP_HEADER_SIZE + size + align - 1) & ~(align - 1);
+    HeapPage* block = mapped ? gc_heap_large_cached(heap, block_size) : NULL;
+    if (block) {
+        block_size = block->block_size;
+        /* Only the pages behind the header page were discarded */
+        memset((char*) block + GC_HEAP_HEADER_SIZE, 0, GC_HEAP_PAGE_SIZE - GC_HEAP_HEADER_SIZE);
+    } else {
+        block = (HeapPage*) (mapped ? gc_heap_map(block_size) : gc_heap_system_alloc(block_size));
+    }
+    if (!block && mapped) {
+        /* Fall back to the system allocator where mapping is unavailable */
+        mapped = false;
+        block = (HeapPage*) gc_heap_system_alloc(block_size);
+    }
+    if (!block) {
+        errno = ENOMEM;
+        return NULL;
+    }
+    if (!gc_page_map_set(heap->page_map, block, block_size, block)) {
+        if (mapped) {
+            gc_heap_unmap(block, block_size);
+        } else {
+            gc_heap_system_free(block);
+        }
+        errno = ENOMEM;
+        return NULL;
+    }
+    block->free_list = NULL;
+    block->slots = (char*) block + GC_HEAP_HEADER_SIZE;
+    block->obj_size = size;
+    block->obj_recip = 0;
+    block->block_size = block_size;
+    block->nslots = 1;
+    block->nfree = 0;
+    block->size_class = GC_HEAP_LARGE_CLASS;
+    block->unswept = false;
+    block->mapped = mapped;
+    block->sweep_next = NULL;
+    memset(block->cards, 0, sizeof(block->cards));
+    gc_heap_unmark_page(block);
+    gc_heap_list_push(&heap->large, block);
+    heap->committed += block_size;
+    heap->used += size;
+    LOG_DEBUG("Created large block %p (size=%zu)", (void*) block, block_size);
+    return block->slots;
+}
+
+void* gc_heap_alloc(Heap* heap, size_t size) {
+    if (size > GC_HEAP_MAX_SMALL_SIZE) {
+        return gc_heap_alloc_large(heap, size);
+    }
+    unsigned int size_class = gc_heap_size_class(size);
+    HeapClass* c = &heap->classes[size_class];
+    HeapPage* page = c->partial;
+    if (!page && !(page = gc_heap_page_new(heap, size_class))) {
+        return NULL;
+    }
+    void* slot = page->free_list;
+    page->free_list = *(void**) slot;
+    if (--page->nfree == 0) {
+        gc_heap_list_unlink(&c->partial, page);
+        gc_heap_list_push(&c->full, page);
+    }
+    heap->used += page->obj_size;
+    return slot;
+}
+
+/*
+ * Returns empty pages to the system, but keeps the last partial page of the
+ * class around so alloc/free churn does not thrash the system allocator.
+ */
+static void gc_heap_release_if_empty(Heap* heap, HeapPage* page) {
+    if (page->size_class == GC_HEAP_LARGE_CLASS) {
+        if (page->nfree) {
+            gc_heap_list_unlink(&heap->large, page);
+            gc_heap_release(heap, page);
+        }
+        return;
+    }
+    HeapClass* c = &heap->classes[page->size_class];
+    if (page->nfree == page->nslots && (page->prev || page->next)) {
+        gc_heap_list_unlink(&c->partial, page);
+        c->npages--;
+        LOG_DEBUG("Releasing empty heap page %p (class=%u)",
+                  (void*) page, page->size_class);
+        gc_heap_release(heap, page);
+    }
+}
+
+void gc_heap_free(Heap* heap, void* ptr) {
+    HeapPage* page = gc_heap_page_of(ptr);
+    heap->used -= page->obj_size;
+    if (page->size_class == GC_HEAP_LARGE_CLASS) {
+        page->nfree = 1;
+    } else {
+        HeapClass* c = &heap->classes[page->size_class];
+        *(void**) ptr = page->free_list;
+        page->free_list = ptr;
+        if (page->nfree++ == 0) {
+            gc_heap_list_unlink(&c->full, page);
+            gc_heap_list_push(&c->partial, page);
+        }
+    }
+    /* The sweeper still holds unswept pages, it releases them when done */
+    if (!page->unswept) {
+        gc_heap_release_if_empty(heap, page);
+    }
+}
+
+/*
+ * Returns n slots of an unswept small page at once. They are chained
+ * through their first word from first to last, like the free list they
+ * are spliced into.
+ */
+void gc_heap_free_slots(Heap* heap, HeapPage* page, void* first, void* last, size_t n) {
+    HeapClass* c = &heap->classes[page->size_class];
+    heap->used -= n * page->obj_size;
+    *(void**) last = page->free_list;
+    page->free_list = first;
+    if (page->nfree == 0) {
+        gc_heap_list_unlink(&c->full, page);
+        gc_heap_list_push(&c->partial, page);
+    }
+    page->nfree += n;
+}
+
+size_t gc_heap_usable_size(void* ptr) {
+    HeapPage* page = gc_heap_page_of(ptr);
+    if (page->size_class == GC_HEAP_LARGE_CLASS) {
+        return page->block_size - GC_HEAP_HEADER_SIZE;
+    }
+    return page->obj_size;
+}
+
+/*
+ * Resizes an object within its usable size. A large block's payload size
+ * bounds interior pointers and card scans, so it follows the object.
+ */
+void gc_heap_resize(Heap* heap, void* ptr, size_t size) {
+    HeapPage* page = gc_heap_page_of(ptr);
+    if (page->size_class == GC_HEAP_LARGE_CLASS) {
+        /* the start has to stay resolvable */
+        size = size ? size : 1;
+        heap->used = heap->used - page->obj_size + size;
+        page->obj_size = size;
+    }
+}
+
+static void gc_heap_sweep_queue(Heap* heap, HeapPage** unswept, HeapPage* page) {
+    while (page) {
+        page->unswept = true;
+        page->sweep_next = *unswept;
+        *unswept = page;
+        heap->unswept++;
+        page = page->next;
+    }
+}
+
+void gc_heap_sweep_begin(Heap* heap) {
+    for (unsigned int i = 0; i < GC_HEAP_NUM_CLASSES; ++i) {
+        HeapClass* c = &heap->classes[i];
+        gc_heap_sweep_queue(heap, &c->unswept, c->full);
+        gc_heap_sweep_queue(heap, &c->unswept, c->partial);
+    }
+    gc_heap_sweep_queue(heap, &heap->unswept_large, heap->large);
+    LOG_DEBUG("Queued %zu pages for sweeping", heap->unswept);
+}
+
+/*
+ * Takes the next unswept page of a size class, or the next unswept large
+ * block for GC_HEAP_LARGE_CLASS. The page stays marked as unswept until it
+ * is passed to gc_heap_sweep_done.
+ */
+HeapPage* gc_heap_sweep_next(Heap* heap, unsigned int size_class) {
+    HeapPage** unswept = size_class == GC_HEAP_LARGE_CLASS
+                         ? &heap->unswept_large : &heap->classes[size_class].unswept;
+    HeapPage* page = *unswept;
+    if (page) {
+        *unswept = page->sweep_next;
+        page->sweep_next = NULL;
+    }
+    return page;
+}
+
+void gc_heap_sweep_done(Heap* heap, HeapPage* page) {
+    gc_heap_unmark_page(page);
+    page->unswept = false;
+    heap->unswept--;
+    gc_heap_release_if_empty(heap, page);
+}
+
+static void gc_heap_unmark_list(HeapPage* page) {
+    for (; page; page = page->next) {
+        gc_heap_unmark_page(page);
+    }
+}
+
+/*
+ * Clears the marks of every page, for marks that are dropped instead of
+ * being swept.
+ */
+void gc_heap_clear_marks(Heap* heap) {
+    for (unsigned int i = 0; i < GC_HEAP_NUM_CLASSES; ++i) {
+        gc_heap_unmark_list(heap->classes[i].partial);
+        gc_heap_unmark_list(heap->classes[i].full);
+    }
+    gc_heap_unmark_list(heap->large);
+}
@@ -0,0 +1,208 @@
+#ifndef HEAP_H
+#define HEAP_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+#include "page_map.h"
+
+/*
+ * Managed memory is carved out of size-aligned pages. Every page serves a
+ * single size class and keeps its own free list, so the page header of any
+ * pointer handed out by the heap is found by masking off the low address
+ * bits. Up to 2 KiB, classes are multiples of the granule and then four
+ * per power of two. Mid-size classes are sized by the number of slots
+ * that fill a page, from GC_HEAP_MEDIUM_SLOTS down to two, so they leave
+ * no tail unused. Objects above the largest size class get a dedicated
+ * block that spans as many pages as needed, with the header at its start.
+ *
+ * Every page of a block is registered in the heap's page map, which
+ * resolves arbitrary (interior) pointers to the object containing them.
+ *
+ * Mark bits live in a bitmap in the page header, one bit per slot (a
+ * single bit for large blocks), so marking and sweeping never write to
+ * the allocation map and a page's marks are cleared with one memset.
+ * Outside of a collection all bits are clear; a page's bits are cleared
+ * when it is swept.
+ *
+ * Pages are divided into cards of GC_HEAP_CARD_SIZE bytes that the write
+ * barrier marks dirty in generational mode. Large blocks only use their
+ * first card, which stands for the whole object.
+ *
+ * Blocks above the heap's mmap_threshold are mapped from the system
+ * directly and unmapped when they are released. A few released blocks are
+ * kept for reuse with their pages handed back to the system through
+ * MADV_DONTNEED, so they cost address space but no memory. Mapped blocks
+ * are always handed out zeroed.
+ *
+ * For lazy sweeping, gc_heap_sweep_begin queues every page and block on an
+ * unswept list. Unswept pages are never released by gc_heap_free; the
+ * sweeper hands them back with gc_heap_sweep_done once it has visited all
+ * of their slots.
+ */
+#define GC_HEAP_PAGE_SIZE ((size_t) 1 << GC_PAGE_SHIFT)
+#define GC_HEAP_GRANULE ((size_t) 16)
+#define GC_HEAP_MEDIUM_CLASS 24
+#define GC_HEAP_MEDIUM_SLOTS 15
+#define GC_HEAP_NUM_CLASSES (GC_HEAP_MEDIUM_CLASS + GC_HEAP_MEDIUM_SLOTS - 1)
+#define GC_HEAP_MAX_SMALL_SIZE \
+    (((GC_HEAP_PAGE_SIZE - GC_HEAP_HEADER_SIZE) / 2) & ~(GC_HEAP_GRANULE - 1))
+#define GC_HEAP_LARGE_CLASS GC_HEAP_NUM_CLASSES
+#define GC_HEAP_CARD_SHIFT 9
+#define GC_HEAP_CARD_SIZE ((size_t) 1 << GC_HEAP_CARD_SHIFT)
+#define GC_HEAP_CARDS (GC_HEAP_PAGE_SIZE >> GC_HEAP_CARD_SHIFT)
+#define GC_HEAP_MMAP_THRESHOLD ((size_t) 128 << 10)
+#define GC_HEAP_LARGE_CACHE 4
+#define GC_HEAP_MARK_WORDS (GC_HEAP_PAGE_SIZE / GC_HEAP_GRANULE / 64)
+
+typedef struct HeapPage {
+    struct HeapPage* next;    // next page in the partial/full/large list
+    struct HeapPage* prev;    // previous page in that list
+    void* free_list;          // singly linked list of free slots
+    char* slots;              // first slot (small) or payload (large)
+    size_t obj_size;          // slot size (small) or payload size (large)
+    uint32_t obj_recip;       // ceil(2^32 / obj_size) to divide offsets by the slot size
+    size_t block_size;        // bytes spanned by the page or block
+    size_t nslots;            // number of slots in the page
+    size_t nfree;             // number of slots on the free list
+    unsigned int size_class;  // index into Heap.classes or GC_HEAP_LARGE_CLASS
+    bool unswept;             // queued for the pending sweep
+    bool mapped;              // block obtained with mmap
+    struct HeapPage* sweep_next; // next page in the unswept list
+    uint8_t cards[GC_HEAP_CARDS]; // cards written to since the last minor collection
+    uint64_t marks[GC_HEAP_MARK_WORDS]; // mark bit of every slot
+} HeapPage;
+
+/*
+ * Page headers are padded so that the first slot keeps the heap granule
+ * alignment.
+ */
+#define GC_HEAP_HEADER_SIZE \
+    ((sizeof(HeapPage) + GC_HEAP_GRANULE - 1) & ~(GC_HEAP_GRANULE - 1))
+
+typedef struct HeapClass {
+    size_t obj_size;          // slot size of this class
+    size_t npages;            // pages currently owned by this class
+    HeapPage* partial;        // pages with at least one free slot
+    HeapPage* full;           // pages without free slots
+    HeapPage* unswept;        // pages not yet visited by the pending sweep
+} HeapClass;
+
+typedef struct Heap {
+    HeapClass classes[GC_HEAP_NUM_CLASSES];
+    HeapPage* large;          // dedicated blocks for large objects
+    HeapPage* unswept_large;  // large blocks not yet visited by the pending sweep
+    HeapPage* large_cache;    // released mapped blocks kept for reuse
+    size_t ncached;           // blocks in large_cache
+    size_t mmap_threshold;    // large objects above this size are mapped
+    size_t unswept;           // pages and blocks left to sweep
+    size_t committed;         // bytes currently obtained from the system
+    size_t used;              // bytes in slots and blocks handed out
+    PageMap* page_map;        // page number -> owning page or block
+} Heap;
+
+Heap* gc_heap_new(void);
+void gc_heap_delete(Heap* heap);
+
+unsigned int gc_heap_size_class(size_t size);
+
+void* gc_heap_alloc(Heap* heap, size_t size);
+void gc_heap_free(Heap* heap, void* ptr);
+void gc_heap_free_slots(Heap* heap, HeapPage* page, void* first, void* last, size_t n);
+size_t gc_heap_usable_size(void* ptr);
+void gc_heap_resize(Heap* heap, void* ptr, size_t size);
+
+void gc_heap_sweep_begin(Heap* heap);
+HeapPage* gc_heap_sweep_next(Heap* heap, unsigned int size_class);
+void gc_heap_sweep_done(Heap* heap, HeapPage* page);
+void gc_heap_clear_marks(Heap* heap);
+
+static inline HeapPage* gc_heap_page_of(void* ptr) {
+    return (HeapPage*) ((uintptr_t) ptr & ~(uintptr_t) (GC_HEAP_PAGE_SIZE - 1));
+}
+
+/*
+ * Slot number of an object start within its page.
+ */
+static inline size_t gc_heap_slot_index(HeapPage* page, void* ptr) {
+    if (page->size_class == GC_HEAP_LARGE_CLASS) {
+        return 0;
+    }
+    /* offsets are below 2^16, where multiplying by the reciprocal is exact */
+    size_t offset = (size_t) ((char*) ptr - page->slots);
+    return (size_t) (((uint64_t) offset * page->obj_recip) >> 32);
+}
+
+static inline bool gc_heap_is_marked(void* ptr) {
+    HeapPage* page = gc_heap_page_of(ptr);
+    size_t i = gc_heap_slot_index(page, ptr);
+    return (page->marks[i / 64] >> (i % 64)) & 1;
+}
+
+/*
+ * Sets the mark bit of an object start. Returns whether it was set before.
+ */
+static inline bool gc_heap_mark(void* ptr) {
+    HeapPage* page = gc_heap_page_of(ptr);
+    size_t i = gc_heap_slot_index(page, ptr);
+    uint64_t bit = (uint64_t) 1 << (i % 64);
+    bool marked = page->marks[i / 64] & bit;
+    page->marks[i / 64] |= bit;
+    return marked;
+}
+
+/*
+ * gc_heap_mark for concurrent markers. Only one of them sees false.
+ */
+static inline bool gc_heap_mark_atomic(void* ptr) {
+    HeapPage* page = gc_heap_page_of(ptr);
+    size_t i = gc_heap_slot_index(page, ptr);
+    uint64_t bit = (uint64_t) 1 << (i % 64);
+    return __atomic_fetch_or(&page->marks[i / 64], bit, __ATOMIC_RELAXED) & bit;
+}
+
+static inline void gc_heap_unmark_page(HeapPage* page) {
+    memset(page->marks, 0, sizeof(page->marks));
+}
+
+/*
+ * Marks the cards covering [ptr, ptr + size) of an object dirty.
+ */
+static inline void gc_heap_dirty_cards(void* ptr, size_t size) {
+    HeapPage* page = gc_heap_page_of(ptr);
+    if (page->size_class == GC_HEAP_LARGE_CLASS) {
+        page->cards[0] = 1;
+        return;
+    }
+    size_t first = ((uintptr_t) ptr & (GC_HEAP_PAGE_SIZE - 1)) >> GC_HEAP_CARD_SHIFT;
+    size_t last = (((uintptr_t) ptr & (GC_HEAP_PAGE_SIZE - 1)) + (size ? size - 1 : 0)) >> GC_HEAP_CARD_SHIFT;
+    for (size_t i = first; i <= last; ++i) {
+        page->cards[i] = 1;
+    }
+}
+
+/*
+ * Resolves any pointer into a slot of the heap to the start of that slot.
+ * Returns NULL for pointers outside of the heap, into page headers or past
+ * the end of a large object. Free slots are resolved as well, so callers
+ * still have to consult the allocation map.
+ */
+static inline void* gc_heap_object_start(Heap* heap, void* ptr) {
+    HeapPage* page = gc_page_map_lookup(heap->page_map, ptr);
+    if (!page || (char*) ptr < page->slots) {
+        return NULL;
+    }
+    size_t offset = (size_t) ((char*) ptr - page->slots);
+    if (page->size_class == GC_HEAP_LARGE_CLASS) {
+        return offset < page->obj_size ? page->slots : NULL;
+    }
+    /* offsets are below 2^16, where multiplying by the reciprocal is exact */
+    size_t index = (size_t) (((uint64_t) offset * page->obj_recip) >> 32);
+    if (index >= page->nslots) {
+        return NULL;
+    }
+    return page->slots + index * page->obj_size;
+}
+
+#endif
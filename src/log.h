@@ -3,7 +3,13 @@
 
 #include <stdio.h>
 
-#define LOGLEVEL LOGLEVEL_DEBUG
+/*
+ * Messages above LOGLEVEL are compiled out. Collector activity is traced
+ * with GC_TRACE (see trace.h) rather than logged.
+ */
+#ifndef LOGLEVEL
+#define LOGLEVEL LOGLEVEL_WARNING
+#endif
 
 enum {
     LOGLEVEL_CRITICAL,
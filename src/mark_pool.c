@@ -0,0 +1,252 @@
+#include <pthread.h>
+#include <sched.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+#include "log.h"
+#include "mark_pool.h"
+
+static bool gc_mark_deque_push(MarkDeque* dq, void* ptr, size_t size,
+                               const struct GcLayout* layout, bool grow) {
+    pthread_mutex_lock(&dq->lock);
+    if (dq->top == dq->capacity) {
+        /* Stolen items leave a gap at the bottom. Grow only if compacting
+         * would not free at least half of the deque. */
+        size_t n = dq->top - dq->bottom;
+        if (!grow && !dq->bottom) {
+            pthread_mutex_unlock(&dq->lock);
+            return false;
+        }
+        if (grow && dq->bottom <= dq->capacity / 2) {
+            size_t capacity = dq->capacity ? dq->capacity * 2 : 256;
+            WorkItem* items = (WorkItem*) realloc(dq->items, capacity * sizeof(WorkItem));
+            if (!items) {
+                pthread_mutex_unlock(&dq->lock);
+                return false;
+            }
+            dq->items = items;
+            dq->capacity = capacity;
+        }
+        memmove(dq->items, dq->items + dq->bottom, n * sizeof(WorkItem));
+        __atomic_store_n(&dq->bottom, 0, __ATOMIC_RELEASE);
+        __atomic_store_n(&dq->top, n, __ATOMIC_RELEASE);
+    }
+    dq->items[dq->top].ptr = (char*) ptr;
+    dq->items[dq->top].size = size;
+    dq->items[dq->top].layout = layout;
+    __atomic_store_n(&dq->top, dq->top + 1, __ATOMIC_RELEASE);
+    pthread_mutex_unlock(&dq->lock);
+    return true;
+}
+
+static bool gc_mark_deque_pop(MarkDeque* dq, WorkItem* item) {
+    bool found = false;
+    pthread_mutex_lock(&dq->lock);
+    if (dq->top > dq->bottom) {
+        *item = dq->items[dq->top - 1];
+        __atomic_store_n(&dq->top, dq->top - 1, __ATOMIC_RELEASE);
+        found = true;
+    }
+    pthread_mutex_unlock(&dq->lock);
+    return found;
+}
+
+static bool gc_mark_deque_steal(MarkDeque* dq, WorkItem* item) {
+    /* Cheap unlocked check first, most deques are empty while stealing */
+    if (__atomic_load_n(&dq->top, __ATOMIC_ACQUIRE) == __atomic_load_n(&dq->bottom, __ATOMIC_ACQUIRE)) {
+        return false;
+    }
+    bool found = false;
+    pthread_mutex_lock(&dq->lock);
+    if (dq->top > dq->bottom) {
+        *item = dq->items[dq->bottom];
+        __atomic_store_n(&dq->bottom, dq->bottom + 1, __ATOMIC_RELEASE);
+        found = true;
+    }
+    pthread_mutex_unlock(&dq->lock);
+    return found;
+}
+
+static bool gc_mark_deque_empty(MarkDeque* dq) {
+    return __atomic_load_n(&dq->top, __ATOMIC_ACQUIRE) == __atomic_load_n(&dq->bottom, __ATOMIC_ACQUIRE);
+}
+
+static bool gc_mark_pool_steal(MarkPool* pool, size_t worker, WorkItem* item) {
+    for (size_t i = 1; i < pool->nworkers; ++i) {
+        if (gc_mark_deque_steal(&pool->deques[(worker + i) % pool->nworkers], item)) {
+            return true;
+        }
+    }
+    return false;
+}
+
+/*
+ * Works until the whole pool runs out of work. A worker only counts itself
+ * as idle with an empty deque, and deques only fill up through pushes of
+ * busy workers, so all deques are empty once every worker is idle.
+ */
+static void gc_mark_pool_work(MarkPool* pool, size_t worker) {
+    MarkDeque* own = &pool->deques[worker];
+    WorkItem item;
+    for (;;) {
+        while (gc_mark_deque_pop(own, &item) || gc_mark_pool_steal(pool, worker, &item)) {
+            pool->scan(pool->ctx, pool, worker, &item);
+        }
+        __atomic_add_fetch(&pool->idle, 1, __ATOMIC_ACQ_REL);
+        bool found = false;
+        while (!found) {
+            if (__atomic_load_n(&pool->idle, __ATOMIC_ACQUIRE) == pool->nworkers) {
+                return;
+            }
+            for (size_t i = 0; i < pool->nworkers && !found; ++i) {
+                found = !gc_mark_deque_empty(&pool->deques[i]);
+            }
+            if (!found) {
+                sched_yield();
+            }
+        }
+        __atomic_sub_fetch(&pool->idle, 1, __ATOMIC_ACQ_REL);
+    }
+}
+
+static void* gc_mark_pool_thread(void* arg) {
+    MarkPool* pool = (MarkPool*) arg;
+    pthread_mutex_lock(&pool->lock);
+    /* Worker ids are handed out in creation order */
+    size_t worker = ++pool->finished;
+    unsigned long seen = pool->phase;
+    pthread_cond_signal(&pool->done);
+    for (;;) {
+        while (pool->phase == seen && !pool->shutdown) {
+            pthread_cond_wait(&pool->start, &pool->lock);
+        }
+        if (pool->shutdown) {
+            break;
+        }
+        seen = pool->phase;
+        pthread_mutex_unlock(&pool->lock);
+        gc_mark_pool_work(pool, worker);
+        pthread_mutex_lock(&pool->lock);
+        pool->finished++;
+        pthread_cond_signal(&pool->done);
+    }
+    pthread_mutex_unlock(&pool->lock);
+    return NULL;
+}
+
+MarkPool* gc_mark_pool_new(size_t nworkers, MarkPoolScanFn scan, void* ctx) {
+    MarkPool* pool = (MarkPool*) calloc(1, sizeof(MarkPool));
+    if (!pool) {
+        return NULL;
+    }
+    pool->deques = (MarkDeque*) calloc(nworkers, sizeof(MarkDeque));
+    pool->threads = (pthread_t*) calloc(nworkers, sizeof(pthread_t));
+    if (!pool->deques || !pool->threads) {
+        free(pool->deques);
+        free(pool->threads);
+        free(pool);
+        return NULL;
+    }
+    pool->scan = scan;
+    pool->ctx = ctx;
+    pthread_mutex_init(&pool->lock, NULL);
+    pthread_cond_init(&pool->start, NULL);
+    pthread_cond_init(&pool->done, NULL);
+    for (size_t i = 0; i < nworkers; ++i) {
+        pthread_mutex_init(&pool->deques[i].lock, NULL);
+    }
+    /* Start the threads one by one so each picks up its own worker id */
+    pool->nworkers = 1;
+    pthread_mutex_lock(&pool->lock);
+    for (size_t i = 1; i < nworkers; ++i) {
+        if (pthread_create(&pool->threads[i - 1], NULL, gc_mark_pool_thread, pool) != 0) {
+            LOG_WARNING("Failed to start mark thread %zu, continuing with %zu", i, pool->nworkers);
+            break;
+        }
+        while (pool->finished < i) {
+            pthread_cond_wait(&pool->done, &pool->lock);
+        }
+        pool->nworkers++;
+    }
+    pool->finished = 0;
+    pthread_mutex_unlock(&pool->lock);
+    LOG_DEBUG("Started mark pool with %zu workers", pool->nworkers);
+    return pool;
+}
+
+void gc_mark_pool_delete(MarkPool* pool) {
+    pthread_mutex_lock(&pool->lock);
+    pool->shutdown = true;
+    pthread_cond_broadcast(&pool->start);
+    pthread_mutex_unlock(&pool->lock);
+    for (size_t i = 1; i < pool->nworkers; ++i) {
+        pthread_join(pool->threads[i - 1], NULL);
+    }
+    for (size_t i = 0; i < pool->nworkers; ++i) {
+        pthread_mutex_destroy(&pool->deques[i].lock);
+        free(pool->deques[i].items);
+    }
+    pthread_cond_destroy(&pool->done);
+    pthread_cond_destroy(&pool->start);
+    pthread_mutex_destroy(&pool->lock);
+    free(pool->deques);
+    free(pool->threads);
+    free(pool);
+}
+
+bool gc_mark_pool_push(MarkPool* pool, size_t worker, void* ptr, size_t size,
+                       const struct GcLayout* layout) {
+    if (!gc_mark_deque_push(&pool->deques[worker], ptr, size, layout, !pool->fixed)) {
+        __atomic_store_n(&pool->overflowed, true, __ATOMIC_RELAXED);
+        return false;
+    }
+    return true;
+}
+
+/*
+ * Spreads the initial items over all workers and marks in parallel until
+ * no work is left. Returns false if a push failed, in which case the
+ * caller has to rescan the marked objects for unmarked children.
+ */
+bool gc_mark_pool_run(MarkPool* pool, Worklist* initial) {
+    WorkItem item;
+    size_t worker = 0;
+    pool->overflowed = false;
+    while (gc_worklist_pop(initial, &item)) {
+        gc_mark_pool_push(pool, worker, item.ptr, item.size, item.layout);
+        worker = (worker + 1) % pool->nworkers;
+    }
+    pthread_mutex_lock(&pool->lock);
+    pool->idle = 0;
+    pool->finished = 0;
+    pool->phase++;
+    pthread_cond_broadcast(&pool->start);
+    pthread_mutex_unlock(&pool->lock);
+
+    gc_mark_pool_work(pool, 0);
+
+    /* Pool threads may still be leaving the phase, wait until they are out */
+    pthread_mutex_lock(&pool->lock);
+    while (pool->finished < pool->nworkers - 1) {
+        pthread_cond_wait(&pool->done, &pool->lock);
+    }
+    pthread_mutex_unlock(&pool->lock);
+    return !pool->overflowed;
+}
+
+/*
+ * Doubles the capacity of every deque ahead of a phase in which they may
+ * not grow.
+ */
+void gc_mark_pool_reserve(MarkPool* pool) {
+    for (size_t i = 0; i < pool->nworkers; ++i) {
+        MarkDeque* dq = &pool->deques[i];
+        size_t capacity = dq->capacity ? dq->capacity * 2 : 256;
+        WorkItem* items = (WorkItem*) realloc(dq->items, capacity * sizeof(WorkItem));
+        if (items) {
+            dq->items = items;
+            dq->capacity = capacity;
+        }
+    }
+}
@@ -0,0 +1,55 @@
+#ifndef MARK_POOL_H
+#define MARK_POOL_H
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include "worklist.h"
+
+/*
+ * Thread pool for parallel marking. Every worker owns a deque of objects
+ * waiting to be scanned: it pushes and pops at the top of its own deque and
+ * steals from the bottom of the others' deques when it runs dry. A phase
+ * ends once all workers are idle at the same time, which can only happen
+ * when every deque is empty.
+ *
+ * The thread starting a phase takes part in it as worker 0, so a pool of n
+ * workers runs n - 1 threads of its own.
+ */
+struct MarkPool;
+
+typedef void (*MarkPoolScanFn)(void* ctx, struct MarkPool* pool, size_t worker, WorkItem* item);
+
+typedef struct MarkDeque {
+    pthread_mutex_t lock;
+    WorkItem* items;
+    size_t bottom;            // index of the oldest item
+    size_t top;               // one past the newest item
+    size_t capacity;
+} MarkDeque;
+
+typedef struct MarkPool {
+    size_t nworkers;          // number of workers including the caller
+    pthread_t* threads;       // nworkers - 1 pool threads
+    MarkDeque* deques;        // one deque per worker
+    MarkPoolScanFn scan;      // scans one item on behalf of a worker
+    void* ctx;                // passed through to scan
+    pthread_mutex_t lock;     // protects the phase bookkeeping below
+    pthread_cond_t start;     // signals a new phase (or shutdown)
+    pthread_cond_t done;      // signals that a pool thread finished its phase
+    unsigned long phase;      // number of phases started
+    size_t finished;          // pool threads done with the current phase
+    size_t idle;              // workers out of work in the current phase
+    bool overflowed;          // a push failed during the current phase
+    bool fixed;               // deques may not grow while this is set
+    bool shutdown;
+} MarkPool;
+
+MarkPool* gc_mark_pool_new(size_t nworkers, MarkPoolScanFn scan, void* ctx);
+void gc_mark_pool_delete(MarkPool* pool);
+bool gc_mark_pool_push(MarkPool* pool, size_t worker, void* ptr, size_t size,
+                       const struct GcLayout* layout);
+bool gc_mark_pool_run(MarkPool* pool, Worklist* initial);
+void gc_mark_pool_reserve(MarkPool* pool);
+
+#endif
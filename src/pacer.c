@@ -0,0 +1,94 @@
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <time.h>
+#include "log.h"
+#include "pacer.h"
+
+Pacer* gc_pacer_new(double growth, size_t min_goal, double cpu_fraction) {
+    Pacer* pacer = (Pacer*) malloc(sizeof(Pacer));
+    if (!pacer) {
+        return NULL;
+    }
+    pacer->growth = growth;
+    pacer->cpu_fraction = cpu_fraction;
+    pacer->min_goal = min_goal;
+    pacer->live = 0;
+    pacer->goal = min_goal;
+    pacer->gc_ns = 0;
+    pacer->clock_ns = 0;
+    pacer->cycle_end_ns = gc_pacer_now();
+    return pacer;
+}
+
+void gc_pacer_delete(Pacer* pacer) {
+    free(pacer);
+}
+
+uint64_t gc_pacer_now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000u + (uint64_t) ts.tv_nsec;
+}
+
+/*
+ * Starts timing collector work, unless there is no CPU fraction target or
+ * an outer call is timing already. Returns whether the clock was started.
+ */
+bool gc_pacer_clock_start(Pacer* pacer) {
+    if (pacer->cpu_fraction <= 0.0 || pacer->clock_ns) {
+        return false;
+    }
+    pacer->clock_ns = gc_pacer_now();
+    return true;
+}
+
+void gc_pacer_clock_stop(Pacer* pacer, bool started) {
+    if (started) {
+        pacer->gc_ns += gc_pacer_now() - pacer->clock_ns;
+        pacer->clock_ns = 0;
+    }
+}
+
+/*
+ * Adds to live while saturating, huge growth factors disable collection.
+ */
+static size_t gc_pacer_add(size_t live, double bytes) {
+    if (bytes >= (double) (SIZE_MAX - live)) {
+        return SIZE_MAX;
+    }
+    return live + (size_t) bytes;
+}
+
+void gc_pacer_cycle_done(Pacer* pacer, size_t live) {
+    uint64_t now = gc_pacer_now();
+    if (pacer->clock_ns) {
+        /* Cycles usually complete while collector work is timed, the rest
+         * of that work counts towards the next cycle */
+        pacer->gc_ns += now - pacer->clock_ns;
+        pacer->clock_ns = now;
+    }
+    size_t goal = gc_pacer_add(live, (double) live * pacer->growth);
+    goal = goal < pacer->min_goal ? pacer->min_goal : goal;
+    uint64_t period = now - pacer->cycle_end_ns;
+    double f = pacer->cpu_fraction;
+    if (f > 0.0 && f < 1.0 && pacer->gc_ns && period > pacer->gc_ns) {
+        /* The mutator allocated the last runway in the time the collector
+         * left it. To keep collecting below the target fraction, it has to
+         * run gc_ns * (1 - f) / f between cycles. */
+        double mutator_ns = (double) (period - pacer->gc_ns);
+        double wanted_ns = (double) pacer->gc_ns * (1.0 - f) / f;
+        if (wanted_ns > mutator_ns) {
+            double runway = (double) (pacer->goal > pacer->live ? pacer->goal - pacer->live : 0);
+            size_t paced = gc_pacer_add(live, runway * wanted_ns / mutator_ns);
+            goal = paced > goal ? paced : goal;
+        }
+    }
+    LOG_DEBUG("Pacer: live=%zu, goal=%zu, gc_ns=%llu, period_ns=%llu", live, goal,
+              (unsigned long long) pacer->gc_ns, (unsigned long long) period);
+    pacer->live = live;
+    pacer->goal = goal;
+    pacer->gc_ns = 0;
+    pacer->cycle_end_ns = now;
+}
@@ -0,0 +1,38 @@
+#ifndef PACER_H
+#define PACER_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Decides when the next collection starts. Once a cycle has completed,
+ * the heap may grow by `growth` times the bytes that survived it before
+ * the next one is triggered, but never stays below `min_goal`.
+ *
+ * With a CPU fraction target, the time spent collecting is accounted per
+ * cycle, between gc_pacer_clock_start and gc_pacer_clock_stop. If the
+ * collector took more than that share of the time since the previous
+ * cycle, the goal is raised until the mutator, allocating at the rate it
+ * just did, runs long enough to bring the share back down.
+ */
+typedef struct Pacer {
+    double growth;            // heap growth over the live bytes before collecting
+    double cpu_fraction;      // target share of time spent collecting, 0 for none
+    size_t min_goal;          // smallest heap goal in bytes
+    size_t live;              // bytes in use after the last completed cycle
+    size_t goal;              // bytes in use that trigger the next cycle
+    uint64_t gc_ns;           // time spent collecting in the current cycle
+    uint64_t clock_ns;        // start of the collector work being timed, 0 if none
+    uint64_t cycle_end_ns;    // when the last cycle completed
+} Pacer;
+
+Pacer* gc_pacer_new(double growth, size_t min_goal, double cpu_fraction);
+void gc_pacer_delete(Pacer* pacer);
+
+uint64_t gc_pacer_now(void);
+bool gc_pacer_clock_start(Pacer* pacer);
+void gc_pacer_clock_stop(Pacer* pacer, bool started);
+void gc_pacer_cycle_done(Pacer* pacer, size_t live);
+
+#endif
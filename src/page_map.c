@@ -0,0 +1,52 @@
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include "log.h"
+#include "page_map.h"
+
+PageMap* gc_page_map_new(void) {
+    return (PageMap*) calloc(1, sizeof(PageMap));
+}
+
+void gc_page_map_delete(PageMap* pm) {
+    for (size_t i = 0; i < GC_PAGE_MAP_ROOT_SIZE; ++i) {
+        free(pm->leaves[i]);
+    }
+    free(pm);
+}
+
+bool gc_page_map_set(PageMap* pm, void* start, size_t size, struct HeapPage* page) {
+    uintptr_t first = (uintptr_t) start >> GC_PAGE_SHIFT;
+    uintptr_t last = ((uintptr_t) start + size - 1) >> GC_PAGE_SHIFT;
+    if (last >> GC_PAGE_MAP_PAGE_BITS) {
+        LOG_WARNING("Address %p is outside of the page map", start);
+        return false;
+    }
+    for (uintptr_t n = first; n <= last; ++n) {
+        struct HeapPage*** leaf = &pm->leaves[n >> GC_PAGE_MAP_LEAF_BITS];
+        if (!*leaf) {
+            *leaf = (struct HeapPage**) calloc(GC_PAGE_MAP_LEAF_SIZE, sizeof(struct HeapPage*));
+            if (!*leaf) {
+                gc_page_map_clear(pm, start, (n - first) << GC_PAGE_SHIFT);
+                return false;
+            }
+        }
+        (*leaf)[n & (GC_PAGE_MAP_LEAF_SIZE - 1)] = page;
+    }
+    return true;
+}
+
+void gc_page_map_clear(PageMap* pm, void* start, size_t size) {
+    if (!size) {
+        return;
+    }
+    uintptr_t first = (uintptr_t) start >> GC_PAGE_SHIFT;
+    uintptr_t last = ((uintptr_t) start + size - 1) >> GC_PAGE_SHIFT;
+    for (uintptr_t n = first; n <= last; ++n) {
+        struct HeapPage** leaf = pm->leaves[n >> GC_PAGE_MAP_LEAF_BITS];
+        if (leaf) {
+            leaf[n & (GC_PAGE_MAP_LEAF_SIZE - 1)] = NULL;
+        }
+    }
+}
@@ -0,0 +1,52 @@
+#ifndef PAGE_MAP_H
+#define PAGE_MAP_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Two-level table from heap page numbers to page headers. The root is
+ * indexed by the high bits of an address and points to lazily allocated
+ * leaves indexed by the remaining page-number bits, so any word can be
+ * resolved to its heap page (or rejected) with at most two loads.
+ */
+#define GC_PAGE_SHIFT 15
+
+#if UINTPTR_MAX > 0xffffffffu
+#define GC_PAGE_MAP_ADDRESS_BITS 48
+#else
+#define GC_PAGE_MAP_ADDRESS_BITS 32
+#endif
+#define GC_PAGE_MAP_PAGE_BITS (GC_PAGE_MAP_ADDRESS_BITS - GC_PAGE_SHIFT)
+#define GC_PAGE_MAP_LEAF_BITS (GC_PAGE_MAP_PAGE_BITS / 2)
+#define GC_PAGE_MAP_ROOT_BITS (GC_PAGE_MAP_PAGE_BITS - GC_PAGE_MAP_LEAF_BITS)
+#define GC_PAGE_MAP_LEAF_SIZE ((size_t) 1 << GC_PAGE_MAP_LEAF_BITS)
+#define GC_PAGE_MAP_ROOT_SIZE ((size_t) 1 << GC_PAGE_MAP_ROOT_BITS)
+
+struct HeapPage;
+
+typedef struct PageMap {
+    struct HeapPage** leaves[GC_PAGE_MAP_ROOT_SIZE];
+} PageMap;
+
+PageMap* gc_page_map_new(void);
+void gc_page_map_delete(PageMap* pm);
+bool gc_page_map_set(PageMap* pm, void* start, size_t size, struct HeapPage* page);
+void gc_page_map_clear(PageMap* pm, void* start, size_t size);
+
+static inline struct HeapPage* gc_page_map_lookup(const PageMap* pm, const void* ptr) {
+    uintptr_t addr = (uintptr_t) ptr;
+#if UINTPTR_MAX > 0xffffffffu
+    if (addr >> GC_PAGE_MAP_ADDRESS_BITS) {
+        return NULL;
+    }
+#endif
+    struct HeapPage** leaf = pm->leaves[addr >> (GC_PAGE_SHIFT + GC_PAGE_MAP_LEAF_BITS)];
+    if (!leaf) {
+        return NULL;
+    }
+    return leaf[(addr >> GC_PAGE_SHIFT) & (GC_PAGE_MAP_LEAF_SIZE - 1)];
+}
+
+#endif
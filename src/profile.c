@@ -0,0 +1,362 @@
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE // dladdr
+#endif
+#include <pthread.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "profile.h"
+
+/* log.h takes the name log, so libm is called through the builtins */
+#define gc_profile_log __builtin_log
+#define gc_profile_exp __builtin_exp
+
+#if defined(__linux__)
+#include <dlfcn.h>
+#include <execinfo.h>
+#endif
+
+Profiler* gc_profiler_new(size_t interval) {
+    Profiler* prof = (Profiler*) calloc(1, sizeof(Profiler));
+    if (!prof) {
+        return NULL;
+    }
+    pthread_mutex_init(&prof->lock, NULL);
+    prof->rng = 0x9e3779b97f4a7c15u ^ (uintptr_t) prof;
+    gc_profiler_set_interval(prof, interval);
+#if defined(__linux__)
+    /* The first backtrace loads the unwinder, which allocates; get that
+     * out of the way before an allocation is sampled */
+    void* frame;
+    backtrace(&frame, 1);
+#endif
+    return prof;
+}
+
+void gc_profiler_delete(Profiler* prof) {
+    free(prof->sites);
+    free(prof->site_index);
+    free(prof->samples);
+    pthread_mutex_destroy(&prof->lock);
+    free(prof);
+}
+
+/*
+ * Changes the mean distance between samples. Samples taken so far keep
+ * being tracked when sampling stops.
+ */
+void gc_profiler_set_interval(Profiler* prof, size_t interval) {
+    pthread_mutex_lock(&prof->lock);
+    if (interval) {
+        prof->rate = interval;
+    }
+    __atomic_store_n(&prof->interval, interval, __ATOMIC_RELAXED);
+    pthread_mutex_unlock(&prof->lock);
+    prof->countdown = gc_profiler_next(prof);
+    __atomic_add_fetch(&prof->epoch, 1, __ATOMIC_RELAXED);
+}
+
+/*
+ * Draws the number of bytes until the next sample.
+ */
+int64_t gc_profiler_next(Profiler* prof) {
+    pthread_mutex_lock(&prof->lock);
+    prof->rng ^= prof->rng << 13;
+    prof->rng ^= prof->rng >> 7;
+    prof->rng ^= prof->rng << 17;
+    /* uniform in (0, 1] from the top 53 bits */
+    double u = (double) ((prof->rng >> 11) + 1) / 9007199254740992.0;
+    double distance = -gc_profile_log(u) * (double) prof->interval;
+    pthread_mutex_unlock(&prof->lock);
+    return distance < 1.0 ? 1 : distance > (double) INT64_MAX / 2 ? INT64_MAX / 2 : (int64_t) distance;
+}
+
+static size_t gc_profiler_hash_ptr(void* ptr, size_t capacity) {
+    return (size_t) (((uintptr_t) ptr >> 4) * 0x9e3779b97f4a7c15u) & (capacity - 1);
+}
+
+static bool gc_profiler_grow_samples(Profiler* prof) {
+    size_t capacity = prof->samples_capacity ? 2 * prof->samples_capacity : 256;
+    ProfileSample* samples = (ProfileSample*) calloc(capacity, sizeof(ProfileSample));
+    if (!samples) {
+        return false;
+    }
+    for (size_t i = 0; i < prof->samples_capacity; ++i) {
+        ProfileSample* s = &prof->samples[i];
+        if (s->ptr) {
+            size_t j = gc_profiler_hash_ptr(s->ptr, capacity);
+            while (samples[j].ptr) {
+                j = (j + 1) & (capacity - 1);
+            }
+            samples[j] = *s;
+        }
+    }
+    free(prof->samples);
+    prof->samples = samples;
+    prof->samples_capacity = capacity;
+    return true;
+}
+
+/*
+ * Slot of the sample of ptr, or of the empty slot where it would go.
+ */
+static size_t gc_profiler_find_sample(Profiler* prof, void* ptr) {
+    size_t i = gc_profiler_hash_ptr(ptr, prof->samples_capacity);
+    while (prof->samples[i].ptr && prof->samples[i].ptr != ptr) {
+        i = (i + 1) & (prof->samples_capacity - 1);
+    }
+    return i;
+}
+
+static void gc_profiler_remove_sample(Profiler* prof, size_t i) {
+    size_t mask = prof->samples_capacity - 1;
+    prof->samples[i].ptr = NULL;
+    prof->nsamples--;
+    /* backward shift deletion keeps probe sequences unbroken */
+    for (size_t j = (i + 1) & mask; prof->samples[j].ptr; j = (j + 1) & mask) {
+        size_t home = gc_profiler_hash_ptr(prof->samples[j].ptr, prof->samples_capacity);
+        if (((j - home) & mask) >= ((j - i) & mask)) {
+            prof->samples[i] = prof->samples[j];
+            prof->samples[j].ptr = NULL;
+            i = j;
+        }
+    }
+}
+
+/*
+ * Returns the site of a backtrace, creating it on first sight, or
+ * UINT32_MAX if there is no memory for it.
+ */
+static uint32_t gc_profiler_intern(Profiler* prof, void** frames, size_t depth) {
+    uint64_t hash = 0xcbf29ce484222325u;
+    for (size_t i = 0; i < depth; ++i) {
+        hash = (hash ^ (uintptr_t) frames[i]) * 0x100000001b3u;
+    }
+    if (2 * (prof->nsites + 1) > prof->site_index_capacity) {
+        size_t capacity = prof->site_index_capacity ? 2 * prof->site_index_capacity : 256;
+        uint32_t* index = (uint32_t*) calloc(capacity, sizeof(uint32_t));
+        if (!index) {
+            return UINT32_MAX;
+        }
+        for (size_t s = 0; s < prof->nsites; ++s) {
+            size_t j = (size_t) prof->sites[s].hash & (capacity - 1);
+            while (index[j]) {
+                j = (j + 1) & (capacity - 1);
+            }
+            index[j] = (uint32_t) s + 1;
+        }
+        free(prof->site_index);
+        prof->site_index = index;
+        prof->site_index_capacity = capacity;
+    }
+    size_t mask = prof->site_index_capacity - 1;
+    size_t i = (size_t) hash & mask;
+    for (; prof->site_index[i]; i = (i + 1) & mask) {
+        ProfileSite* site = &prof->sites[prof->site_index[i] - 1];
+        if (site->hash == hash && site->depth == depth
+            && memcmp(site->frames, frames, depth * sizeof(void*)) == 0) {
+            return prof->site_index[i] - 1;
+        }
+    }
+    if (prof->nsites == prof->sites_capacity) {
+        size_t capacity = prof->sites_capacity ? 2 * prof->sites_capacity : 64;
+        ProfileSite* sites = (ProfileSite*) realloc(prof->sites, capacity * sizeof(ProfileSite));
+        if (!sites) {
+            return UINT32_MAX;
+        }
+        prof->sites = sites;
+        prof->sites_capacity = capacity;
+    }
+    ProfileSite* site = &prof->sites[prof->nsites];
+    memset(site, 0, sizeof(ProfileSite));
+    site->hash = hash;
+    site->depth = depth;
+    memcpy(site->frames, frames, depth * sizeof(void*));
+    prof->site_index[i] = (uint32_t) ++prof->nsites;
+    return (uint32_t) (prof->nsites - 1);
+}
+
+/*
+ * Records a sampled allocation at the caller's backtrace. Returns false
+ * if it could not be recorded; the object must not be tagged then.
+ */
+bool gc_profiler_sample(Profiler* prof, void* ptr, size_t size) {
+    void* frames[GC_PROFILE_MAX_DEPTH + 1];
+    size_t depth = 0;
+#if defined(__linux__)
+    /* leave out this function */
+    int n = backtrace(frames, GC_PROFILE_MAX_DEPTH + 1);
+    depth = n > 1 ? (size_t) n - 1 : 0;
+#endif
+    pthread_mutex_lock(&prof->lock);
+    bool recorded = false;
+    if (2 * (prof->nsamples + 1) <= prof->samples_capacity || gc_profiler_grow_samples(prof)) {
+        uint32_t site = gc_profiler_intern(prof, frames + 1, depth);
+        if (site != UINT32_MAX) {
+            ProfileSample* s = &prof->samples[gc_profiler_find_sample(prof, ptr)];
+            s->ptr = ptr;
+            s->size = size;
+            s->site = site;
+            s->survived = false;
+            prof->nsamples++;
+            prof->sites[site].alloc_objects++;
+            prof->sites[site].alloc_bytes += size;
+            prof->sites[site].inuse_objects++;
+            prof->sites[site].inuse_bytes += size;
+            recorded = true;
+        }
+    }
+    pthread_mutex_unlock(&prof->lock);
+    return recorded;
+}
+
+/*
+ * A sampled object was freed or swept.
+ */
+void gc_profiler_free(Profiler* prof, void* ptr) {
+    pthread_mutex_lock(&prof->lock);
+    if (prof->nsamples) {
+        size_t i = gc_profiler_find_sample(prof, ptr);
+        ProfileSample* s = &prof->samples[i];
+        if (s->ptr) {
+            prof->sites[s->site].inuse_objects--;
+            prof->sites[s->site].inuse_bytes -= s->size;
+            gc_profiler_remove_sample(prof, i);
+        }
+    }
+    pthread_mutex_unlock(&prof->lock);
+}
+
+/*
+ * A sampled object survived a collection. Only the first one counts.
+ */
+void gc_profiler_survived(Profiler* prof, void* ptr) {
+    pthread_mutex_lock(&prof->lock);
+    if (prof->nsamples) {
+        ProfileSample* s = &prof->samples[gc_profiler_find_sample(prof, ptr)];
+        if (s->ptr && !s->survived) {
+            s->survived = true;
+            prof->sites[s->site].survived_objects++;
+            prof->sites[s->site].survived_bytes += s->size;
+        }
+    }
+    pthread_mutex_unlock(&prof->lock);
+}
+
+/*
+ * Estimated number of bytes behind sampled ones. An object of size s is
+ * sampled with probability 1 - exp(-s / rate).
+ */
+static double gc_profiler_scale(size_t objects, size_t bytes, size_t rate) {
+    if (!objects || !rate) {
+        return 1.0;
+    }
+    double size = (double) bytes / (double) objects;
+    return 1.0 / (1.0 - gc_profile_exp(-size / (double) rate));
+}
+
+/*
+ * Writes a frame for folded stacks: the symbol if there is one, else the
+ * module and offset, else the address.
+ */
+static void gc_profiler_write_frame(FILE* out, void* frame) {
+#if defined(__linux__)
+    Dl_info info;
+    if (dladdr(frame, &info)) {
+        if (info.dli_sname) {
+            fprintf(out, "%s", info.dli_sname);
+            return;
+        }
+        if (info.dli_fname) {
+            const char* name = strrchr(info.dli_fname, '/');
+            fprintf(out, "%s+0x%zx", name ? name + 1 : info.dli_fname,
+                    (size_t) ((char*) frame - (char*) info.dli_fbase));
+            return;
+        }
+    }
+#endif
+    fprintf(out, "%p", frame);
+}
+
+/*
+ * Folded stacks, outermost frame first, with the estimated bytes in use.
+ */
+static void gc_profiler_write_folded(Profiler* prof, FILE* out) {
+    for (size_t i = 0; i < prof->nsites; ++i) {
+        ProfileSite* site = &prof->sites[i];
+        if (!site->inuse_objects) {
+            continue;
+        }
+        if (!site->depth) {
+            fprintf(out, "[unknown]");
+        }
+        for (size_t j = site->depth; j-- > 0;) {
+            gc_profiler_write_frame(out, site->frames[j]);
+            fputc(j ? ';' : ' ', out);
+        }
+        double scale = gc_profiler_scale(site->inuse_objects, site->inuse_bytes, prof->rate);
+        fprintf(out, "%s%.0f\n", site->depth ? "" : " ", (double) site->inuse_bytes * scale);
+    }
+}
+
+/*
+ * The legacy heap profile format that pprof reads. Counts are of samples,
+ * pprof scales them by the rate in the header.
+ */
+static void gc_profiler_write_pprof(Profiler* prof, FILE* out) {
+    size_t totals[4] = { 0, 0, 0, 0 };
+    for (size_t i = 0; i < prof->nsites; ++i) {
+        totals[0] += prof->sites[i].inuse_objects;
+        totals[1] += prof->sites[i].inuse_bytes;
+        totals[2] += prof->sites[i].alloc_objects;
+        totals[3] += prof->sites[i].alloc_bytes;
+    }
+    fprintf(out, "heap profile: %zu: %zu [%zu: %zu] @ heap_v2/%zu\n",
+            totals[0], totals[1], totals[2], totals[3], prof->rate);
+    for (size_t i = 0; i < prof->nsites; ++i) {
+        ProfileSite* site = &prof->sites[i];
+        fprintf(out, "%zu: %zu [%zu: %zu] @", site->inuse_objects, site->inuse_bytes,
+                site->alloc_objects, site->alloc_bytes);
+        for (size_t j = 0; j < site->depth; ++j) {
+            fprintf(out, " %p", site->frames[j]);
+        }
+        fputc('\n', out);
+    }
+#if defined(__linux__)
+    /* pprof symbolizes the addresses with the mappings */
+    FILE* maps = fopen("/proc/self/maps", "r");
+    if (maps) {
+        fprintf(out, "\nMAPPED_LIBRARIES:\n");
+        char buf[4096];
+        size_t n;
+        while ((n = fread(buf, 1, sizeof(buf), maps))) {
+            fwrite(buf, 1, n, out);
+        }
+        fclose(maps);
+    }
+#endif
+}
+
+bool gc_profiler_write(Profiler* prof, int fd, int format) {
+    int out_fd = dup(fd);
+    FILE* out = out_fd >= 0 ? fdopen(out_fd, "w") : NULL;
+    if (!out) {
+        if (out_fd >= 0) {
+            close(out_fd);
+        }
+        return false;
+    }
+    pthread_mutex_lock(&prof->lock);
+    if (format == GC_PROFILE_PPROF) {
+        gc_profiler_write_pprof(prof, out);
+    } else {
+        gc_profiler_write_folded(prof, out);
+    }
+    pthread_mutex_unlock(&prof->lock);
+    bool written = !ferror(out);
+    return fclose(out) == 0 && written;
+}
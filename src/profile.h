@@ -0,0 +1,84 @@
+#ifndef PROFILE_H
+#define PROFILE_H
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include "gc.h"
+
+/*
+ * Sampling heap profiler. Allocations are sampled by bytes: the distance
+ * to the next sample is drawn from an exponential distribution with the
+ * interval as its mean, so every byte is equally likely to be sampled and
+ * periodic allocation patterns cannot hide from it. A sampled allocation
+ * carries GC_TAG_SAMPLED, its backtrace is interned as a site and the
+ * profiler remembers which site it came from until it is freed or swept.
+ *
+ * Sites count sampled allocations, those still in use and those that
+ * survived at least one collection. Counts are of samples; the estimate
+ * of the real bytes behind them is made when the profile is written.
+ *
+ * The locked allocation path keeps its countdown in the profiler, thread
+ * caches keep their own, so sampling never adds a lock to an allocation
+ * that is not sampled. Changing the interval starts a new epoch, on which
+ * the caches redraw their countdowns.
+ */
+#define GC_PROFILE_MAX_DEPTH 32
+
+typedef struct ProfileSite {
+    uint64_t hash;            // hash of the frames
+    size_t depth;             // number of frames
+    void* frames[GC_PROFILE_MAX_DEPTH]; // return addresses, innermost first
+    size_t alloc_objects;     // sampled allocations
+    size_t alloc_bytes;
+    size_t inuse_objects;     // sampled allocations not freed yet
+    size_t inuse_bytes;
+    size_t survived_objects;  // sampled allocations that survived a collection
+    size_t survived_bytes;
+} ProfileSite;
+
+typedef struct ProfileSample {
+    void* ptr;                // sampled object, NULL for an empty slot
+    size_t size;
+    uint32_t site;            // index into Profiler.sites
+    bool survived;            // survived a collection
+} ProfileSample;
+
+typedef struct Profiler {
+    pthread_mutex_t lock;     // guards everything below but the countdown
+    size_t interval;          // mean bytes between samples, 0 to stop sampling
+    size_t rate;              // last nonzero interval, used to scale the samples
+    int64_t countdown;        // bytes until the next sample of the locked path
+    uint32_t epoch;           // bumped by every interval change, 1 from the start
+    uint64_t rng;             // xorshift state for the sample distances
+    ProfileSite* sites;
+    size_t nsites;
+    size_t sites_capacity;
+    uint32_t* site_index;     // open addressing by hash, site + 1 or 0 if empty
+    size_t site_index_capacity;
+    ProfileSample* samples;   // open addressing by address
+    size_t nsamples;
+    size_t samples_capacity;
+} Profiler;
+
+Profiler* gc_profiler_new(size_t interval);
+void gc_profiler_delete(Profiler* prof);
+
+void gc_profiler_set_interval(Profiler* prof, size_t interval);
+int64_t gc_profiler_next(Profiler* prof);
+bool gc_profiler_sample(Profiler* prof, void* ptr, size_t size);
+void gc_profiler_free(Profiler* prof, void* ptr);
+void gc_profiler_survived(Profiler* prof, void* ptr);
+bool gc_profiler_write(Profiler* prof, int fd, int format);
+
+/*
+ * Counts size bytes against a countdown and returns whether the
+ * allocation is to be sampled.
+ */
+static inline bool gc_profiler_due(Profiler* prof, int64_t* countdown, size_t size) {
+    return prof && __atomic_load_n(&prof->interval, __ATOMIC_RELAXED)
+           && (*countdown -= (int64_t) size) <= 0;
+}
+
+#endif
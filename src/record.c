@@ -0,0 +1,226 @@
+#include <pthread.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include "log.h"
+#include "record.h"
+
+Recorder* gc_recorder_new(void) {
+    Recorder* rec = (Recorder*) malloc(sizeof(Recorder));
+    if (!rec) {
+        return NULL;
+    }
+    pthread_mutex_init(&rec->lock, NULL);
+    rec->fd = -1;
+    rec->active = false;
+    rec->failed = false;
+    rec->last = 0;
+    rec->events = 0;
+    rec->len = 0;
+    return rec;
+}
+
+void gc_recorder_delete(Recorder* rec) {
+    gc_recorder_stop(rec);
+    pthread_mutex_destroy(&rec->lock);
+    free(rec);
+}
+
+/*
+ * Writes out the buffer. Must be called with the lock held.
+ */
+static void gc_recorder_flush(Recorder* rec) {
+    size_t done = 0;
+    while (done < rec->len && !rec->failed) {
+        ssize_t n = write(rec->fd, rec->buf + done, rec->len - done);
+        if (n <= 0) {
+            LOG_WARNING("Failed to write the allocation record to fd %d, dropping the rest", rec->fd);
+            rec->failed = true;
+        } else {
+            done += (size_t) n;
+        }
+    }
+    rec->len = 0;
+}
+
+/*
+ * Starts recording to fd, after the GC_RECORD_MAGIC header. Returns false
+ * if the header cannot be written.
+ */
+bool gc_recorder_start(Recorder* rec, int fd) {
+    gc_recorder_stop(rec);
+    if (write(fd, GC_RECORD_MAGIC, sizeof(GC_RECORD_MAGIC) - 1) != sizeof(GC_RECORD_MAGIC) - 1) {
+        return false;
+    }
+    pthread_mutex_lock(&rec->lock);
+    rec->fd = fd;
+    rec->failed = false;
+    rec->last = 0;
+    rec->events = 0;
+    rec->len = 0;
+    __atomic_store_n(&rec->active, true, __ATOMIC_RELAXED);
+    pthread_mutex_unlock(&rec->lock);
+    return true;
+}
+
+/*
+ * Flushes what is buffered and stops recording. Returns the number of
+ * events recorded.
+ */
+uint64_t gc_recorder_stop(Recorder* rec) {
+    pthread_mutex_lock(&rec->lock);
+    uint64_t events = rec->events;
+    if (rec->active) {
+        gc_recorder_flush(rec);
+        __atomic_store_n(&rec->active, false, __ATOMIC_RELAXED);
+        rec->fd = -1;
+    }
+    pthread_mutex_unlock(&rec->lock);
+    return events;
+}
+
+void gc_recorder_emit(Recorder* rec, uint8_t type, uintptr_t addr, uint64_t a, uint64_t b) {
+    GcRecordEvent event = { type, addr, a, b };
+    pthread_mutex_lock(&rec->lock);
+    if (rec->active && !rec->failed) {
+        if (rec->len + GC_RECORD_MAX_SIZE > GC_RECORD_BUFFER) {
+            gc_recorder_flush(rec);
+        }
+        rec->len += gc_record_encode(rec->buf + rec->len, &rec->last, &event);
+        rec->events++;
+    }
+    pthread_mutex_unlock(&rec->lock);
+}
+
+static size_t gc_record_put_varint(uint8_t* buf, uint64_t v) {
+    size_t n = 0;
+    while (v >= 0x80) {
+        buf[n++] = (uint8_t) (v | 0x80);
+        v >>= 7;
+    }
+    buf[n++] = (uint8_t) v;
+    return n;
+}
+
+static bool gc_record_get_varint(const uint8_t* buf, size_t len, size_t* pos, uint64_t* v) {
+    *v = 0;
+    for (size_t n = 0; *pos < len && n < 10; ++n) {
+        uint8_t byte = buf[(*pos)++];
+        *v |= (uint64_t) (byte & 0x7f) << (7 * n);
+        if (!(byte & 0x80)) {
+            return true;
+        }
+    }
+    return false;
+}
+
+/*
+ * Addresses are stored as the zigzag-encoded difference to the previous
+ * one, so nearby objects take one or two bytes.
+ */
+static size_t gc_record_put_addr(uint8_t* buf, uintptr_t* last, uint64_t addr) {
+    int64_t delta = (int64_t) (addr - *last);
+    *last = (uintptr_t) addr;
+    return gc_record_put_varint(buf, ((uint64_t) delta << 1) ^ (uint64_t) (delta >> 63));
+}
+
+static bool gc_record_get_addr(const uint8_t* buf, size_t len, size_t* pos, uint64_t* last, uint64_t* addr) {
+    uint64_t zigzag;
+    if (!gc_record_get_varint(buf, len, pos, &zigzag)) {
+        return false;
+    }
+    *addr = *last + ((zigzag >> 1) ^ (~(zigzag & 1) + 1));
+    *last = *addr;
+    return true;
+}
+
+/*
+ * Encodes an event into buf, which needs room for GC_RECORD_MAX_SIZE
+ * bytes, and returns its size.
+ */
+size_t gc_record_encode(uint8_t* buf, uintptr_t* last, const GcRecordEvent* event) {
+    size_t n = 0;
+    buf[n++] = event->type;
+    switch (event->type) {
+    case GC_RECORD_ALLOC:
+        n += gc_record_put_addr(buf + n, last, event->addr);
+        n += gc_record_put_varint(buf + n, event->a);
+        n += gc_record_put_varint(buf + n, event->b);
+        break;
+    case GC_RECORD_REALLOC:
+        n += gc_record_put_addr(buf + n, last, event->addr);
+        n += gc_record_put_addr(buf + n, last, event->a);
+        n += gc_record_put_varint(buf + n, event->b);
+        break;
+    case GC_RECORD_FREE:
+    case GC_RECORD_DEATH:
+        n += gc_record_put_addr(buf + n, last, event->addr);
+        break;
+    case GC_RECORD_EDGE:
+        n += gc_record_put_addr(buf + n, last, event->addr);
+        n += gc_record_put_varint(buf + n, event->a);
+        n += gc_record_put_addr(buf + n, last, event->b);
+        break;
+    case GC_RECORD_CLEAR:
+        n += gc_record_put_addr(buf + n, last, event->addr);
+        n += gc_record_put_varint(buf + n, event->a);
+        break;
+    case GC_RECORD_RUN:
+        n += gc_record_put_varint(buf + n, event->a);
+        break;
+    }
+    return n;
+}
+
+/*
+ * Decodes the event at the start of data into event and returns its size,
+ * or 0 if the data ends within it or it is not a known event.
+ */
+size_t gc_record_decode(const void* data, size_t len, uintptr_t* last, GcRecordEvent* event) {
+    const uint8_t* buf = (const uint8_t*) data;
+    if (!len) {
+        return 0;
+    }
+    uint64_t addr = *last;
+    size_t n = 1;
+    bool ok = false;
+    event->type = buf[0];
+    event->addr = 0;
+    event->a = 0;
+    event->b = 0;
+    switch (event->type) {
+    case GC_RECORD_ALLOC:
+        ok = gc_record_get_addr(buf, len, &n, &addr, &event->addr)
+             && gc_record_get_varint(buf, len, &n, &event->a)
+             && gc_record_get_varint(buf, len, &n, &event->b);
+        break;
+    case GC_RECORD_REALLOC:
+        ok = gc_record_get_addr(buf, len, &n, &addr, &event->addr)
+             && gc_record_get_addr(buf, len, &n, &addr, &event->a)
+             && gc_record_get_varint(buf, len, &n, &event->b);
+        break;
+    case GC_RECORD_FREE:
+    case GC_RECORD_DEATH:
+        ok = gc_record_get_addr(buf, len, &n, &addr, &event->addr);
+        break;
+    case GC_RECORD_EDGE:
+        ok = gc_record_get_addr(buf, len, &n, &addr, &event->addr)
+             && gc_record_get_varint(buf, len, &n, &event->a)
+             && gc_record_get_addr(buf, len, &n, &addr, &event->b);
+        break;
+    case GC_RECORD_CLEAR:
+        ok = gc_record_get_addr(buf, len, &n, &addr, &event->addr)
+             && gc_record_get_varint(buf, len, &n, &event->a);
+        break;
+    case GC_RECORD_RUN:
+        ok = gc_record_get_varint(buf, len, &n, &event->a);
+        break;
+    }
+    if (!ok) {
+        return 0;
+    }
+    *last = (uintptr_t) addr;
+    return n;
+}
@@ -0,0 +1,64 @@
+#ifndef RECORD_H
+#define RECORD_H
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include "gc.h"
+
+/*
+ * Allocation recording. Events of all threads are encoded into one buffer
+ * under the recorder's lock and written out whenever it fills up, so the
+ * file holds them in the order they happened. Every record is its type
+ * byte followed by LEB128 varints; addresses are zigzag-encoded deltas
+ * from the previous address in the file, which keeps most records at a
+ * few bytes.
+ *
+ * The recorder is created by the first gc_record_start and lives until
+ * gc_stop, so threads that see a stale recorder pointer never touch freed
+ * memory. Events that arrive while it is stopped are ignored.
+ */
+#define GC_RECORD_BUFFER ((size_t) 64 << 10)
+
+/* Largest encoded record: the type and three 10-byte varints */
+#define GC_RECORD_MAX_SIZE 31
+
+typedef struct Recorder {
+    pthread_mutex_t lock;     // serializes events and writes
+    int fd;                   // file written to, -1 while stopped
+    bool active;              // events are recorded
+    bool failed;              // a write failed, later events are dropped
+    uintptr_t last;           // previous address in the file
+    uint64_t events;          // events recorded since the recording started
+    size_t len;               // bytes waiting in buf
+    uint8_t buf[GC_RECORD_BUFFER];
+} Recorder;
+
+Recorder* gc_recorder_new(void);
+void gc_recorder_delete(Recorder* rec);
+
+bool gc_recorder_start(Recorder* rec, int fd);
+uint64_t gc_recorder_stop(Recorder* rec);
+void gc_recorder_emit(Recorder* rec, uint8_t type, uintptr_t addr, uint64_t a, uint64_t b);
+
+size_t gc_record_encode(uint8_t* buf, uintptr_t* last, const GcRecordEvent* event);
+
+/*
+ * The collector's recorder if it is recording. Thread-cached allocations
+ * check it without holding the collector lock.
+ */
+static inline Recorder* gc_recording(GarbageCollector* gc) {
+    Recorder* rec = __atomic_load_n(&gc->recorder, __ATOMIC_ACQUIRE);
+    return rec && __atomic_load_n(&rec->active, __ATOMIC_RELAXED) ? rec : NULL;
+}
+
+#define GC_RECORD(gc, type, addr, a, b) \
+    do { \
+        Recorder* rec_ = gc_recording(gc); \
+        if (rec_) { \
+            gc_recorder_emit(rec_, type, (uintptr_t) (addr), (uint64_t) (a), (uint64_t) (b)); \
+        } \
+    } while (0)
+
+#endif
@@ -0,0 +1,125 @@
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE // dl_iterate_phdr
+#endif
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include "log.h"
+#include "roots.h"
+
+#if defined(__linux__)
+#include <link.h>
+#endif
+
+RootSet* gc_root_set_new(void) {
+    return (RootSet*) calloc(1, sizeof(RootSet));
+}
+
+void gc_root_set_delete(RootSet* rs) {
+    free(rs->roots);
+    free(rs);
+}
+
+bool gc_root_set_add(RootSet* rs, void* ptr) {
+    if (rs->size == rs->capacity) {
+        size_t capacity = rs->capacity ? 2 * rs->capacity : 16;
+        void** roots = (void**) realloc(rs->roots, capacity * sizeof(void*));
+        if (!roots) {
+            return false;
+        }
+        rs->roots = roots;
+        rs->capacity = capacity;
+    }
+    rs->roots[rs->size++] = ptr;
+    return true;
+}
+
+bool gc_root_set_remove(RootSet* rs, void* ptr) {
+    for (size_t i = 0; i < rs->size; ++i) {
+        if (rs->roots[i] == ptr) {
+            rs->roots[i] = rs->roots[--rs->size];
+            return true;
+        }
+    }
+    return false;
+}
+
+RootRanges* gc_root_ranges_new(void) {
+    return (RootRanges*) calloc(1, sizeof(RootRanges));
+}
+
+void gc_root_ranges_delete(RootRanges* rr) {
+    free(rr->ranges);
+    free(rr);
+}
+
+bool gc_root_ranges_add(RootRanges* rr, void* start, size_t len, bool segment) {
+    if (!len) {
+        return true;
+    }
+    if (rr->size == rr->capacity) {
+        size_t capacity = rr->capacity ? 2 * rr->capacity : 16;
+        RootRange* ranges = (RootRange*) realloc(rr->ranges, capacity * sizeof(RootRange));
+        if (!ranges) {
+            return false;
+        }
+        rr->ranges = ranges;
+        rr->capacity = capacity;
+    }
+    RootRange* range = &rr->ranges[rr->size++];
+    range->start = (char*) start;
+    range->end = (char*) start + len;
+    range->segment = segment;
+    return true;
+}
+
+bool gc_root_ranges_remove(RootRanges* rr, void* start, size_t len) {
+    for (size_t i = 0; i < rr->size; ++i) {
+        RootRange* range = &rr->ranges[i];
+        if (!range->segment && range->start == (char*) start && range->end == (char*) start + len) {
+            *range = rr->ranges[--rr->size];
+            return true;
+        }
+    }
+    return false;
+}
+
+#if defined(__linux__)
+static int gc_root_ranges_add_object(struct dl_phdr_info* info, size_t size, void* data) {
+    (void) size;
+    RootRanges* rr = (RootRanges*) data;
+    for (ElfW(Half) i = 0; i < info->dlpi_phnum; ++i) {
+        const ElfW(Phdr)* phdr = &info->dlpi_phdr[i];
+        /* Writable loadable segments hold .data and .bss */
+        if (phdr->p_type == PT_LOAD && (phdr->p_flags & PF_W)) {
+            char* start = (char*) (info->dlpi_addr + phdr->p_vaddr);
+            if (!gc_root_ranges_add(rr, start, phdr->p_memsz, true)) {
+                return 1;
+            }
+            LOG_DEBUG("Found data segment %p-%p in '%s'", (void*) start,
+                      (void*) (start + phdr->p_memsz), info->dlpi_name);
+        }
+    }
+    return 0;
+}
+#endif
+
+/*
+ * Replaces the segment ranges with the data segments of the currently
+ * loaded objects. Returns the number of segments found.
+ */
+size_t gc_root_ranges_find_segments(RootRanges* rr) {
+    size_t n = 0;
+    for (size_t i = 0; i < rr->size; ++i) {
+        if (!rr->ranges[i].segment) {
+            rr->ranges[n++] = rr->ranges[i];
+        }
+    }
+    size_t user = n;
+    rr->size = n;
+#if defined(__linux__)
+    dl_iterate_phdr(gc_root_ranges_add_object, rr);
+#endif
+    return rr->size - user;
+}
@@ -0,0 +1,51 @@
+#ifndef ROOTS_H
+#define ROOTS_H
+
+#include <stdbool.h>
+#include <stddef.h>
+
+/*
+ * Heap objects made static with gc_make_static. They are kept apart from
+ * the allocation map, so marking them costs O(roots) instead of a walk
+ * over every allocation. Members also carry GC_TAG_ROOT in the map.
+ */
+typedef struct RootSet {
+    void** roots;
+    size_t size;
+    size_t capacity;
+} RootSet;
+
+RootSet* gc_root_set_new(void);
+void gc_root_set_delete(RootSet* rs);
+
+bool gc_root_set_add(RootSet* rs, void* ptr);
+bool gc_root_set_remove(RootSet* rs, void* ptr);
+
+/*
+ * Memory ranges outside of the heap that are scanned for pointers on every
+ * collection, like the stacks. Ranges are added by the program, or found
+ * by gc_root_ranges_find_segments, which registers the writable data
+ * segments (.data and .bss) of the executable and all loaded shared
+ * libraries. Segment ranges are rediscovered as a whole, so libraries
+ * loaded later are picked up.
+ */
+typedef struct RootRange {
+    char* start;              // first byte of the range
+    char* end;                // one past the last byte
+    bool segment;             // found by gc_root_ranges_find_segments
+} RootRange;
+
+typedef struct RootRanges {
+    RootRange* ranges;
+    size_t size;
+    size_t capacity;
+} RootRanges;
+
+RootRanges* gc_root_ranges_new(void);
+void gc_root_ranges_delete(RootRanges* rr);
+
+bool gc_root_ranges_add(RootRanges* rr, void* start, size_t len, bool segment);
+bool gc_root_ranges_remove(RootRanges* rr, void* start, size_t len);
+size_t gc_root_ranges_find_segments(RootRanges* rr);
+
+#endif
@@ -0,0 +1,179 @@
+#include <errno.h>
+#include <pthread.h>
+#include <semaphore.h>
+#include <setjmp.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include "log.h"
+#include "thread_registry.h"
+
+__thread GcThread* gc_current_thread = NULL;
+static pthread_once_t gc_signals_once = PTHREAD_ONCE_INIT;
+
+static void gc_sem_wait(sem_t* sem) {
+    while (sem_wait(sem) != 0 && errno == EINTR) {
+    }
+}
+
+static void gc_suspend_handler(int sig) {
+    (void) sig;
+    int saved_errno = errno;
+    GcThread* self = gc_current_thread;
+    ThreadRegistry* r = self->registry;
+    /* Registers of the interrupted code are in the signal frame above us,
+     * callee-saved ones that live on in registers end up in regs */
+    setjmp(self->regs);
+    self->tos = __builtin_frame_address(0);
+    sem_post(&r->ack);
+    sigset_t mask;
+    sigfillset(&mask);
+    sigdelset(&mask, GC_SIG_RESTART);
+    while (__atomic_load_n(&r->stopped, __ATOMIC_ACQUIRE)) {
+        sigsuspend(&mask);
+    }
+    sem_post(&r->ack);
+    errno = saved_errno;
+}
+
+static void gc_restart_handler(int sig) {
+    (void) sig;
+}
+
+static void gc_install_signals(void) {
+    struct sigaction sa;
+    sa.sa_flags = SA_RESTART;
+    sigemptyset(&sa.sa_mask);
+    /* Restart signals stay pending until the handler waits for them */
+    sigaddset(&sa.sa_mask, GC_SIG_RESTART);
+    sa.sa_handler = gc_suspend_handler;
+    if (sigaction(GC_SIG_SUSPEND, &sa, NULL) != 0) {
+        LOG_CRITICAL("Failed to install the suspend signal handler%s", "");
+    }
+    sigemptyset(&sa.sa_mask);
+    sa.sa_handler = gc_restart_handler;
+    if (sigaction(GC_SIG_RESTART, &sa, NULL) != 0) {
+        LOG_CRITICAL("Failed to install the restart signal handler%s", "");
+    }
+}
+
+ThreadRegistry* gc_thread_registry_new(void) {
+    ThreadRegistry* r = (ThreadRegistry*) calloc(1, sizeof(ThreadRegistry));
+    if (!r) {
+        return NULL;
+    }
+    pthread_mutexattr_t attr;
+    pthread_mutexattr_init(&attr);
+    pthread_mutexattr_settype(&attr, PTHREAD_MUTEX_RECURSIVE);
+    pthread_mutex_init(&r->lock, &attr);
+    pthread_mutexattr_destroy(&attr);
+    sem_init(&r->ack, 0, 0);
+    pthread_once(&gc_signals_once, gc_install_signals);
+    return r;
+}
+
+void gc_thread_registry_delete(ThreadRegistry* r) {
+    GcThread* t = r->threads;
+    while (t) {
+        GcThread* next = t->next;
+        if (gc_current_thread == t) {
+            gc_current_thread = NULL;
+        }
+        free(t);
+        t = next;
+    }
+    sem_destroy(&r->ack);
+    pthread_mutex_destroy(&r->lock);
+    free(r);
+}
+
+/*
+ * Registers the calling thread, whose stack bottom is bos. Registering a
+ * thread again only updates its stack bottom.
+ */
+bool gc_thread_register(ThreadRegistry* r, void* bos) {
+    pthread_mutex_lock(&r->lock);
+    GcThread* t = gc_thread_current(r);
+    if (!t) {
+        t = (GcThread*) calloc(1, sizeof(GcThread));
+        if (!t) {
+            pthread_mutex_unlock(&r->lock);
+            return false;
+        }
+        t->registry = r;
+        t->id = pthread_self();
+        t->next = r->threads;
+        r->threads = t;
+        r->nthreads++;
+        gc_current_thread = t;
+    }
+    t->bos = bos;
+    pthread_mutex_unlock(&r->lock);
+    return true;
+}
+
+void gc_thread_unregister(ThreadRegistry* r) {
+    pthread_mutex_lock(&r->lock);
+    for (GcThread** p = &r->threads; *p; p = &(*p)->next) {
+        if (pthread_equal((*p)->id, pthread_self())) {
+            GcThread* t = *p;
+            *p = t->next;
+            r->nthreads--;
+            if (gc_current_thread == t) {
+                gc_current_thread = NULL;
+            }
+            free(t);
+            break;
+        }
+    }
+    pthread_mutex_unlock(&r->lock);
+}
+
+GcThread* gc_thread_current(ThreadRegistry* r) {
+    for (GcThread* t = r->threads; t; t = t->next) {
+        if (pthread_equal(t->id, pthread_self())) {
+            return t;
+        }
+    }
+    return NULL;
+}
+
+/*
+ * Suspends every registered thread but the caller and waits until all of
+ * them saved their registers. Must be called with the lock held.
+ */
+void gc_thread_stop_world(ThreadRegistry* r) {
+    __atomic_store_n(&r->stopped, true, __ATOMIC_RELEASE);
+    r->nstopped = 0;
+    for (GcThread* t = r->threads; t; t = t->next) {
+        t->suspended = false;
+        if (pthread_equal(t->id, pthread_self())) {
+            continue;
+        }
+        if (pthread_kill(t->id, GC_SIG_SUSPEND) != 0) {
+            LOG_WARNING("Failed to suspend thread, did it exit without unregistering?%s", "");
+            continue;
+        }
+        t->suspended = true;
+        r->nstopped++;
+    }
+    for (size_t i = 0; i < r->nstopped; ++i) {
+        gc_sem_wait(&r->ack);
+    }
+    LOG_DEBUG("Stopped %zu threads", r->nstopped);
+}
+
+void gc_thread_start_world(ThreadRegistry* r) {
+    __atomic_store_n(&r->stopped, false, __ATOMIC_RELEASE);
+    for (GcThread* t = r->threads; t; t = t->next) {
+        if (t->suspended) {
+            pthread_kill(t->id, GC_SIG_RESTART);
+        }
+    }
+    /* Wait until every thread left its handler, so that the next stop
+     * cannot be mistaken for this one */
+    for (size_t i = 0; i < r->nstopped; ++i) {
+        gc_sem_wait(&r->ack);
+    }
+    r->nstopped = 0;
+}
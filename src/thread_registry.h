@@ -0,0 +1,82 @@
+#ifndef THREAD_REGISTRY_H
+#define THREAD_REGISTRY_H
+
+#include <pthread.h>
+#include <semaphore.h>
+#include <setjmp.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include "allocation.h"
+#include "heap.h"
+
+/*
+ * Mutator threads sharing a collector. The registry lock serializes every
+ * collector operation. To mark, the collecting thread stops the world by
+ * sending GC_SIG_SUSPEND to every other registered thread. Each of them
+ * saves its registers and top of stack in its GcThread, acknowledges and
+ * waits in the signal handler until GC_SIG_RESTART arrives, so its whole
+ * stack can be scanned in the meantime.
+ *
+ * A thread can be registered with one collector at a time.
+ *
+ * With thread caches enabled, every thread also keeps a few free slots
+ * per size class that it took from the heap in a batch, and the objects it
+ * carved out of them that are not in the allocation map yet. Only the
+ * owning thread touches its cache outside of a stopped world.
+ */
+#ifndef GC_SIG_SUSPEND
+#if defined(SIGPWR)
+#define GC_SIG_SUSPEND SIGPWR
+#else
+#define GC_SIG_SUSPEND SIGUSR1
+#endif
+#endif
+
+#ifndef GC_SIG_RESTART
+#define GC_SIG_RESTART SIGXCPU
+#endif
+
+#define GC_THREAD_CACHE_PENDING 128
+
+typedef struct ThreadCache {
+    void* free[GC_HEAP_NUM_CLASSES]; // free slots per size class, linked through their first word
+    Allocation pending[GC_THREAD_CACHE_PENDING]; // allocations not published to the map yet
+    size_t npending;
+    int64_t profile_countdown; // bytes until the next sampled allocation
+    uint32_t profile_epoch;   // profiler epoch the countdown was drawn in, 0 for none
+} ThreadCache;
+
+typedef struct GcThread {
+    struct GcThread* next;    // next registered thread
+    struct ThreadRegistry* registry;
+    pthread_t id;
+    void* bos;                // bottom of the thread's stack
+    void* tos;                // top of stack saved while suspended
+    jmp_buf regs;             // registers saved while suspended
+    bool suspended;           // suspended by the current stop
+    ThreadCache cache;        // thread-local allocation buffer
+} GcThread;
+
+typedef struct ThreadRegistry {
+    pthread_mutex_t lock;     // recursive lock around all collector operations
+    GcThread* threads;        // registered threads
+    size_t nthreads;
+    size_t nstopped;          // threads suspended by the current stop
+    bool stopped;             // the world is stopped
+    sem_t ack;                // posted by threads entering and leaving suspension
+} ThreadRegistry;
+
+extern __thread GcThread* gc_current_thread;
+
+ThreadRegistry* gc_thread_registry_new(void);
+void gc_thread_registry_delete(ThreadRegistry* r);
+
+bool gc_thread_register(ThreadRegistry* r, void* bos);
+void gc_thread_unregister(ThreadRegistry* r);
+GcThread* gc_thread_current(ThreadRegistry* r);
+
+void gc_thread_stop_world(ThreadRegistry* r);
+void gc_thread_start_world(ThreadRegistry* r);
+
+#endif
@@ -0,0 +1,117 @@
+#include <pthread.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include "pacer.h"
+#include "trace.h"
+
+static uint64_t gc_tracer_next_id = 1;
+
+/* The calling thread's ring of the tracer with the given id */
+static __thread struct {
+    uint64_t id;
+    TraceRing* ring;
+} gc_trace_local = { 0, NULL };
+
+Tracer* gc_tracer_new(void) {
+    Tracer* tracer = (Tracer*) malloc(sizeof(Tracer));
+    if (!tracer) {
+        return NULL;
+    }
+    pthread_mutex_init(&tracer->lock, NULL);
+    tracer->rings = NULL;
+    tracer->id = __atomic_fetch_add(&gc_tracer_next_id, 1, __ATOMIC_RELAXED);
+    tracer->nthreads = 0;
+    return tracer;
+}
+
+void gc_tracer_delete(Tracer* tracer) {
+    TraceRing* ring = tracer->rings;
+    while (ring) {
+        TraceRing* next = ring->next;
+        free(ring);
+        ring = next;
+    }
+    pthread_mutex_destroy(&tracer->lock);
+    free(tracer);
+}
+
+/*
+ * Returns the ring of the calling thread, creating it on first use.
+ */
+TraceRing* gc_tracer_attach(Tracer* tracer) {
+    if (gc_trace_local.id == tracer->id) {
+        return gc_trace_local.ring;
+    }
+    pthread_t self = pthread_self();
+    pthread_mutex_lock(&tracer->lock);
+    TraceRing* ring = tracer->rings;
+    while (ring && !pthread_equal(ring->owner, self)) {
+        ring = ring->next;
+    }
+    if (!ring && (ring = (TraceRing*) malloc(sizeof(TraceRing)))) {
+        ring->owner = self;
+        ring->head = 0;
+        ring->tail = 0;
+        ring->dropped = 0;
+        ring->thread = tracer->nthreads++;
+        ring->next = tracer->rings;
+        tracer->rings = ring;
+    }
+    pthread_mutex_unlock(&tracer->lock);
+    if (!ring) {
+        return NULL;
+    }
+    gc_trace_local.id = tracer->id;
+    gc_trace_local.ring = ring;
+    return ring;
+}
+
+void gc_tracer_emit(Tracer* tracer, uint16_t type, uint64_t a, uint64_t b) {
+    TraceRing* ring = gc_tracer_attach(tracer);
+    if (!ring) {
+        return;
+    }
+    size_t head = ring->head;
+    if (head - __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE) == GC_TRACE_RING_SIZE) {
+        __atomic_fetch_add(&ring->dropped, 1, __ATOMIC_RELAXED);
+        return;
+    }
+    GcTraceEvent* event = &ring->events[head % GC_TRACE_RING_SIZE];
+    event->time_ns = gc_pacer_now();
+    event->thread = ring->thread;
+    event->type = type;
+    event->a = a;
+    event->b = b;
+    __atomic_store_n(&ring->head, head + 1, __ATOMIC_RELEASE);
+}
+
+/*
+ * Moves up to max events out of the rings, oldest first within each
+ * thread. Events of different threads are not merged by time.
+ */
+size_t gc_tracer_drain(Tracer* tracer, GcTraceEvent* events, size_t max) {
+    size_t n = 0;
+    pthread_mutex_lock(&tracer->lock);
+    for (TraceRing* ring = tracer->rings; ring && n < max; ring = ring->next) {
+        size_t tail = ring->tail;
+        size_t head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+        while (tail != head && n < max) {
+            events[n++] = ring->events[tail++ % GC_TRACE_RING_SIZE];
+        }
+        __atomic_store_n(&ring->tail, tail, __ATOMIC_RELEASE);
+    }
+    pthread_mutex_unlock(&tracer->lock);
+    return n;
+}
+
+uint64_t gc_tracer_dropped(Tracer* tracer) {
+    uint64_t dropped = 0;
+    pthread_mutex_lock(&tracer->lock);
+    for (TraceRing* ring = tracer->rings; ring; ring = ring->next) {
+        dropped += __atomic_load_n(&ring->dropped, __ATOMIC_RELAXED);
+    }
+    pthread_mutex_unlock(&tracer->lock);
+    return dropped;
+}
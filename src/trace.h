@@ -0,0 +1,89 @@
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include "gc.h"
+
+/*
+ * Binary event tracing. Every thread that emits events gets its own ring
+ * of GC_TRACE_RING_SIZE events. The owning thread is the only producer
+ * and gc_tracer_drain the only consumer, so a ring needs no lock: the
+ * producer publishes an event by advancing head, the consumer releases
+ * it by advancing tail. Events that find their ring full are dropped and
+ * counted instead of blocking the program.
+ *
+ * Rings belong to the tracer and live until it is deleted. Threads find
+ * their ring through a thread-local cache keyed by the tracer's id, so a
+ * later tracer at the same address never picks up a stale ring. The cache
+ * holds one tracer; a thread switching between collectors finds its ring
+ * again in the tracer's list by its owner.
+ *
+ * Building with GC_USDT also compiles an SDT probe into every trace point
+ * (provider "gc", probe names as in the GC_TRACE_* macros), which perf and
+ * bpftrace can attach to whatever the trace level.
+ */
+#define GC_TRACE_RING_SIZE 4096
+
+typedef struct TraceRing {
+    struct TraceRing* next;   // next ring of the tracer
+    pthread_t owner;          // thread writing to the ring
+    uint32_t thread;          // number of the owning thread
+    size_t head;              // next event to write, advanced by the owner
+    size_t tail;              // next event to read, advanced by the drain
+    uint64_t dropped;         // events lost to a full ring
+    GcTraceEvent events[GC_TRACE_RING_SIZE];
+} TraceRing;
+
+typedef struct Tracer {
+    pthread_mutex_t lock;     // guards the ring list and serializes drains
+    TraceRing* rings;
+    uint64_t id;              // unique among all tracers ever created
+    uint32_t nthreads;        // rings created so far
+} Tracer;
+
+Tracer* gc_tracer_new(void);
+void gc_tracer_delete(Tracer* tracer);
+
+TraceRing* gc_tracer_attach(Tracer* tracer);
+void gc_tracer_emit(Tracer* tracer, uint16_t type, uint64_t a, uint64_t b);
+size_t gc_tracer_drain(Tracer* tracer, GcTraceEvent* events, size_t max);
+uint64_t gc_tracer_dropped(Tracer* tracer);
+
+#if defined(GC_USDT)
+#include <sys/sdt.h>
+#define GC_TRACE_PROBE(probe, a, b) DTRACE_PROBE2(gc, probe, a, b)
+#else
+#define GC_TRACE_PROBE(probe, a, b) do {} while (0)
+#endif
+
+/*
+ * Level at which an event is recorded: allocations, frees and the
+ * per-page sweep are only traced at GC_TRACE_LEVEL_ALL.
+ */
+static inline int gc_trace_level_of(uint16_t type, uint64_t a) {
+    if (type == GC_EVENT_ALLOC || type == GC_EVENT_FREE
+        || (type == GC_EVENT_PHASE && a == GC_PHASE_SWEEP)) {
+        return GC_TRACE_LEVEL_ALL;
+    }
+    return GC_TRACE_LEVEL_GC;
+}
+
+#define GC_TRACE(gc, type, probe, a, b) \
+    do { \
+        GC_TRACE_PROBE(probe, a, b); \
+        if ((gc)->trace_level && (gc)->trace_level >= gc_trace_level_of(type, (uint64_t) (a))) { \
+            gc_tracer_emit((gc)->tracer, type, (uint64_t) (a), (uint64_t) (b)); \
+        } \
+    } while (0)
+
+#define GC_TRACE_ALLOC(gc, ptr, size) GC_TRACE(gc, GC_EVENT_ALLOC, alloc, (uintptr_t) (ptr), size)
+#define GC_TRACE_FREE(gc, ptr, size) GC_TRACE(gc, GC_EVENT_FREE, free, (uintptr_t) (ptr), size)
+#define GC_TRACE_BEGIN(gc, minor, used) GC_TRACE(gc, GC_EVENT_BEGIN, begin, minor, used)
+#define GC_TRACE_END(gc, freed, used) GC_TRACE(gc, GC_EVENT_END, end, freed, used)
+#define GC_TRACE_PHASE(gc, id, ns) GC_TRACE(gc, GC_EVENT_PHASE, phase, id, ns)
+#define GC_TRACE_RESIZE(gc, from, to) GC_TRACE(gc, GC_EVENT_RESIZE, resize, from, to)
+
+#endif
@@ -0,0 +1,45 @@
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include "log.h"
+#include "worklist.h"
+
+Worklist* gc_worklist_new(size_t capacity, size_t limit) {
+    Worklist* wl = (Worklist*) malloc(sizeof(Worklist));
+    if (!wl) {
+        return NULL;
+    }
+    wl->capacity = capacity < limit ? capacity : limit;
+    wl->items = (WorkItem*) malloc(wl->capacity * sizeof(WorkItem));
+    if (!wl->items) {
+        wl->capacity = 0;
+    }
+    wl->size = 0;
+    wl->limit = limit;
+    wl->overflowed = false;
+    wl->overflows = 0;
+    return wl;
+}
+
+void gc_worklist_delete(Worklist* wl) {
+    free(wl->items);
+    free(wl);
+}
+
+bool gc_worklist_grow(Worklist* wl) {
+    if (wl->capacity >= wl->limit) {
+        return false;
+    }
+    size_t capacity = wl->capacity ? wl->capacity * 2 : 64;
+    if (capacity > wl->limit) {
+        capacity = wl->limit;
+    }
+    WorkItem* items = (WorkItem*) realloc(wl->items, capacity * sizeof(WorkItem));
+    if (!items) {
+        LOG_WARNING("Failed to grow mark stack beyond %zu items", wl->capacity);
+        return false;
+    }
+    wl->items = items;
+    wl->capacity = capacity;
+    return true;
+}
@@ -0,0 +1,55 @@
+#ifndef WORKLIST_H
+#define WORKLIST_H
+
+#include <stdbool.h>
+#include <stddef.h>
+
+struct GcLayout;
+
+/*
+ * Explicit mark stack. Every item is a marked object whose contents still
+ * have to be scanned. The stack grows on demand up to `limit` items; a push
+ * beyond that sets `overflowed` and the caller has to recover by rescanning
+ * the marked part of the heap.
+ */
+typedef struct WorkItem {
+    char* ptr;                // start of the range to scan
+    size_t size;              // length of the range in bytes
+    const struct GcLayout* layout; // pointer layout, NULL to scan conservatively
+} WorkItem;
+
+typedef struct Worklist {
+    WorkItem* items;
+    size_t size;
+    size_t capacity;
+    size_t limit;             // maximum number of items
+    bool overflowed;          // a push was dropped since the last reset
+    size_t overflows;         // overflows recovered from so far
+} Worklist;
+
+Worklist* gc_worklist_new(size_t capacity, size_t limit);
+void gc_worklist_delete(Worklist* wl);
+bool gc_worklist_grow(Worklist* wl);
+
+static inline bool gc_worklist_push(Worklist* wl, void* ptr, size_t size,
+                                    const struct GcLayout* layout) {
+    if (wl->size == wl->capacity && !gc_worklist_grow(wl)) {
+        wl->overflowed = true;
+        return false;
+    }
+    wl->items[wl->size].ptr = (char*) ptr;
+    wl->items[wl->size].size = size;
+    wl->items[wl->size].layout = layout;
+    wl->size++;
+    return true;
+}
+
+static inline bool gc_worklist_pop(Worklist* wl, WorkItem* item) {
+    if (!wl->size) {
+        return false;
+    }
+    *item = wl->items[--wl->size];
+    return true;
+}
+
+#endif
@@ -1,3 +1,4 @@
+#define _GNU_SOURCE // dl_iterate_phdr in roots.c
 #include <float.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -6,22 +7,52 @@
 #include "../src/gc.c"
 #include "../src/allocation.c"
 #include "../src/allocation_map.c"
+#include "../src/finalizer.c"
+#include "../src/heap.c"
+#include "../src/mark_pool.c"
+#include "../src/pacer.c"
+#include "../src/profile.c"
+#include "../src/record.c"
+#include "../src/page_map.c"
+#include "../src/roots.c"
+#include "../src/thread_registry.c"
+#include "../src/trace.c"
+#include "../src/worklist.c"
 
 #define UNUSED(x) (void)(x)
 
+/*
+ * Tests that allocate from a collector, and the helpers that allocate for
+ * them in a deeper frame, must not be inlined. Otherwise pointers they leave
+ * in the runner's frame or registers keep objects of later tests alive.
+ */
+#define STACK_TEST __attribute__((noinline))
+
+/*
+ * Overwrites the stack below the caller, so that pointers left behind by
+ * helpers that already returned are not found by the next collection.
+ * Without sanitizer, so no redzone is left uncleared.
+ */
+STACK_TEST GC_NO_SANITIZE static void _clear_stack() {
+    volatile char buf[16384];
+    for (size_t i = 0; i < sizeof(buf); ++i) {
+        buf[i] = 0;
+    }
+}
+
 static size_t DTOR_COUNT = 0;
 
-static char* test_primes() {
+static char* test_pow2() {
     /*
      * Test a few known cases.
      */
-    mu_assert(!is_prime(0), "Prime test failure for 0");
-    mu_assert(!is_prime(1), "Prime test failure for 1");
-    mu_assert(is_prime(2), "Prime test failure for 2");
-    mu_assert(is_prime(3), "Prime test failure for 3");
-    mu_assert(!is_prime(12742382), "Prime test failure for 12742382");
-    mu_assert(is_prime(611953), "Prime test failure for 611953");
-    mu_assert(is_prime(479001599), "Prime test failure for 479001599");
+    mu_assert(next_pow2(0) == 1, "Power of two failure for 0");
+    mu_assert(next_pow2(1) == 1, "Power of two failure for 1");
+    mu_assert(next_pow2(2) == 2, "Power of two failure for 2");
+    mu_assert(next_pow2(3) == 4, "Power of two failure for 3");
+    mu_assert(next_pow2(1000) == 1024, "Power of two failure for 1000");
+    mu_assert(next_pow2(1024) == 1024, "Power of two failure for 1024");
+    mu_assert(next_pow2(1025) == 2048, "Power of two failure for 1025");
     return 0;
 }
 
@@ -38,31 +69,143 @@ static char* test_gc_allocation_new_delete() {
     mu_assert(a->size == sizeof(int), "Size of mem pointed to should not change");
     mu_assert(a->tag == GC_TAG_NONE, "Annotation should initially be untagged");
     mu_assert(a->dtor == dtor, "Destructor pointer should not change");
-    mu_assert(a->next == NULL, "Annotation should initilally be unlinked");
+    mu_assert(a->probe == 0, "Annotation should initilally be unplaced");
     gc_allocation_delete(a);
     free(ptr);
     return NULL;
 }
 
 
+static char* test_gc_heap_alloc_free() {
+    /* Size classes round up and never shrink a request */
+    mu_assert(gc_heap_size_class(1) == 0, "1 byte should map to the smallest class");
+    mu_assert(gc_heap_size_class(16) == 0, "16 bytes should map to the smallest class");
+    mu_assert(gc_heap_size_class(17) == 1, "17 bytes should map to the 32 byte class");
+    for (size_t size = 1; size <= GC_HEAP_MAX_SMALL_SIZE; ++size) {
+        unsigned int c = gc_heap_size_class(size);
+        mu_assert(c < GC_HEAP_NUM_CLASSES, "Small sizes must map to a small class");
+        mu_assert(gc_heap_class_size(c) >= size, "Class must fit the requested size");
+        mu_assert(c == 0 || gc_heap_class_size(c - 1) < size, "Class must be the tightest fit");
+    }
+
+    Heap* heap = gc_heap_new();
+    /* Small objects share a page and are aligned to the granule */
+    char* a = gc_heap_alloc(heap, 24);
+    char* b = gc_heap_alloc(heap, 24);
+    mu_assert(a && b && a != b, "Heap should hand out distinct slots");
+    mu_assert(gc_heap_page_of(a) == gc_heap_page_of(b), "Same class should share a page");
+    mu_assert(((uintptr_t) a % GC_HEAP_GRANULE) == 0, "Slots must be granule aligned");
+    mu_assert(gc_heap_usable_size(a) == 32, "24 bytes should come from the 32 byte class");
+    mu_assert(heap->committed == GC_HEAP_PAGE_SIZE, "One page should be committed");
+
+    /* Freed slots are reused first */
+    gc_heap_free(heap, b);
+    mu_assert(gc_heap_alloc(heap, 20) == b, "Freed slot should be reused");
+
+    /* Filling a page spills over into a new one */
+    HeapPage* page = gc_heap_page_of(a);
+    size_t nslots = page->nslots;
+    for (size_t i = 2; i < nslots + 1; ++i) {
+        gc_heap_alloc(heap, 32);
+    }
+    mu_assert(page->nfree == 0, "First page should be full");
+    mu_assert(heap->classes[1].npages == 2, "Class should have spilled into a second page");
+
+    /* Mid-size objects share pages as well, as many as fit */
+    char* m = gc_heap_alloc(heap, 4096);
+    char* n = gc_heap_alloc(heap, 4100);
+    mu_assert(gc_heap_page_of(m) == gc_heap_page_of(n), "Mid-size objects should share a page");
+    mu_assert(gc_heap_page_of(m)->nslots == (GC_HEAP_PAGE_SIZE - GC_HEAP_HEADER_SIZE) / 4096,
+              "Mid-size classes should fill their pages");
+    mu_assert(gc_heap_page_of(gc_heap_alloc(heap, GC_HEAP_MAX_SMALL_SIZE))->nslots == 2,
+              "The largest class should hold two objects per page");
+
+    /* Large objects get their own block */
+    char* big = gc_heap_alloc(heap, 3 * GC_HEAP_PAGE_SIZE);
+    mu_assert(big != NULL, "Large allocation should succeed");
+    mu_assert(gc_heap_page_of(big)->size_class == GC_HEAP_LARGE_CLASS, "Large object should be in a large block");
+    mu_assert(gc_heap_usable_size(big) >= 3 * GC_HEAP_PAGE_SIZE, "Large block must fit the object");
+    gc_heap_free(heap, big);
+    mu_assert(heap->large == NULL, "Freed large blocks are returned immediately");
+
+    gc_heap_delete(heap);
+    return NULL;
+}
+
+static char* test_gc_heap_interior_pointers() {
+    Heap* heap = gc_heap_new();
+    char* a = gc_heap_alloc(heap, 48);
+    char* b = gc_heap_alloc(heap, 48);
+    char* big = gc_heap_alloc(heap, 2 * GC_HEAP_PAGE_SIZE);
+    int on_stack = 0;
+    void* foreign = malloc(16);
+
+    /* Any address inside a slot resolves to the slot start */
+    mu_assert(gc_heap_object_start(heap, a) == a, "Object start should resolve to itself");
+    mu_assert(gc_heap_object_start(heap, a + 47) == a, "Interior pointer should resolve to its object");
+    mu_assert(gc_heap_object_start(heap, b + 1) == b, "Interior pointer should resolve to its object");
+    mu_assert(gc_heap_object_start(heap, big + GC_HEAP_PAGE_SIZE + 5) == big,
+              "Pointers into later pages of a large block should resolve to its start");
+    mu_assert(gc_heap_object_start(heap, big + 2 * GC_HEAP_PAGE_SIZE) == NULL,
+              "Pointers past a large object must not resolve");
+
+    /* Words outside of the heap are rejected */
+    mu_assert(gc_heap_object_start(heap, NULL) == NULL, "NULL is not a heap pointer");
+    mu_assert(gc_heap_object_start(heap, &on_stack) == NULL, "Stack addresses are not heap pointers");
+    mu_assert(gc_heap_object_start(heap, foreign) == NULL, "malloc'ed memory is not a heap pointer");
+    mu_assert(gc_heap_object_start(heap, gc_heap_page_of(a)) == NULL, "Page headers are not objects");
+    mu_assert(gc_heap_object_start(heap, (void*) UINTPTR_MAX) == NULL, "Non-canonical words are rejected");
+
+    /* Released blocks are removed from the page map */
+    gc_heap_free(heap, big);
+    mu_assert(gc_page_map_lookup(heap->page_map, big) == NULL, "Freed blocks must leave the page map");
+
+    free(foreign);
+    gc_heap_delete(heap);
+    return NULL;
+}
+
+STACK_TEST static char* test_gc_mark_interior_pointer() {
+    GarbageCollector gc_;
+    void *bos = __builtin_frame_address(0);
+    gc_start(&gc_, bos);
+    gc_pause(&gc_);
+
+    /* A struct that only holds a cursor into the middle of a buffer */
+    char** holder = gc_malloc(&gc_, sizeof(char*));
+    char* buffer = gc_malloc(&gc_, 256);
+    holder[0] = buffer + 100;
+    gc_mark_alloc(&gc_, holder);
+    mu_assert(gc_heap_is_marked(buffer),
+              "Interior pointers should keep their object alive");
+
+    /* Only exact object pointers can be freed */
+    gc_free(&gc_, buffer + 1);
+    mu_assert(gc_allocation_map_get(gc_.allocs, buffer) != NULL,
+              "Freeing an interior pointer must be ignored");
+    mu_assert(gc_realloc(&gc_, buffer + 1, 512) == NULL && errno == EINVAL,
+              "Reallocating an interior pointer must fail");
+
+    gc_stop(&gc_);
+    return NULL;
+}
+
 static char* test_gc_allocation_map_new_delete() {
     /* Standard invocation */
-    AllocationMap* am = gc_allocation_map_new(8, 16, 0.5, 0.2, 0.8);
-    mu_assert(am->min_capacity == 11, "True min capacity should be next prime");
-    mu_assert(am->capacity == 17, "True capacity should be next prime");
+    AllocationMap* am = gc_allocation_map_new(8, 16, 0.2, 0.8);
+    mu_assert(am->min_capacity == 8, "True min capacity should be next power of two");
+    mu_assert(am->capacity == 16, "True capacity should be next power of two");
     mu_assert(am->size == 0, "Allocation map should be initialized to empty");
-    mu_assert(am->sweep_limit == 8, "Incorrect sweep limit calculation");
     mu_assert(am->downsize_factor == 0.2, "Downsize factor should not change");
     mu_assert(am->upsize_factor == 0.8, "Upsize factor should not change");
     mu_assert(am->allocs != NULL, "Allocation map must not have a NULL pointer");
     gc_allocation_map_delete(am);
 
     /* Enforce min sizes */
-    am = gc_allocation_map_new(8, 4, 0.5, 0.2, 0.8);
-    mu_assert(am->min_capacity == 11, "True min capacity should be next prime");
-    mu_assert(am->capacity == 11, "True capacity should be next prime");
+    am = gc_allocation_map_new(8, 4, 0.2, 0.8);
+    mu_assert(am->min_capacity == 8, "True min capacity should be next power of two");
+    mu_assert(am->capacity == 8, "True capacity should be next power of two");
     mu_assert(am->size == 0, "Allocation map should be initialized to empty");
-    mu_assert(am->sweep_limit == 5, "Incorrect sweep limit calculation");
     mu_assert(am->downsize_factor == 0.2, "Downsize factor should not change");
     mu_assert(am->upsize_factor == 0.8, "Upsize factor should not change");
     mu_assert(am->allocs != NULL, "Allocation map must not have a NULL pointer");
@@ -73,7 +216,7 @@ static char* test_gc_allocation_map_new_delete() {
 
 
 static char* test_gc_allocation_map_basic_get() {
-    AllocationMap* am = gc_allocation_map_new(8, 16, 0.5, 0.2, 0.8);
+    AllocationMap* am = gc_allocation_map_new(8, 16, 0.2, 0.8);
 
     /* Ask for something that does not exist */
     int* five = malloc(sizeof(int));
@@ -117,16 +260,20 @@ static char* test_gc_allocation_map_put_get_remove() {
         ints[i] = malloc(sizeof(int));
     }
 
-    /* Enforce separate chaining by disallowing up/downsizing.
-     * The pigeonhole principle then states that we need to have at least one
-     * entry in the hash map that has a separare chain with len > 1
+    /* Disallow up/downsizing by load factor. The table still has to grow
+     * once it runs out of free slots, so 64 entries must fit anyway.
      */
-    AllocationMap* am = gc_allocation_map_new(32, 32, DBL_MAX, 0.0, DBL_MAX);
+    AllocationMap* am = gc_allocation_map_new(32, 32, 0.0, DBL_MAX);
     Allocation* a;
     for (size_t i=0; i<64; ++i) {
         a = gc_allocation_map_put(am, ints[i], sizeof(int), NULL);
     }
     mu_assert(am->size == 64, "Maps w/ 64 elements should have size 64");
+    mu_assert(am->capacity >= 64 / GC_ALLOCATION_MAP_MAX_LOAD, "Map must grow past its max load");
+    for (size_t i=0; i<64; ++i) {
+        a = gc_allocation_map_get(am, ints[i]);
+        mu_assert(a && a->ptr == ints[i], "Every entry must be found after growing");
+    }
     /* Now update all of them with a new dtor */
     for (size_t i=0; i<64; ++i) {
         a = gc_allocation_map_put(am, ints[i], sizeof(int), dtor);
@@ -149,10 +296,168 @@ static char* test_gc_allocation_map_put_get_remove() {
     return NULL;
 }
 
-static char* test_gc_allocation_map_cleanup() {
+static char* test_gc_allocation_map_robin_hood() {
+    /* Fake, densely packed heap addresses stress the hash mixing */
+    size_t N = 4096;
+    AllocationMap* am = gc_allocation_map_new(16, 16, 0.0, 0.8);
+    for (size_t i=0; i<N; ++i) {
+        gc_allocation_map_put(am, (void*) (0x10000 + i * 16), i, NULL);
+    }
+    mu_assert(am->size == N, "All entries should be inserted");
+    mu_assert((am->capacity & (am->capacity - 1)) == 0, "Capacity must stay a power of two");
+    /* Remove every other entry, shifting the probe sequences back */
+    for (size_t i=0; i<N; i+=2) {
+        gc_allocation_map_remove(am, (void*) (0x10000 + i * 16), false);
+    }
+    mu_assert(am->size == N / 2, "Half of the entries should be removed");
+    for (size_t i=0; i<N; ++i) {
+        Allocation* a = gc_allocation_map_get(am, (void*) (0x10000 + i * 16));
+        if (i % 2) {
+            mu_assert(a && a->size == i, "Remaining entries must still be found");
+        } else {
+            mu_assert(a == NULL, "Removed entries must not be found");
+        }
+    }
+    /* Every entry sits exactly probe slots after its home slot */
+    size_t mask = am->capacity - 1;
+    for (size_t i=0; i<am->capacity; ++i) {
+        Allocation* a = &am->allocs[i];
+        if (!a->ptr) continue;
+        mu_assert(((gc_hash(a->ptr) + a->probe) & mask) == i, "Probe distance is inconsistent");
+    }
+    gc_allocation_map_delete(am);
+    return NULL;
+}
+
+STACK_TEST static char* test_gc_sweep_half() {
+    /* Sweep removes entries while iterating, which shifts later entries
+     * back, possibly across the end of the table. */
+    GarbageCollector gc_;
+    void *bos = __builtin_frame_address(0);
+    gc_start(&gc_, bos);
+    gc_pause(&gc_);
+    size_t N = 3000;
+    for (size_t i=0; i<N; ++i) {
+        gc_malloc(&gc_, 8);
+    }
+    size_t marked = 0;
+    for (size_t i=0; i<gc_.allocs->capacity; ++i) {
+        Allocation* chunk = &gc_.allocs->allocs[i];
+        if (chunk->ptr && (i % 2)) {
+            gc_heap_mark(chunk->ptr);
+            marked++;
+        }
+    }
+    size_t collected = gc_sweep(&gc_);
+    mu_assert(collected == (N - marked) * 8, "Exactly the unmarked allocations should be swept");
+    mu_assert(gc_.allocs->size == marked, "Marked allocations should survive");
+    mu_assert(gc_.swept_objects == N - marked && gc_.swept_bytes == collected,
+              "The sweep should count what it freed");
+    /* Freed slots are reused */
+    size_t committed = gc_.heap->committed;
+    for (size_t i=0; i<N - marked; ++i) {
+        gc_malloc(&gc_, 8);
+    }
+    mu_assert(gc_.heap->committed == committed, "Swept slots should be allocated again");
+    gc_stop(&gc_);
+    return NULL;
+}
+
+STACK_TEST static char* test_gc_lazy_sweep() {
+    GarbageCollector gc_;
+    void *bos = __builtin_frame_address(0);
+    GarbageCollectorOptions opts;
+    gc_options_init(&opts);
+    opts.lazy_sweep = true;
+    gc_start_opts(&gc_, bos, &opts);
+    gc_pause(&gc_);
+    /* Fill the pages of the size class completely */
+    HeapClass* c = &gc_.heap->classes[gc_heap_size_class(32)];
+    size_t N = 0;
+    while (N < 3000 || c->partial) {
+        gc_malloc(&gc_, 32);
+        N++;
+    }
+    size_t marked = 0;
+    for (size_t i=0; i<gc_.allocs->capacity; ++i) {
+        Allocation* chunk = &gc_.allocs->allocs[i];
+        if (chunk->ptr && (i % 2)) {
+            gc_heap_mark(chunk->ptr);
+            marked++;
+        }
+    }
+    /* What gc_run does after marking in lazy mode */
+    gc_heap_sweep_begin(gc_.heap);
+    mu_assert(gc_.heap->unswept > 1, "Every page should be queued for sweeping");
+    mu_assert(gc_.allocs->size == N, "Nothing should be freed before allocating");
+
+    /* Allocating sweeps just enough to find a free slot */
+    void* fresh = gc_malloc(&gc_, 32);
+    mu_assert(gc_.allocs->size > marked + 1, "Allocation should only sweep on demand");
+    mu_assert(gc_.allocs->size < N + 1, "Allocation should reuse swept memory");
+
+    /* Idle steps finish the rest */
+    size_t steps = 0;
+    while (gc_sweep_step(&gc_, 1)) {
+        steps++;
+    }
+    mu_assert(steps > 0, "Sweeping should take several steps");
+    mu_assert(gc_.heap->unswept == 0, "No pages should be left to sweep");
+    mu_assert(gc_.allocs->size == marked + 1, "Marked and new allocations should survive");
+    mu_assert(gc_find_alloc(&gc_, fresh) != NULL, "New allocation must not be swept");
+    gc_stop(&gc_);
+    return NULL;
+}
+
+STACK_TEST static char* test_gc_deferred_finalizers() {
+    DTOR_COUNT = 0;
+    GarbageCollector gc_;
+    void *bos = __builtin_frame_address(0);
+    GarbageCollectorOptions opts;
+    gc_options_init(&opts);
+    opts.finalizer_mode = GC_FINALIZE_DEFERRED;
+    gc_start_opts(&gc_, bos, &opts);
+    gc_pause(&gc_);
+    size_t N = 100;
+    for (size_t i=0; i<N; ++i) {
+        gc_malloc_ext(&gc_, 64, dtor);
+    }
+    gc_malloc(&gc_, 64);
+    size_t committed = gc_.heap->committed;
+    HeapPage* page = gc_.heap->classes[gc_heap_size_class(64)].partial;
+    size_t nfree = page->nfree;
+
+    /* Nothing is marked, the sweep only unlinks finalizable objects */
+    size_t collected = gc_sweep(&gc_);
+    mu_assert(collected == (N + 1) * 64, "Sweep should count all dead objects");
+    mu_assert(DTOR_COUNT == 0, "Destructors must not run during the sweep");
+    mu_assert(gc_.allocs->size == 0, "Dead objects should be unlinked");
+    mu_assert(page->nfree == nfree + 1, "Only objects without destructor should be freed");
+
+    mu_assert(gc_run_finalizers(&gc_) == N, "All queued destructors should run");
+    mu_assert(DTOR_COUNT == N, "Every destructor should run exactly once");
+    mu_assert(page->nfree == page->nslots, "Memory should be released after finalization");
+    mu_assert(gc_.heap->committed == committed, "The last page of a class is kept");
+    gc_stop(&gc_);
+
+    /* On the finalizer thread, gc_stop waits for outstanding destructors */
+    DTOR_COUNT = 0;
+    opts.finalizer_mode = GC_FINALIZE_THREAD;
+    gc_start_opts(&gc_, bos, &opts);
+    gc_pause(&gc_);
+    for (size_t i=0; i<N; ++i) {
+        gc_malloc_ext(&gc_, 64, dtor);
+    }
+    gc_sweep(&gc_);
+    gc_stop(&gc_);
+    mu_assert(DTOR_COUNT == N, "gc_stop should run all outstanding destructors");
+    return NULL;
+}
+
+STACK_TEST static char* test_gc_allocation_map_cleanup() {
     /* Make sure that the entries in the allocation map get reset
      * to NULL when we delete things. This is required for the
-     * chunk != NULL checks when iterating over the items in the hash map.
+     * chunk->ptr != NULL checks when iterating over the items in the hash map.
      */
     DTOR_COUNT = 0;
     GarbageCollector gc_;
@@ -175,14 +480,14 @@ static char* test_gc_allocation_map_cleanup() {
 
     /* now make sure that all allocation entries are NULL */
     for (size_t i=0; i<gc_.allocs->capacity; ++i) {
-        mu_assert(gc_.allocs->allocs[i] == NULL, "Deleted allocs should be reset to NULL");
+        mu_assert(gc_.allocs->allocs[i].ptr == NULL, "Deleted allocs should be reset to NULL");
     }
     gc_stop(&gc_);
     return NULL;
 }
 
 
-static char* test_gc_mark_stack() {
+STACK_TEST static char* test_gc_mark_stack() {
     GarbageCollector gc_;
     void *bos = __builtin_frame_address(0);
     gc_start_ext(&gc_, bos, 32, 32, 0.0, DBL_MAX, DBL_MAX);
@@ -193,10 +498,10 @@ static char* test_gc_mark_stack() {
     int** five_ptr = gc_calloc(&gc_, 2, sizeof(int*));
     gc_mark_stack(&gc_);
     Allocation* a = gc_allocation_map_get(gc_.allocs, five_ptr);
-    mu_assert(a->tag & GC_TAG_MARK, "Heap allocation referenced from stack should be tagged");
+    mu_assert(gc_heap_is_marked(a->ptr), "Heap allocation referenced from stack should be tagged");
 
-    /* manually reset the tags */
-    a->tag = GC_TAG_NONE;
+    /* manually reset the marks */
+    gc_heap_clear_marks(gc_.heap);
 
     /* Part 2: Add dependent allocations and check if these allocations
      * get marked properly*/
@@ -206,19 +511,14 @@ static char* test_gc_mark_stack() {
     *five_ptr[1] = 5;
     gc_mark_stack(&gc_);
     a = gc_allocation_map_get(gc_.allocs, five_ptr);
-    mu_assert(a->tag & GC_TAG_MARK, "Referenced heap allocation should be tagged");
+    mu_assert(gc_heap_is_marked(a->ptr), "Referenced heap allocation should be tagged");
     for (size_t i=0; i<2; ++i) {
         a = gc_allocation_map_get(gc_.allocs, five_ptr[i]);
-        mu_assert(a->tag & GC_TAG_MARK, "Dependent heap allocs should be tagged");
+        mu_assert(gc_heap_is_marked(a->ptr), "Dependent heap allocs should be tagged");
     }
 
-    /* Clean up the tags manually */
-    a = gc_allocation_map_get(gc_.allocs, five_ptr);
-    a->tag = GC_TAG_NONE;
-    for (size_t i=0; i<2; ++i) {
-        a = gc_allocation_map_get(gc_.allocs, five_ptr[i]);
-        a->tag = GC_TAG_NONE;
-    }
+    /* Clean up the marks manually */
+    gc_heap_clear_marks(gc_.heap);
 
     /* Part3: Now delete the pointer to five_ptr[1] which should
      * leave the allocation for five_ptr[1] unmarked. */
@@ -226,23 +526,620 @@ static char* test_gc_mark_stack() {
     five_ptr[1] = NULL;
     gc_mark_stack(&gc_);
     a = gc_allocation_map_get(gc_.allocs, five_ptr);
-    mu_assert(a->tag & GC_TAG_MARK, "Referenced heap allocation should be tagged");
+    mu_assert(gc_heap_is_marked(a->ptr), "Referenced heap allocation should be tagged");
     a = gc_allocation_map_get(gc_.allocs, five_ptr[0]);
-    mu_assert(a->tag & GC_TAG_MARK, "Referenced alloc should be tagged");
-    mu_assert(unmarked_alloc->tag == GC_TAG_NONE, "Unreferenced alloc should not be tagged");
+    mu_assert(gc_heap_is_marked(a->ptr), "Referenced alloc should be tagged");
+    mu_assert(!gc_heap_is_marked(unmarked_alloc->ptr), "Unreferenced alloc should not be tagged");
 
-    /* Clean up the tags manually, again */
-    a = gc_allocation_map_get(gc_.allocs, five_ptr[0]);
-    a->tag = GC_TAG_NONE;
-    a = gc_allocation_map_get(gc_.allocs, five_ptr);
-    a->tag = GC_TAG_NONE;
+    /* Clean up the marks manually, again */
+    gc_heap_clear_marks(gc_.heap);
+
+    gc_stop(&gc_);
+    return NULL;
+}
+
+
+STACK_TEST static char* test_gc_scan_stride() {
+    GarbageCollector gc_;
+    void *bos = __builtin_frame_address(0);
+    GarbageCollectorOptions opts;
+    gc_options_init(&opts);
+    mu_assert(opts.scan_stride == GC_SCAN_STRIDE_ALIGNED, "Scanning should default to aligned words");
+    opts.scan_stride = 3;
+    gc_start_opts(&gc_, bos, &opts);
+    mu_assert(gc_.scan_stride == GC_SCAN_STRIDE_ALIGNED, "Invalid strides should fall back to aligned words");
+    gc_pause(&gc_);
+
+    /* Hide a pointer at an unaligned offset and one at an aligned offset */
+    char* holder = gc_malloc(&gc_, 4 * sizeof(void*));
+    void* aligned = gc_malloc(&gc_, 16);
+    void* unaligned = gc_malloc(&gc_, 16);
+    memcpy(holder, &aligned, sizeof(void*));
+    memcpy(holder + sizeof(void*) + 3, &unaligned, sizeof(void*));
+
+    gc_mark_alloc(&gc_, holder);
+    mu_assert(gc_heap_is_marked(aligned),
+              "Aligned pointers should be found by the aligned scan");
+    mu_assert(!gc_heap_is_marked(unaligned),
+              "Unaligned pointers should be skipped by the aligned scan");
+
+    /* The byte-granular compatibility mode finds both */
+    gc_heap_clear_marks(gc_.heap);
+    gc_.scan_stride = GC_SCAN_STRIDE_BYTES;
+    gc_mark_alloc(&gc_, holder);
+    mu_assert(gc_heap_is_marked(aligned),
+              "Byte scanning should find aligned pointers");
+    mu_assert(gc_heap_is_marked(unaligned),
+              "Byte scanning should find unaligned pointers");
+
+    gc_stop(&gc_);
+    return NULL;
+}
+
+typedef struct Node {
+    struct Node* next;
+    size_t value;
+} Node;
+
+STACK_TEST static char* test_gc_mark_deep_list() {
+    GarbageCollector gc_;
+    void *bos = __builtin_frame_address(0);
+    GarbageCollectorOptions opts;
+    gc_options_init(&opts);
+    opts.mark_stack_limit = 2;
+    gc_start_opts(&gc_, bos, &opts);
+    gc_pause(&gc_);
+
+    /* A list long enough to exhaust the C stack with recursive marking,
+     * hanging off a fan-out node that overflows the tiny mark stack. */
+    size_t N = 200000;
+    Node** fan = gc_calloc(&gc_, 8, sizeof(Node*));
+    Node* head = NULL;
+    for (size_t i = 0; i < N; ++i) {
+        Node* n = gc_malloc(&gc_, sizeof(Node));
+        n->next = head;
+        n->value = i;
+        head = n;
+    }
+    for (size_t i = 0; i < 8; ++i) {
+        fan[i] = gc_malloc(&gc_, sizeof(Node));
+    }
+    fan[7]->next = head;
+
+    gc_mark_alloc(&gc_, fan);
+    mu_assert(!gc_.worklist->overflowed, "Overflow should be resolved after marking");
+    mu_assert(gc_.worklist->capacity <= 2, "Mark stack must respect its limit");
+    size_t marked = 0;
+    for (size_t i=0; i<gc_.allocs->capacity; ++i) {
+        Allocation* chunk = &gc_.allocs->allocs[i];
+        marked += (chunk->ptr && gc_heap_is_marked(chunk->ptr)) ? 1 : 0;
+        mu_assert(!chunk->ptr || chunk->tag == GC_TAG_NONE, "Marking must not write metadata");
+    }
+    mu_assert(marked == N + 9, "Every reachable node should be marked");
+
+    /* Unmark by sweeping, nothing should be collected */
+    size_t collected = gc_sweep(&gc_);
+    mu_assert(collected == 0, "Reachable nodes must not be collected");
+    gc_stop(&gc_);
+    return NULL;
+}
+
+STACK_TEST static char* test_gc_mark_parallel() {
+    GarbageCollector gc_;
+    void *bos = __builtin_frame_address(0);
+    GarbageCollectorOptions opts;
+    gc_options_init(&opts);
+    opts.mark_threads = 4;
+    gc_start_opts(&gc_, bos, &opts);
+    gc_pause(&gc_);
+    mu_assert(gc_.mark_pool != NULL, "Mark pool should be created for multiple threads");
+
+    /* Several long lists hanging off a fan-out node, so that workers have
+     * something to steal, plus garbage that must stay unmarked. */
+    size_t W = 16, N = 20000;
+    Node** fan = gc_calloc(&gc_, W, sizeof(Node*));
+    for (size_t w = 0; w < W; ++w) {
+        for (size_t i = 0; i < N; ++i) {
+            Node* n = gc_malloc(&gc_, sizeof(Node));
+            n->next = fan[w];
+            n->value = i;
+            fan[w] = n;
+        }
+        gc_malloc(&gc_, sizeof(Node));
+    }
+
+    gc_mark_alloc(&gc_, fan);
+    size_t marked = 0;
+    for (size_t i=0; i<gc_.allocs->capacity; ++i) {
+        Allocation* chunk = &gc_.allocs->allocs[i];
+        marked += (chunk->ptr && gc_heap_is_marked(chunk->ptr)) ? 1 : 0;
+    }
+    mu_assert(marked == W * N + 1, "Every reachable node should be marked exactly");
+
+    size_t collected = gc_sweep(&gc_);
+    mu_assert(collected == W * sizeof(Node), "Only the unreachable nodes should be collected");
+    gc_stop(&gc_);
+    return NULL;
+}
+
+STACK_TEST static void* _mutator_thread(void* arg) {
+    GarbageCollector* gc_ = (GarbageCollector*) arg;
+    gc_register_thread(gc_, __builtin_frame_address(0));
+    /* The list is only reachable from this thread's stack and registers */
+    size_t N = 2000;
+    Node* head = NULL;
+    for (size_t i = 0; i < N; ++i) {
+        Node* n = gc_malloc(gc_, sizeof(Node));
+        n->next = head;
+        n->value = i;
+        head = n;
+        if (i % 250 == 0) {
+            gc_run(gc_);
+        }
+    }
+    size_t expected = N;
+    for (Node* n = head; n; n = n->next) {
+        if (n->value != --expected) {
+            break;
+        }
+    }
+    gc_unregister_thread(gc_);
+    return (void*) (uintptr_t) (expected == 0 && head->value == N - 1);
+}
+
+STACK_TEST static char* _run_mutator_threads(bool thread_cache) {
+    GarbageCollector gc_;
+    void *bos = __builtin_frame_address(0);
+    GarbageCollectorOptions opts;
+    gc_options_init(&opts);
+    opts.thread_cache = thread_cache;
+    gc_start_opts(&gc_, bos, &opts);
+    pthread_t threads[4];
+    for (size_t i = 0; i < 4; ++i) {
+        pthread_create(&threads[i], NULL, _mutator_thread, &gc_);
+    }
+    bool intact = true;
+    for (size_t i = 0; i < 4; ++i) {
+        void* result;
+        pthread_join(threads[i], &result);
+        intact = intact && result;
+    }
+    mu_assert(intact, "Lists held by other threads must survive collections");
+    mu_assert(gc_.threads->nthreads == 1, "Threads should unregister");
+    gc_stop(&gc_);
+    return NULL;
+}
+
+STACK_TEST static char* test_gc_threads() {
+    char* error = _run_mutator_threads(false);
+    return error ? error : _run_mutator_threads(true);
+}
+
+STACK_TEST static char* test_gc_thread_cache() {
+    GarbageCollector gc_;
+    void *bos = __builtin_frame_address(0);
+    GarbageCollectorOptions opts;
+    gc_options_init(&opts);
+    opts.thread_cache = true;
+    gc_start_opts(&gc_, bos, &opts);
+    gc_pause(&gc_);
+    ThreadCache* tc = &gc_current_thread->cache;
 
+    /* The fast path only records allocations in the thread's cache */
+    int** ptrs = gc_calloc(&gc_, 2, sizeof(int*));
+    for (size_t i = 0; i < 16; ++i) {
+        ptrs[i % 2] = gc_malloc(&gc_, sizeof(int));
+    }
+    mu_assert(tc->npending == 17, "Allocations should be pending in the cache");
+    mu_assert(gc_.allocs->size == 0, "Pending allocations are not in the map");
+    mu_assert(tc->free[gc_heap_size_class(sizeof(int))] != NULL, "Cache should hold spare slots");
+
+    /* Pending allocations are live and their referents get marked */
+    gc_mark(&gc_);
+    for (size_t i = 0; i < gc_.allocs->capacity; ++i) {
+        mu_assert(gc_.allocs->allocs[i].ptr == NULL, "Marking must not publish allocations");
+    }
+
+    /* Freeing publishes the thread's pending allocations first */
+    gc_free(&gc_, ptrs[0]);
+    mu_assert(tc->npending == 0, "Freeing should publish pending allocations");
+    mu_assert(gc_.allocs->size == 16, "Published allocations should be in the map");
+
+    /* Filling the pending list forces a publish on the next allocation */
+    for (size_t i = 0; i < GC_THREAD_CACHE_PENDING + 1; ++i) {
+        gc_malloc(&gc_, 32);
+    }
+    mu_assert(tc->npending == 1, "A full cache should be published");
+    mu_assert(gc_.allocs->size == 16 + GC_THREAD_CACHE_PENDING, "Published allocations should be in the map");
+
+    /* Cached countdowns are drawn when the cache first sees an interval,
+     * not left at zero or at what the previous interval gave them */
+    gc_set_profile_interval(&gc_, (size_t) 1 << 40);
+    gc_malloc(&gc_, 32);
+    mu_assert(gc_.profiler->nsamples == 0, "A fresh cache should not sample its first allocation");
+    gc_set_profile_interval(&gc_, 1);
+    gc_malloc(&gc_, 32);
+    mu_assert(gc_.profiler->nsamples == 1, "A short interval should sample every allocation");
+    gc_set_profile_interval(&gc_, (size_t) 1 << 40);
+    gc_malloc(&gc_, 32);
+    mu_assert(gc_.profiler->nsamples == 1, "A new interval should reseed the cached countdown");
     gc_stop(&gc_);
     return NULL;
 }
 
+STACK_TEST static void _link_young(GarbageCollector* gc, Node* old) {
+    /* Use another size class, so pointers just past the old object cannot
+     * be taken for pointers into the young one */
+    Node* young = gc_malloc(gc, 64);
+    young->value = 42;
+    old->next = young;
+    gc_write_barrier(gc, old, &old->next);
+    for (size_t i = 0; i < 10; ++i) {
+        gc_malloc(gc, sizeof(Node));
+    }
+}
 
-static char* test_gc_basic_alloc_free() {
+STACK_TEST static bool _young_promoted(GarbageCollector* gc, Node* old) {
+    Allocation* alloc = gc_allocation_map_get(gc->allocs, old->next);
+    bool promoted = old->next->value == 42 && alloc && (alloc->tag & GC_TAG_OLD);
+    _clear_stack();
+    return promoted;
+}
+
+STACK_TEST static char* test_gc_generational() {
+    GarbageCollector gc_;
+    void *bos = __builtin_frame_address(0);
+    GarbageCollectorOptions opts;
+    gc_options_init(&opts);
+    opts.generational = true;
+    opts.promote_age = 1;
+    gc_start_opts(&gc_, bos, &opts);
+    gc_pause(&gc_);
+
+    /* Surviving a collection promotes the root */
+    Node* root = gc_malloc_static(&gc_, sizeof(Node), NULL);
+    gc_run(&gc_);
+    Allocation* alloc = gc_allocation_map_get(gc_.allocs, root);
+    mu_assert(alloc->tag & GC_TAG_OLD, "Survivors should be promoted");
+    mu_assert(gc_.old_bytes == sizeof(Node), "Old generation should be accounted");
+
+    /* A minor collection finds the young object through the dirty card
+     * and reclaims the young garbage */
+    _link_young(&gc_, root);
+    _clear_stack();
+    size_t collected = gc_run_minor(&gc_);
+    mu_assert(collected == 10 * sizeof(Node), "Minor collection should reclaim young garbage");
+    mu_assert(_young_promoted(&gc_, root), "Young objects referenced from old ones must survive");
+
+    /* Old garbage is left to major collections */
+    root->next = NULL;
+    _clear_stack();
+    collected = gc_run_minor(&gc_);
+    mu_assert(collected == 0, "Minor collections must not reclaim old objects");
+    _clear_stack();
+    collected = gc_run(&gc_);
+    mu_assert(collected == 64, "Major collections should reclaim old garbage");
+    mu_assert(gc_.old_bytes == sizeof(Node), "Old generation should shrink");
+
+    /* Reallocating old objects keeps the old generation accounted */
+    root = gc_realloc(&gc_, root, 8);
+    mu_assert(gc_.old_bytes == 8, "Resizing in place should resize the old generation");
+    root = gc_realloc(&gc_, root, 100);
+    mu_assert(gc_.old_bytes == 0, "Moved objects should leave the old generation");
+    /* The collection the copy triggers promotes the object it copies */
+    gc_resume(&gc_);
+    gc_.pacer->goal = 0;
+    root = gc_realloc(&gc_, root, 200);
+    gc_pause(&gc_);
+    mu_assert(gc_.stats.minor_collections == 3, "The reallocation should trigger a minor collection");
+    mu_assert(gc_.old_bytes == 0, "Objects promoted while moving should leave the old generation");
+    gc_free(&gc_, root);
+    mu_assert(gc_.old_bytes == 0, "Freeing the young copy should not touch the old generation");
+    gc_stop(&gc_);
+    return NULL;
+}
+
+STACK_TEST static void _hide_garbage(GarbageCollector* gc, Node* root) {
+    Node* hidden = gc_malloc(gc, 64);
+    hidden->value = 42;
+    /* Flipped bits keep the conservative scan from seeing the pointer */
+    root->value = ~(size_t) hidden;
+    for (size_t i = 0; i < 10; ++i) {
+        gc_malloc(gc, sizeof(Node));
+    }
+}
+
+STACK_TEST static char* test_gc_incremental() {
+    GarbageCollector gc_;
+    void *bos = __builtin_frame_address(0);
+    GarbageCollectorOptions opts;
+    gc_options_init(&opts);
+    opts.incremental = true;
+    gc_start_opts(&gc_, bos, &opts);
+    gc_pause(&gc_);
+
+    Node* root = gc_malloc_static(&gc_, sizeof(Node), NULL);
+    _hide_garbage(&gc_, root);
+    _clear_stack();
+    /* Leaves a live pointer in the registers the garbage went through */
+    Node* live = gc_malloc(&gc_, sizeof(Node));
+    gc_mark_begin(&gc_);
+    mu_assert(gc_.marking, "Incremental mark should be in progress");
+    Node* fresh = gc_malloc(&gc_, sizeof(Node));
+    mu_assert(gc_heap_is_marked(fresh),
+              "Objects allocated during the mark should be marked");
+    mu_assert(gc_mark_increment(&gc_, SIZE_MAX, 0), "Mark stack should drain");
+
+    /* Storing the hidden object into the scanned root must shade it */
+    Node* hidden = (Node*) ~root->value;
+    mu_assert(!gc_heap_is_marked(hidden),
+              "Unreachable objects should not be marked");
+    root->next = hidden;
+    gc_write_barrier(&gc_, root, &root->next);
+    mu_assert(gc_heap_is_marked(hidden),
+              "The write barrier should mark stored pointers");
+
+    _clear_stack();
+    while (gc_step(&gc_, 1000000)) {
+    }
+    mu_assert(!gc_.marking && !gc_sweep_pending(&gc_), "Steps should finish the cycle");
+    mu_assert(gc_.allocs->size == 4 && live, "Garbage should be reclaimed");
+    mu_assert(root->next->value == 42, "Objects stored during the mark must survive");
+
+    /* Allocations finish the mark on their own */
+    gc_resume(&gc_);
+    gc_mark_begin(&gc_);
+    for (size_t i = 0; i < 100 && gc_.marking; ++i) {
+        gc_malloc(&gc_, sizeof(Node));
+    }
+    mu_assert(!gc_.marking, "Allocation should assist the mark");
+    mu_assert(root->next->value == 42, "Roots should survive assisted marks");
+    gc_stop(&gc_);
+    return NULL;
+}
+
+STACK_TEST static void _allocate_garbage(GarbageCollector* gc, size_t n, size_t size) {
+    for (size_t i = 0; i < n; ++i) {
+        gc_malloc(gc, size);
+    }
+}
+
+STACK_TEST static char* test_gc_pacer() {
+    GarbageCollector gc_;
+    void *bos = __builtin_frame_address(0);
+    GarbageCollectorOptions opts;
+    gc_options_init(&opts);
+    opts.min_heap = 64 * 1024;
+    gc_start_opts(&gc_, bos, &opts);
+    mu_assert(gc_.pacer->goal == 64 * 1024, "The first goal should be the minimum heap");
+
+    /* The goal doubles the live bytes */
+    void* live = gc_malloc_static(&gc_, 100000, NULL);
+    gc_run(&gc_);
+    mu_assert(gc_.pacer->live == 100000 && gc_.pacer->goal == 200000,
+              "The goal should grow with the live bytes");
+
+    /* Many small objects do not trigger a collection before the goal */
+    _allocate_garbage(&gc_, 5000, 16);
+    mu_assert(gc_.allocs->size == 5001, "Collections should wait for the heap goal");
+    /* Few large ones do */
+    _allocate_garbage(&gc_, 100, 1024);
+    mu_assert(gc_.allocs->size < 5101 && gc_.pacer->live < 200000,
+              "Collections should start at the heap goal");
+    gc_stop(&gc_);
+
+    /* gc_start_ext collects by the load of the allocation map */
+    gc_start_ext(&gc_, bos, 32, 32, 0.0, DBL_MAX, 0.5);
+    _allocate_garbage(&gc_, 64, 1024);
+    mu_assert(gc_.allocs->size <= 17, "Collections should start at the sweep factor");
+    gc_stop(&gc_);
+
+    /* A collector busy for 90% of the time gets more runway */
+    Pacer* pacer = gc_pacer_new(1.0, 0, 0.25);
+    pacer->cycle_end_ns = gc_pacer_now() - 1000000;
+    pacer->gc_ns = 900000;
+    gc_pacer_cycle_done(pacer, 1000);
+    mu_assert(pacer->goal == 2000, "Runway is only extended from the last one");
+    pacer->cycle_end_ns = gc_pacer_now() - 1000000;
+    pacer->gc_ns = 900000;
+    gc_pacer_cycle_done(pacer, 1000);
+    mu_assert(pacer->goal > 2000, "The CPU fraction target should raise the goal");
+    pacer->cpu_fraction = 0.0;
+    pacer->gc_ns = 900000;
+    gc_pacer_cycle_done(pacer, 1000);
+    mu_assert(pacer->goal == 2000, "Without a target the goal only follows the live bytes");
+    gc_pacer_delete(pacer);
+
+    /* Collections time only their own work, also when they complete the
+     * cycle they are timing */
+    opts.gc_cpu_fraction = 0.25;
+    gc_start_opts(&gc_, bos, &opts);
+    gc_malloc_static(&gc_, 100000, NULL);
+    uint64_t start = gc_pacer_now();
+    gc_run(&gc_);
+    gc_run(&gc_);
+    mu_assert(gc_.pacer->gc_ns <= gc_pacer_now() - start && gc_.pacer->clock_ns == 0,
+              "Collections should account the time they took");
+    gc_stop(&gc_);
+    UNUSED(live);
+    return NULL;
+}
+
+typedef struct Pair {
+    size_t number;
+    Node* node;
+} Pair;
+
+static const uintptr_t PAIR_BITMAP[] = { (uintptr_t) 1 << GC_LAYOUT_WORD(Pair, node) };
+static const GcLayout PAIR_LAYOUT = { GC_LAYOUT_WORDS(Pair), PAIR_BITMAP };
+
+STACK_TEST static void _fill_typed(GarbageCollector* gc, Pair* pairs, void** buffer) {
+    buffer[0] = gc_malloc(gc, sizeof(Node));
+    for (size_t i = 0; i < 4; ++i) {
+        /* Numbers that look like pointers must not keep objects alive. Use
+         * another size class, so pointers just past the nodes cannot be
+         * taken for pointers into them. */
+        pairs[i].number = (size_t) gc_malloc(gc, 64);
+        pairs[i].node = gc_malloc(gc, sizeof(Node));
+    }
+}
+
+STACK_TEST static char* _run_typed(size_t mark_threads) {
+    GarbageCollector gc_;
+    void *bos = __builtin_frame_address(0);
+    GarbageCollectorOptions opts;
+    gc_options_init(&opts);
+    opts.mark_threads = mark_threads;
+    gc_start_opts(&gc_, bos, &opts);
+    gc_pause(&gc_);
+
+    Pair* pairs = gc_malloc_typed(&gc_, 4 * sizeof(Pair), &PAIR_LAYOUT);
+    void** buffer = gc_malloc_atomic(&gc_, 64);
+    _fill_typed(&gc_, pairs, buffer);
+    _clear_stack();
+    size_t collected = gc_run(&gc_);
+    mu_assert(collected == 4 * 64 + sizeof(Node), "Non-pointer words should not be scanned");
+    for (size_t i = 0; i < 4; ++i) {
+        mu_assert(gc_allocation_map_get(gc_.allocs, pairs[i].node), "Pointer words should be scanned");
+        mu_assert(!gc_allocation_map_get(gc_.allocs, (void*) pairs[i].number), "Numbers should be ignored");
+    }
+    mu_assert(gc_allocation_map_get(gc_.allocs, buffer) && !gc_allocation_map_get(gc_.allocs, buffer[0]),
+              "Atomic objects should not be scanned");
+
+    /* Reallocation keeps the layout */
+    pairs = gc_realloc(&gc_, pairs, 64 * sizeof(Pair));
+    mu_assert(gc_allocation_map_get(gc_.allocs, pairs)->layout == &PAIR_LAYOUT,
+              "Reallocated objects should keep their layout");
+    char* s = gc_strdup(&gc_, "atomic");
+    mu_assert(gc_allocation_map_get(gc_.allocs, s)->layout->words == 0,
+              "Strings should be pointer-free");
+    gc_stop(&gc_);
+    return NULL;
+}
+
+STACK_TEST static char* test_gc_typed() {
+    char* error = _run_typed(1);
+    /* The first run leaves pointers in the frame of the second */
+    _clear_stack();
+    return error ? error : _run_typed(4);
+}
+
+STACK_TEST static void _fill_large(GarbageCollector* gc, void** big, size_t n) {
+    big[0] = gc_malloc(gc, sizeof(Node));
+    big[n / 2] = gc_malloc(gc, sizeof(Node));
+    big[n - 1] = gc_malloc(gc, sizeof(Node));
+}
+
+STACK_TEST static char* _run_large(size_t mark_threads) {
+    GarbageCollector gc_;
+    void *bos = __builtin_frame_address(0);
+    GarbageCollectorOptions opts;
+    gc_options_init(&opts);
+    opts.mark_threads = mark_threads;
+    opts.large_object_threshold = 64 * 1024;
+    gc_start_opts(&gc_, bos, &opts);
+    gc_pause(&gc_);
+
+    size_t n = (1 << 20) / sizeof(void*);
+    void** big = gc_malloc(&gc_, n * sizeof(void*));
+    mu_assert(gc_heap_page_of(big)->mapped, "Large objects should be mapped");
+    mu_assert(!gc_heap_page_of(gc_malloc(&gc_, 32 * 1024))->mapped,
+              "Objects below the threshold should not be mapped");
+    _fill_large(&gc_, big, n);
+    _clear_stack();
+    size_t collected = gc_run(&gc_);
+    mu_assert(collected == 32 * 1024, "Only the unreferenced block should be collected");
+    mu_assert(gc_allocation_map_get(gc_.allocs, big[n - 1]), "The end of large objects should be scanned");
+
+    /* Large objects are scanned a chunk at a time */
+    WorkItem item;
+    gc_mark_candidate(&gc_, big);
+    gc_worklist_pop(gc_.worklist, &item);
+    gc_mark_item(&gc_, &item);
+    mu_assert(gc_.worklist->size == 2 && gc_.worklist->items[0].ptr == (char*) big + GC_MARK_CHUNK,
+              "The rest of a large object should be queued");
+    gc_mark_drain(&gc_);
+    gc_run(&gc_);
+
+    /* Released blocks are cached for reuse */
+    size_t committed = gc_.heap->committed;
+    void* old = big;
+    /* the head of the object shares its page with the block header */
+    big[0] = old;
+    gc_free(&gc_, big);
+    mu_assert(gc_.heap->ncached == 1 && gc_.heap->committed < committed,
+              "Released blocks should be cached and discarded");
+    big = gc_malloc(&gc_, n * sizeof(void*));
+    mu_assert(big == old && gc_.heap->ncached == 0 && big[0] == NULL && big[n - 1] == NULL,
+              "Cached blocks should be reused zeroed");
+    gc_stop(&gc_);
+    return NULL;
+}
+
+STACK_TEST static char* test_gc_large_objects() {
+    char* error = _run_large(1);
+    _clear_stack();
+    return error ? error : _run_large(4);
+}
+
+static void* ROOT_GLOBAL = NULL;
+static void* SEGMENT_GLOBAL = NULL;
+#define HIDE(p) ((uintptr_t) (p) ^ (uintptr_t) 0x5a5a5a5a)
+
+STACK_TEST static uintptr_t _store_global(GarbageCollector* gc, void** global) {
+    *global = gc_malloc(gc, 48);
+    return HIDE(*global);
+}
+
+STACK_TEST static bool _is_allocated(GarbageCollector* gc, uintptr_t hidden) {
+    return gc_allocation_map_get(gc->allocs, (void*) HIDE(hidden)) != NULL;
+}
+
+STACK_TEST static char* test_gc_root_ranges() {
+    GarbageCollector gc_;
+    void *bos = __builtin_frame_address(0);
+    gc_start(&gc_, bos);
+    gc_pause(&gc_);
+
+    /* Registered ranges keep their referents alive */
+    uintptr_t hidden = _store_global(&gc_, &ROOT_GLOBAL);
+    mu_assert(gc_add_root_range(&gc_, &ROOT_GLOBAL, sizeof(ROOT_GLOBAL)), "Range should be added");
+    _clear_stack();
+    gc_run(&gc_);
+    mu_assert(_is_allocated(&gc_, hidden),
+              "Objects referenced from root ranges must survive");
+    gc_remove_root_range(&gc_, &ROOT_GLOBAL, sizeof(ROOT_GLOBAL));
+    _clear_stack();
+    gc_run(&gc_);
+    mu_assert(!_is_allocated(&gc_, hidden),
+              "Removed ranges should not be scanned");
+    ROOT_GLOBAL = NULL;
+    gc_stop(&gc_);
+
+#if defined(__linux__)
+    /* Data segments are scanned without registration */
+    GarbageCollectorOptions opts;
+    gc_options_init(&opts);
+    opts.scan_data_segments = true;
+    gc_start_opts(&gc_, bos, &opts);
+    gc_pause(&gc_);
+    hidden = _store_global(&gc_, &SEGMENT_GLOBAL);
+    _clear_stack();
+    gc_run(&gc_);
+    mu_assert(gc_.root_ranges->size > 0, "Data segments should be found");
+    mu_assert(_is_allocated(&gc_, hidden),
+              "Objects referenced from globals must survive");
+    SEGMENT_GLOBAL = NULL;
+    _clear_stack();
+    gc_run(&gc_);
+    mu_assert(!_is_allocated(&gc_, hidden),
+              "Objects no longer referenced from globals should be reclaimed");
+    gc_stop(&gc_);
+#endif
+    return NULL;
+}
+
+STACK_TEST static char* test_gc_basic_alloc_free() {
     /* Create an array of pointers to an int. Then delete the pointer to
      * the containing array and check if all the contained allocs are garbage
      * collected.
@@ -265,14 +1162,12 @@ static char* test_gc_basic_alloc_free() {
     /* Test that all managed allocations get tagged if the root is present */
     gc_mark(&gc_);
     for (size_t i=0; i<gc_.allocs->capacity; ++i) {
-        Allocation* chunk = gc_.allocs->allocs[i];
-        while (chunk) {
-            mu_assert(chunk->tag & GC_TAG_MARK, "Referenced allocs should be marked");
-            // reset for next test
-            chunk->tag = GC_TAG_NONE;
-            chunk = chunk->next;
-        }
+        Allocation* chunk = &gc_.allocs->allocs[i];
+        if (!chunk->ptr) continue;
+        mu_assert(gc_heap_is_marked(chunk->ptr), "Referenced allocs should be marked");
     }
+    // reset for next test
+    gc_heap_clear_marks(gc_.heap);
 
     /* Now drop the root allocation */
     ints = NULL;
@@ -281,12 +1176,10 @@ static char* test_gc_basic_alloc_free() {
     /* Check that none of the allocations get tagged */
     size_t total = 0;
     for (size_t i=0; i<gc_.allocs->capacity; ++i) {
-        Allocation* chunk = gc_.allocs->allocs[i];
-        while (chunk) {
-            mu_assert(!(chunk->tag & GC_TAG_MARK), "Unreferenced allocs should not be marked");
-            total += chunk->size;
-            chunk = chunk->next;
-        }
+        Allocation* chunk = &gc_.allocs->allocs[i];
+        if (!chunk->ptr) continue;
+        mu_assert(!gc_heap_is_marked(chunk->ptr), "Unreferenced allocs should not be marked");
+        total += chunk->size;
     }
     mu_assert(total == 16 * sizeof(int) + 16 * sizeof(int*),
               "Expected number of managed bytes is off");
@@ -299,7 +1192,7 @@ static char* test_gc_basic_alloc_free() {
     return NULL;
 }
 
-static void _create_static_allocs(GarbageCollector* gc,
+STACK_TEST static void _create_static_allocs(GarbageCollector* gc,
                                   size_t count,
                                   size_t size) {
     for (size_t i=0; i<count; ++i) {
@@ -308,7 +1201,7 @@ static void _create_static_allocs(GarbageCollector* gc,
     }
 }
 
-static char* test_gc_static_allocation() {
+STACK_TEST static char* test_gc_static_allocation() {
     DTOR_COUNT = 0;
     GarbageCollector gc_;
     void *bos = __builtin_frame_address(0);
@@ -319,6 +1212,16 @@ static char* test_gc_static_allocation() {
     /* make sure they are not garbage collected */
     size_t collected = gc_run(&gc_);
     mu_assert(collected == 0, "Static objects should not be collected");
+    mu_assert(gc_.roots->size == N, "Static objects should be in the root set");
+    /* a static object that is no longer static is collected */
+    void* p = gc_malloc_static(&gc_, 512, dtor);
+    p = gc_realloc(&gc_, p, 4096);
+    mu_assert(gc_.roots->size == N + 1 && gc_.roots->roots[N] == p,
+              "Reallocated static objects should stay in the root set");
+    gc_unmake_static(&gc_, p);
+    mu_assert(gc_.roots->size == N, "Unmade static objects should leave the root set");
+    gc_free(&gc_, p);
+    DTOR_COUNT = 0;
     /* remove the root tag from the roots on the heap */
     gc_unroot_roots(&gc_);
     /* run the mark phase */
@@ -327,14 +1230,12 @@ static char* test_gc_static_allocation() {
     size_t total = 0;
     size_t n = 0;
     for (size_t i=0; i<gc_.allocs->capacity; ++i) {
-        Allocation* chunk = gc_.allocs->allocs[i];
-        while (chunk) {
-            mu_assert(!(chunk->tag & GC_TAG_MARK), "Marked an unused alloc");
-            mu_assert(!(chunk->tag & GC_TAG_ROOT), "Unrooting failed");
-            total += chunk->size;
-            n++;
-            chunk = chunk->next;
-        }
+        Allocation* chunk = &gc_.allocs->allocs[i];
+        if (!chunk->ptr) continue;
+        mu_assert(!gc_heap_is_marked(chunk->ptr), "Marked an unused alloc");
+        mu_assert(!(chunk->tag & GC_TAG_ROOT), "Unrooting failed");
+        total += chunk->size;
+        n++;
     }
     mu_assert(n == N, "Expected number of allocations is off");
     mu_assert(total == N*512, "Expected number of managed bytes is off");
@@ -347,7 +1248,7 @@ static char* test_gc_static_allocation() {
     return NULL;
 }
 
-static char* test_gc_realloc() {
+STACK_TEST static char* test_gc_realloc() {
     GarbageCollector gc_;
     void *bos = __builtin_frame_address(0);
     gc_start(&gc_, bos);
@@ -385,11 +1286,23 @@ static char* test_gc_realloc() {
         mu_assert(a->size == 42*sizeof(int*), "Wrong allocation size");
     }
 
+    /* grow a mapped block within its pages */
+    {
+        size_t size = GC_HEAP_MMAP_THRESHOLD + 1;
+        char* big = gc_malloc(&gc_, size);
+        size_t used = gc_.heap->used;
+        size_t grown = gc_heap_usable_size(big);
+        mu_assert(grown > size && gc_realloc(&gc_, big, grown) == big, "Large blocks should grow in place");
+        mu_assert(gc_heap_object_start(gc_.heap, big + grown - 1) == big,
+                  "Pointers into the grown tail should resolve to the object");
+        mu_assert(gc_.heap->used == used + grown - size, "The heap should account for the growth");
+    }
+
     gc_stop(&gc_);
     return NULL;
 }
 
-static void _create_allocs(GarbageCollector* gc,
+STACK_TEST static void _create_allocs(GarbageCollector* gc,
                            size_t count,
                            size_t size) {
     for (size_t i=0; i<count; ++i) {
@@ -397,7 +1310,7 @@ static void _create_allocs(GarbageCollector* gc,
     }
 }
 
-static char* test_gc_pause_resume() {
+STACK_TEST static char* test_gc_pause_resume() {
     GarbageCollector gc_;
     void *bos = __builtin_frame_address(0);
     gc_start(&gc_, bos);
@@ -419,19 +1332,310 @@ static char* test_gc_pause_resume() {
     return NULL;
 }
 
-static char* duplicate_string(GarbageCollector* gc, char* str) {
+STACK_TEST static char* test_gc_stats() {
+    GarbageCollector gc_;
+    void *bos = __builtin_frame_address(0);
+    gc_start(&gc_, bos);
+    gc_pause(&gc_);
+    size_t N = 100;
+    _create_allocs(&gc_, N, 64);
+    void* live = gc_malloc(&gc_, 64);
+    _clear_stack();
+    size_t collected = gc_run(&gc_);
+
+    GcStats stats;
+    gc_get_stats(&gc_, &stats);
+    mu_assert(stats.collections == 1 && stats.minor_collections == 0, "Collections should be counted");
+    mu_assert(stats.allocated_objects == N + 1 && stats.allocated_bytes == (N + 1) * 64,
+              "Allocations should be counted");
+    mu_assert(stats.freed_bytes == collected && stats.freed_objects == collected / 64,
+              "Freed objects should be counted");
+    mu_assert(stats.live_objects == 1 && stats.live_bytes == 64 && live,
+              "Live objects should be counted");
+    uint64_t pauses = 0;
+    for (size_t i = 0; i < GC_STATS_PAUSE_BUCKETS; ++i) {
+        pauses += stats.pause_histogram[i];
+    }
+    mu_assert(stats.pauses == 1 && pauses == 1, "The collection should be one pause");
+    mu_assert(stats.pause_max_ns == stats.pause_total_ns && stats.pause_max_ns > 0,
+              "The pause should be timed");
+    mu_assert(stats.pause_total_ns >= stats.stack_ns + stats.mark_ns + stats.sweep_ns,
+              "Phases should add up to less than the pause");
+    size_t entries = 0;
+    for (size_t i = 0; i < GC_STATS_PROBE_BUCKETS; ++i) {
+        entries += stats.map_probes[i];
+    }
+    mu_assert(entries == 1 && stats.map_load > 0.0, "The map statistics should cover every entry");
+    mu_assert(stats.allocation_rate > 0.0, "The allocation rate should be known");
+    gc_stop(&gc_);
+    return NULL;
+}
+
+static size_t _count_events(GcTraceEvent* events, size_t n, uint16_t type) {
+    size_t count = 0;
+    for (size_t i = 0; i < n; ++i) {
+        count += events[i].type == type;
+    }
+    return count;
+}
+
+STACK_TEST static char* test_gc_trace() {
+    GarbageCollector gc_;
+    void *bos = __builtin_frame_address(0);
+    GarbageCollectorOptions opts;
+    gc_options_init(&opts);
+    opts.trace_level = GC_TRACE_LEVEL_ALL;
+    gc_start_opts(&gc_, bos, &opts);
+    gc_pause(&gc_);
+    /* not static: the data segment test would find the addresses */
+    GcTraceEvent* events = malloc(GC_TRACE_RING_SIZE * sizeof(GcTraceEvent));
+
+    _create_allocs(&gc_, 10, 64);
+    _clear_stack();
+    size_t collected = gc_run(&gc_);
+    size_t n = gc_trace_drain(&gc_, events, GC_TRACE_RING_SIZE);
+    mu_assert(_count_events(events, n, GC_EVENT_ALLOC) == 10, "Allocations should be traced");
+    mu_assert(_count_events(events, n, GC_EVENT_FREE) == collected / 64, "Frees should be traced");
+    mu_assert(_count_events(events, n, GC_EVENT_BEGIN) == 1 && _count_events(events, n, GC_EVENT_END) == 1,
+              "Collections should be traced");
+    mu_assert(_count_events(events, n, GC_EVENT_PHASE) >= 4, "Phases should be traced");
+    mu_assert(gc_trace_drain(&gc_, events, GC_TRACE_RING_SIZE) == 0, "Drained events should be gone");
+
+    /* Collections only */
+    gc_set_trace_level(&gc_, GC_TRACE_LEVEL_GC);
+    _create_allocs(&gc_, 10, 64);
+    gc_run(&gc_);
+    n = gc_trace_drain(&gc_, events, GC_TRACE_RING_SIZE);
+    mu_assert(_count_events(events, n, GC_EVENT_ALLOC) == 0 && _count_events(events, n, GC_EVENT_BEGIN) == 1,
+              "Only collections should be traced");
+
+    /* Off */
+    gc_set_trace_level(&gc_, GC_TRACE_LEVEL_OFF);
+    _create_allocs(&gc_, 10, 64);
+    gc_run(&gc_);
+    mu_assert(gc_trace_drain(&gc_, events, GC_TRACE_RING_SIZE) == 0, "Nothing should be traced");
+
+    /* Full rings drop events */
+    gc_set_trace_level(&gc_, GC_TRACE_LEVEL_ALL);
+    _create_allocs(&gc_, GC_TRACE_RING_SIZE + 10, 16);
+    GcStats stats;
+    gc_get_stats(&gc_, &stats);
+    /* map resizes are traced as well */
+    mu_assert(stats.trace_dropped >= 10, "Events beyond the ring size should be dropped");
+
+    FILE* file = tmpfile();
+    mu_assert(gc_trace_write(&gc_, fileno(file)) == GC_TRACE_RING_SIZE, "All events should be written");
+    mu_assert(lseek(fileno(file), 0, SEEK_END)
+              == (off_t) (sizeof(GC_TRACE_MAGIC) - 1 + GC_TRACE_RING_SIZE * sizeof(GcTraceEvent)),
+              "The trace file should hold the header and the events");
+    fclose(file);
+    free(events);
+    gc_stop(&gc_);
+
+    /* A thread alternating between tracers keeps one ring in each */
+    Tracer* first = gc_tracer_new();
+    Tracer* second = gc_tracer_new();
+    for (size_t i = 0; i < 3; ++i) {
+        gc_tracer_emit(first, GC_EVENT_ALLOC, 0, 0);
+        gc_tracer_emit(second, GC_EVENT_ALLOC, 0, 0);
+    }
+    mu_assert(first->nthreads == 1 && second->nthreads == 1, "Threads should find their rings again");
+    gc_tracer_delete(first);
+    gc_tracer_delete(second);
+    return NULL;
+}
+
+/* Addresses of the objects made by _record_graph, hidden from the scan */
+static uintptr_t RECORDED[3];
+
+STACK_TEST static void _record_graph(GarbageCollector* gc) {
+    void** node = gc_malloc(gc, 64);
+    node[0] = gc_calloc(gc, 4, 16);
+    gc_write_barrier(gc, node, &node[0]);
+    gc_write_barrier(gc, node, &node[1]);
+    RECORDED[0] = HIDE(node);
+    RECORDED[1] = HIDE(node[0]);
+    RECORDED[2] = HIDE(gc_realloc(gc, gc_strdup(gc, "recorded"), 100));
+}
+
+STACK_TEST static char* test_gc_record() {
+    GarbageCollector gc_;
+    void *bos = __builtin_frame_address(0);
+    gc_start(&gc_, bos);
+    gc_pause(&gc_);
+    FILE* file = tmpfile();
+    mu_assert(gc_record_start(&gc_, fileno(file)), "Recording should start");
+    _record_graph(&gc_);
+    _clear_stack();
+    gc_run(&gc_);
+    void* unrecorded = gc_malloc(&gc_, 16);
+    gc_record_stop(&gc_);
+    gc_malloc(&gc_, 16);
+    gc_free(&gc_, unrecorded);
+    uint64_t events = gc_record_stop(&gc_);
+
+    static char data[4096];
+    size_t len = (size_t) pread(fileno(file), data, sizeof(data), 0);
+    fclose(file);
+    size_t header = sizeof(GC_RECORD_MAGIC) - 1;
+    mu_assert(len > header && memcmp(data, GC_RECORD_MAGIC, header) == 0, "The record should have a header");
+    size_t counts[GC_RECORD_RUN + 1] = { 0 };
+    size_t n = 0;
+    uintptr_t last = 0;
+    GcRecordEvent e;
+    for (size_t pos = header, size; (size = gc_record_decode(data + pos, len - pos, &last, &e)); pos += size) {
+        mu_assert(pos + size <= len, "Events should not run past the record");
+        counts[e.type]++;
+        n++;
+        if (e.type == GC_RECORD_ALLOC && e.addr == HIDE(RECORDED[1])) {
+            mu_assert(e.a == 64 && e.b == GC_RECORD_ALLOC_CALLOC, "Calloc should be recorded with its size");
+        } else if (e.type == GC_RECORD_ALLOC && e.b == GC_RECORD_ALLOC_ATOMIC) {
+            mu_assert(e.a == 9, "Strings should be recorded as atomic");
+        } else if (e.type == GC_RECORD_EDGE) {
+            mu_assert(e.addr == HIDE(RECORDED[0]) && e.a == 0 && e.b == HIDE(RECORDED[1]),
+                      "Pointer stores should be recorded as edges");
+        } else if (e.type == GC_RECORD_CLEAR) {
+            mu_assert(e.addr == HIDE(RECORDED[0]) && e.a == sizeof(void*), "Null stores should be recorded");
+        } else if (e.type == GC_RECORD_REALLOC) {
+            mu_assert(e.a == HIDE(RECORDED[2]) && e.b == 100, "Reallocations should be recorded");
+        }
+    }
+    mu_assert(n == events, "Every recorded event should decode");
+    mu_assert(counts[GC_RECORD_ALLOC] == 4 && counts[GC_RECORD_REALLOC] == 1, "Allocations should be recorded");
+    mu_assert(counts[GC_RECORD_RUN] == 1, "Collections run by the program should be recorded");
+    mu_assert(counts[GC_RECORD_DEATH] == 3, "Objects reclaimed by the collector should be recorded");
+    mu_assert(counts[GC_RECORD_FREE] == 0, "Nothing should be recorded after stopping");
+    gc_stop(&gc_);
+    return NULL;
+}
+
+STACK_TEST static void _dump_graph(GarbageCollector* gc) {
+    void** parent = gc_malloc_static(gc, 32, NULL);
+    parent[0] = gc_malloc(gc, 64);
+    parent[1] = gc_strdup(gc, "dumped");
+    gc_malloc(gc, 48);
+}
+
+STACK_TEST static char* test_gc_heap_dump() {
+    GarbageCollector gc_;
+    void *bos = __builtin_frame_address(0);
+    gc_start(&gc_, bos);
+    gc_pause(&gc_);
+    _dump_graph(&gc_);
+    _clear_stack();
+    FILE* file = tmpfile();
+    mu_assert(gc_heap_dump(&gc_, fileno(file)), "The heap should be dumped");
+
+    /* not static: the data segment test would find the addresses */
+    char* data = malloc(4096);
+    size_t len = (size_t) pread(fileno(file), data, 4096, 0);
+    fclose(file);
+    GcDumpHeader* header = (GcDumpHeader*) data;
+    mu_assert(len >= sizeof(GcDumpHeader) && memcmp(header->magic, GC_DUMP_MAGIC, 8) == 0,
+              "The dump should have a header");
+    mu_assert(header->nobjects == 4 && header->nrefs == 2, "Every object and reference should be dumped");
+    mu_assert(header->refs == header->objects + 4 * sizeof(GcDumpObject)
+              && len == header->refs + 2 * sizeof(uint64_t), "The arrays should follow each other");
+    GcDumpObject* objects = (GcDumpObject*) (data + header->objects);
+    uint64_t* refs = (uint64_t*) (data + header->refs);
+    size_t found = 0;
+    for (size_t i = 0; i < 4; ++i) {
+        GcDumpObject* obj = &objects[i];
+        if (obj->size == 32) {
+            mu_assert((obj->tag & GC_TAG_ROOT) && (obj->flags & GC_DUMP_ROOT), "Static objects should be roots");
+            mu_assert(obj->nrefs == 2, "References should be dumped");
+            for (size_t j = 0; j < 2; ++j) {
+                Allocation* target = gc_allocation_map_get(gc_.allocs, (void*) (uintptr_t) refs[obj->refs + j]);
+                mu_assert(target && (target->size == 64 || target->size == 7), "References should point to objects");
+            }
+        } else if (obj->size == 7) {
+            mu_assert(obj->flags == GC_DUMP_ATOMIC && obj->nrefs == 0, "Atomic objects have no references");
+        } else {
+            mu_assert(!(obj->flags & GC_DUMP_ROOT) && obj->nrefs == 0, "Other objects are not roots");
+        }
+        found += obj->size;
+    }
+    mu_assert(found == 32 + 64 + 7 + 48, "All objects should be dumped");
+    /* the marks borrowed by the dump are gone */
+    mu_assert(gc_run(&gc_) == 48, "Only the unreferenced object should be collected");
+    free(data);
+    gc_stop(&gc_);
+    return NULL;
+}
+
+STACK_TEST static void _profile_graph(GarbageCollector* gc) {
+    gc_malloc_static(gc, 32, NULL);
+    for (size_t i = 0; i < 2; ++i) {
+        gc_malloc(gc, 48);
+    }
+}
+
+STACK_TEST static char* test_gc_profile() {
+    GarbageCollector gc_;
+    void *bos = __builtin_frame_address(0);
+    GarbageCollectorOptions opts;
+    gc_options_init(&opts);
+    /* every allocation is sampled */
+    opts.profile_interval = 1;
+    gc_start_opts(&gc_, bos, &opts);
+    gc_pause(&gc_);
+    _profile_graph(&gc_);
+    _clear_stack();
+    mu_assert(gc_run(&gc_) == 96, "Sampled objects should be collected like any other");
+    Profiler* prof = gc_.profiler;
+    mu_assert(prof->nsamples == 1, "Only the sample in use should be kept");
+    mu_assert(gc_allocation_map_get(gc_.allocs, prof->samples[gc_profiler_find_sample(prof, gc_.roots->roots[0])].ptr)
+              ->tag & GC_TAG_SAMPLED, "Sampled objects should be tagged");
+    size_t counts[4] = { 0, 0, 0, 0 };
+    for (size_t i = 0; i < prof->nsites; ++i) {
+        counts[0] += prof->sites[i].alloc_objects;
+        counts[1] += prof->sites[i].inuse_objects;
+        counts[2] += prof->sites[i].inuse_bytes;
+        counts[3] += prof->sites[i].survived_objects;
+    }
+    mu_assert(counts[0] == 3 && counts[1] == 1 && counts[2] == 32, "Sites should count their samples");
+    mu_assert(counts[3] == 1, "Samples surviving a collection should be counted");
+
+    /* not static: the data segment test would find the addresses */
+    char* data = malloc(4096);
+    FILE* file = tmpfile();
+    mu_assert(gc_profile_write(&gc_, fileno(file), GC_PROFILE_FOLDED), "The folded profile should be written");
+    size_t len = (size_t) pread(fileno(file), data, 4095, 0);
+    data[len] = 0;
+    fclose(file);
+    mu_assert(len > 0 && strchr(data, '\n') == data + len - 1 && strchr(data, ';'),
+              "The folded profile should have a stack per site in use");
+    mu_assert(strtoul(strrchr(data, ' ') + 1, NULL, 10) >= 32, "Stacks should be weighed by their bytes");
+    file = tmpfile();
+    mu_assert(gc_profile_write(&gc_, fileno(file), GC_PROFILE_PPROF), "The pprof profile should be written");
+    len = (size_t) pread(fileno(file), data, 4095, 0);
+    data[len] = 0;
+    fclose(file);
+    const char* header = "heap profile: 1: 32 [3: 128] @ heap_v2/1\n";
+    mu_assert(strncmp(data, header, strlen(header)) == 0, "The pprof profile should have a header");
+    free(data);
+
+    gc_set_profile_interval(&gc_, 0);
+    gc_malloc(&gc_, 16);
+    mu_assert(prof->nsamples == 1 && gc_.profiler == prof, "Sampling should stop, keeping the samples");
+    gc_stop(&gc_);
+    return NULL;
+}
+
+STACK_TEST static char* duplicate_string(GarbageCollector* gc, char* str) {
     char* copy = (char*) gc_strdup(gc, str);
     mu_assert(strncmp(str, copy, 16) == 0, "Strings should be equal");
     return NULL;
 }
 
-char* test_gc_strdup() {
+STACK_TEST char* test_gc_strdup() {
     GarbageCollector gc_;
     void *bos = __builtin_frame_address(0);
     gc_start(&gc_, bos);
     char* str = "This is a string";
     char* error = duplicate_string(&gc_, str);
     mu_assert(error == NULL, "Duplication failed"); // cascade minunit tests
+    _clear_stack();
     size_t collected = gc_run(&gc_);
     mu_assert(collected == 17, "Unexpected number of collected bytes in strdup");
     gc_stop(&gc_);
@@ -448,6 +1652,12 @@ static char* test_suite() {
     printf("---=[ GC tests\n");
     printf("test_gc_allocation_new_delete \n");
     mu_run_test(test_gc_allocation_new_delete);
+    printf("test_gc_heap_alloc_free \n");
+    mu_run_test(test_gc_heap_alloc_free);
+    printf("test_gc_heap_interior_pointers \n");
+    mu_run_test(test_gc_heap_interior_pointers);
+    printf("test_gc_mark_interior_pointer \n");
+    mu_run_test(test_gc_mark_interior_pointer);
     printf("test_gc_allocation_map_new_delete \n");
     mu_run_test(test_gc_allocation_map_new_delete);
     printf("test_gc_allocation_map_basic_get \n");
@@ -458,12 +1668,52 @@ static char* test_suite() {
     // mu_run_test(test_gc_mark_stack);
     // printf("test_gc_basic_alloc_free \n");
     // mu_run_test(test_gc_basic_alloc_free);
+    printf("test_gc_allocation_map_robin_hood \n");
+    mu_run_test(test_gc_allocation_map_robin_hood);
+    printf("test_gc_sweep_half \n");
+    mu_run_test(test_gc_sweep_half);
+    printf("test_gc_scan_stride \n");
+    mu_run_test(test_gc_scan_stride);
+    printf("test_gc_deferred_finalizers \n");
+    mu_run_test(test_gc_deferred_finalizers);
+    printf("test_gc_lazy_sweep \n");
+    mu_run_test(test_gc_lazy_sweep);
+    printf("test_gc_mark_deep_list \n");
+    mu_run_test(test_gc_mark_deep_list);
+    printf("test_gc_stats \n");
+    mu_run_test(test_gc_stats);
+    printf("test_gc_trace \n");
+    mu_run_test(test_gc_trace);
+    printf("test_gc_record \n");
+    mu_run_test(test_gc_record);
+    printf("test_gc_heap_dump \n");
+    mu_run_test(test_gc_heap_dump);
+    printf("test_gc_profile \n");
+    mu_run_test(test_gc_profile);
+    printf("test_gc_root_ranges \n");
+    mu_run_test(test_gc_root_ranges);
+    printf("test_gc_large_objects \n");
+    mu_run_test(test_gc_large_objects);
+    printf("test_gc_typed \n");
+    mu_run_test(test_gc_typed);
+    printf("test_gc_pacer \n");
+    mu_run_test(test_gc_pacer);
+    printf("test_gc_incremental \n");
+    mu_run_test(test_gc_incremental);
+    printf("test_gc_generational \n");
+    mu_run_test(test_gc_generational);
+    printf("test_gc_thread_cache \n");
+    mu_run_test(test_gc_thread_cache);
+    printf("test_gc_threads \n");
+    mu_run_test(test_gc_threads);
+    printf("test_gc_mark_parallel \n");
+    mu_run_test(test_gc_mark_parallel);
     printf("test_gc_allocation_map_cleanup \n");
     mu_run_test(test_gc_allocation_map_cleanup);
     printf("test_gc_static_allocation \n");
     mu_run_test(test_gc_static_allocation);
-    printf("test_primes \n");
-    mu_run_test(test_primes);
+    printf("test_pow2 \n");
+    mu_run_test(test_pow2);
     printf("test_gc_realloc \n");
     mu_run_test(test_gc_realloc);
     printf("test_gc_pause_resume \n");
@@ -0,0 +1,381 @@
+/*
+ * Analyzes a heap dump written by gc_heap_dump:
+ *
+ *   gc_heap_analyze [-n count] DUMP
+ *
+ * The dump is mapped, not read. Objects flagged as referenced from the
+ * roots, and static objects, hang off a virtual root; the dominator tree
+ * of that graph (Cooper, Harvey and Kennedy's iterative algorithm) gives
+ * the retained size of every object, the bytes that would be freed
+ * without it. Prints a summary, the count objects retaining the most
+ * and the shallow sizes by destructor. Objects the roots do not reach
+ * are dead and only wait for the next collection.
+ */
+#include <fcntl.h>
+#include <inttypes.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "gc.h"
+
+#define NONE UINT32_MAX
+
+static const GcDumpObject* objects;
+static const uint64_t* refs;
+static uint64_t nobjects;
+
+static void* xmalloc(size_t size) {
+    void* p = malloc(size ? size : 1);
+    if (!p) {
+        fprintf(stderr, "gc_heap_analyze: out of memory\n");
+        exit(1);
+    }
+    return p;
+}
+
+/* Objects by address, to resolve references */
+static uint32_t* by_addr;
+
+static int compare_addr(const void* x, const void* y) {
+    uint64_t a = objects[*(const uint32_t*) x].addr;
+    uint64_t b = objects[*(const uint32_t*) y].addr;
+    return a < b ? -1 : a > b;
+}
+
+static uint32_t find(uint64_t addr) {
+    size_t lo = 0;
+    size_t hi = nobjects;
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+        uint64_t a = objects[by_addr[mid]].addr;
+        if (a == addr) {
+            return by_addr[mid];
+        }
+        if (a < addr) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    return NONE;
+}
+
+/*
+ * The graph has the virtual root as node 0 and object i as node i + 1.
+ * Successors are kept in compressed rows: those of node v are
+ * succ[first[v]] to succ[first[v + 1] - 1].
+ */
+static uint64_t* first;
+static uint32_t* succ;
+
+static void build_graph(void) {
+    uint64_t nroots = 0;
+    for (uint64_t i = 0; i < nobjects; ++i) {
+        nroots += (objects[i].flags & GC_DUMP_ROOT) || (objects[i].tag & GC_TAG_ROOT);
+    }
+    uint64_t nrefs = 0;
+    for (uint64_t i = 0; i < nobjects; ++i) {
+        nrefs += objects[i].nrefs;
+    }
+    first = xmalloc((nobjects + 2) * sizeof(uint64_t));
+    succ = xmalloc((nroots + nrefs) * sizeof(uint32_t));
+    uint64_t n = 0;
+    first[0] = 0;
+    for (uint64_t i = 0; i < nobjects; ++i) {
+        if ((objects[i].flags & GC_DUMP_ROOT) || (objects[i].tag & GC_TAG_ROOT)) {
+            succ[n++] = (uint32_t) (i + 1);
+        }
+    }
+    for (uint64_t i = 0; i < nobjects; ++i) {
+        first[i + 1] = n;
+        for (uint64_t j = 0; j < objects[i].nrefs; ++j) {
+            uint32_t target = find(refs[objects[i].refs + j]);
+            if (target != NONE) {
+                succ[n++] = target + 1;
+            }
+        }
+    }
+    first[nobjects + 1] = n;
+}
+
+/* Reverse postorder number of every node, NONE if unreachable */
+static uint32_t* rpo;
+static uint32_t* order;       // nodes by reverse postorder
+static uint32_t nreachable;
+
+static void number_nodes(void) {
+    uint32_t nodes = (uint32_t) nobjects + 1;
+    rpo = xmalloc(nodes * sizeof(uint32_t));
+    order = xmalloc(nodes * sizeof(uint32_t));
+    uint32_t* stack = xmalloc(nodes * sizeof(uint32_t));
+    uint64_t* next = xmalloc(nodes * sizeof(uint64_t));
+    for (uint32_t v = 0; v < nodes; ++v) {
+        rpo[v] = NONE;
+    }
+    /* iterative depth-first search; rpo marks visited nodes until numbered */
+    uint32_t depth = 0;
+    uint32_t post = 0;
+    stack[depth++] = 0;
+    next[0] = first[0];
+    rpo[0] = 0;
+    while (depth) {
+        uint32_t v = stack[depth - 1];
+        if (next[v] < first[v + 1]) {
+            uint32_t w = succ[next[v]++];
+            if (rpo[w] == NONE) {
+                rpo[w] = 0;
+                next[w] = first[w];
+                stack[depth++] = w;
+            }
+        } else {
+            order[post++] = v;
+            depth--;
+        }
+    }
+    nreachable = post;
+    /* postorder to reverse postorder */
+    for (uint32_t i = 0; i < post / 2; ++i) {
+        uint32_t t = order[i];
+        order[i] = order[post - 1 - i];
+        order[post - 1 - i] = t;
+    }
+    for (uint32_t v = 0; v < nodes; ++v) {
+        rpo[v] = NONE;
+    }
+    for (uint32_t i = 0; i < post; ++i) {
+        rpo[order[i]] = i;
+    }
+    free(stack);
+    free(next);
+}
+
+static uint32_t* idom;
+
+static uint32_t intersect(uint32_t a, uint32_t b) {
+    while (a != b) {
+        while (rpo[a] > rpo[b]) {
+            a = idom[a];
+        }
+        while (rpo[b] > rpo[a]) {
+            b = idom[b];
+        }
+    }
+    return a;
+}
+
+static void dominators(void) {
+    uint32_t nodes = (uint32_t) nobjects + 1;
+    /* predecessors of the reachable nodes, in compressed rows */
+    uint64_t* pfirst = xmalloc((nodes + 1) * sizeof(uint64_t));
+    memset(pfirst, 0, (nodes + 1) * sizeof(uint64_t));
+    for (uint32_t v = 0; v < nodes; ++v) {
+        if (rpo[v] != NONE) {
+            for (uint64_t e = first[v]; e < first[v + 1]; ++e) {
+                pfirst[succ[e] + 1]++;
+            }
+        }
+    }
+    for (uint32_t v = 0; v < nodes; ++v) {
+        pfirst[v + 1] += pfirst[v];
+    }
+    uint32_t* pred = xmalloc(pfirst[nodes] * sizeof(uint32_t));
+    uint64_t* fill = xmalloc(nodes * sizeof(uint64_t));
+    memcpy(fill, pfirst, nodes * sizeof(uint64_t));
+    for (uint32_t v = 0; v < nodes; ++v) {
+        if (rpo[v] != NONE) {
+            for (uint64_t e = first[v]; e < first[v + 1]; ++e) {
+                pred[fill[succ[e]]++] = v;
+            }
+        }
+    }
+    free(fill);
+
+    idom = xmalloc(nodes * sizeof(uint32_t));
+    for (uint32_t v = 0; v < nodes; ++v) {
+        idom[v] = NONE;
+    }
+    idom[0] = 0;
+    bool changed = true;
+    while (changed) {
+        changed = false;
+        for (uint32_t i = 1; i < nreachable; ++i) {
+            uint32_t v = order[i];
+            uint32_t dom = NONE;
+            for (uint64_t e = pfirst[v]; e < pfirst[v + 1]; ++e) {
+                uint32_t p = pred[e];
+                if (idom[p] != NONE) {
+                    dom = dom == NONE ? p : intersect(p, dom);
+                }
+            }
+            if (dom != idom[v]) {
+                idom[v] = dom;
+                changed = true;
+            }
+        }
+    }
+    free(pfirst);
+    free(pred);
+}
+
+static uint64_t* retained;
+
+static int compare_retained(const void* x, const void* y) {
+    uint64_t a = retained[*(const uint32_t*) x];
+    uint64_t b = retained[*(const uint32_t*) y];
+    return a > b ? -1 : a < b;
+}
+
+typedef struct DtorStats {
+    uint64_t dtor;
+    uint64_t count;
+    uint64_t bytes;
+} DtorStats;
+
+static int compare_dtor(const void* x, const void* y) {
+    const DtorStats* a = x;
+    const DtorStats* b = y;
+    return a->dtor < b->dtor ? -1 : a->dtor > b->dtor;
+}
+
+static int compare_bytes(const void* x, const void* y) {
+    const DtorStats* a = x;
+    const DtorStats* b = y;
+    return a->bytes > b->bytes ? -1 : a->bytes < b->bytes;
+}
+
+static void print_by_dtor(size_t count) {
+    DtorStats* stats = xmalloc(nobjects * sizeof(DtorStats));
+    for (uint64_t i = 0; i < nobjects; ++i) {
+        stats[i].dtor = objects[i].dtor;
+        stats[i].count = 1;
+        stats[i].bytes = objects[i].size;
+    }
+    qsort(stats, nobjects, sizeof(DtorStats), compare_dtor);
+    size_t n = 0;
+    for (uint64_t i = 0; i < nobjects; ++i) {
+        if (n && stats[n - 1].dtor == stats[i].dtor) {
+            stats[n - 1].count++;
+            stats[n - 1].bytes += stats[i].bytes;
+        } else {
+            stats[n++] = stats[i];
+        }
+    }
+    qsort(stats, n, sizeof(DtorStats), compare_bytes);
+    printf("\n%14s %10s  %s\n", "bytes", "objects", "destructor");
+    for (size_t i = 0; i < n && i < count; ++i) {
+        printf("%14" PRIu64 " %10" PRIu64 "  0x%" PRIx64 "\n", stats[i].bytes, stats[i].count, stats[i].dtor);
+    }
+    free(stats);
+}
+
+int main(int argc, char** argv) {
+    size_t count = 20;
+    int opt;
+    while ((opt = getopt(argc, argv, "n:")) != -1) {
+        if (opt == 'n') {
+            count = strtoul(optarg, NULL, 10);
+        } else {
+            fprintf(stderr, "usage: %s [-n count] DUMP\n", argv[0]);
+            return 2;
+        }
+    }
+    if (optind != argc - 1) {
+        fprintf(stderr, "usage: %s [-n count] DUMP\n", argv[0]);
+        return 2;
+    }
+    const char* path = argv[optind];
+    int fd = open(path, O_RDONLY);
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st) != 0) {
+        perror(path);
+        return 1;
+    }
+    size_t len = (size_t) st.st_size;
+    const char* data = len >= sizeof(GcDumpHeader) ? mmap(NULL, len, PROT_READ, MAP_PRIVATE, fd, 0) : MAP_FAILED;
+    const GcDumpHeader* header = (const GcDumpHeader*) data;
+    if (data == MAP_FAILED || memcmp(header->magic, GC_DUMP_MAGIC, sizeof(header->magic)) != 0
+        || header->objects > len || header->nobjects > (len - header->objects) / sizeof(GcDumpObject)
+        || header->refs > len || header->nrefs > (len - header->refs) / sizeof(uint64_t)
+        || header->nobjects >= NONE) {
+        fprintf(stderr, "%s: not a heap dump\n", path);
+        return 1;
+    }
+    objects = (const GcDumpObject*) (data + header->objects);
+    refs = (const uint64_t*) (data + header->refs);
+    nobjects = header->nobjects;
+    for (uint64_t i = 0; i < nobjects; ++i) {
+        if (objects[i].refs > header->nrefs || objects[i].nrefs > header->nrefs - objects[i].refs) {
+            fprintf(stderr, "%s: object %" PRIu64 " has references outside of the dump\n", path, i);
+            return 1;
+        }
+    }
+
+    by_addr = xmalloc(nobjects * sizeof(uint32_t));
+    for (uint64_t i = 0; i < nobjects; ++i) {
+        by_addr[i] = (uint32_t) i;
+    }
+    qsort(by_addr, nobjects, sizeof(uint32_t), compare_addr);
+    build_graph();
+    number_nodes();
+    dominators();
+
+    /* Dominator tree children come after their parent in reverse postorder */
+    uint32_t nodes = (uint32_t) nobjects + 1;
+    retained = xmalloc(nodes * sizeof(uint64_t));
+    retained[0] = 0;
+    uint64_t total = 0;
+    uint64_t roots = 0;
+    for (uint64_t i = 0; i < nobjects; ++i) {
+        retained[i + 1] = objects[i].size;
+        total += objects[i].size;
+        roots += (objects[i].flags & GC_DUMP_ROOT) || (objects[i].tag & GC_TAG_ROOT);
+    }
+    for (uint32_t i = nreachable; i-- > 1;) {
+        retained[idom[order[i]]] += retained[order[i]];
+    }
+    uint64_t reachable = retained[0];
+
+    printf("objects      %" PRIu64 " (%" PRIu64 " bytes)\n", nobjects, total);
+    printf("references   %" PRIu64 "\n", (uint64_t) header->nrefs);
+    printf("roots        %" PRIu64 "\n", roots);
+    printf("reachable    %" PRIu32 " (%" PRIu64 " bytes)\n", nreachable - 1, reachable);
+    printf("unreachable  %" PRIu64 " (%" PRIu64 " bytes)\n", nobjects - (nreachable - 1), total - reachable);
+    printf("heap         %" PRIu64 " used, %" PRIu64 " committed\n",
+           (uint64_t) header->heap_used, (uint64_t) header->heap_committed);
+
+    uint32_t* top = xmalloc(nreachable * sizeof(uint32_t));
+    uint32_t ntop = 0;
+    for (uint32_t i = 1; i < nreachable; ++i) {
+        top[ntop++] = order[i];
+    }
+    qsort(top, ntop, sizeof(uint32_t), compare_retained);
+    printf("\n%14s %14s %8s  %-18s  %-18s  %s\n", "retained", "size", "refs", "address", "dominator", "destructor");
+    for (uint32_t i = 0; i < ntop && i < count; ++i) {
+        const GcDumpObject* obj = &objects[top[i] - 1];
+        uint32_t dom = idom[top[i]];
+        char dominator[24] = "root";
+        if (dom) {
+            snprintf(dominator, sizeof(dominator), "0x%016" PRIx64, objects[dom - 1].addr);
+        }
+        printf("%14" PRIu64 " %14" PRIu64 " %8" PRIu64 "  0x%016" PRIx64 "  %-18s  0x%" PRIx64 "\n",
+               retained[top[i]], obj->size, obj->nrefs, obj->addr, dominator, obj->dtor);
+    }
+    print_by_dtor(count);
+
+    free(top);
+    free(retained);
+    free(idom);
+    free(rpo);
+    free(order);
+    free(first);
+    free(succ);
+    free(by_addr);
+    munmap((void*) data, len);
+    close(fd);
+    return 0;
+}
@@ -0,0 +1,348 @@
+/*
+ * Replays an allocation record written with gc_record_start against a
+ * fresh collector and prints what it cost as one JSON object:
+ *
+ *   gc_replay [-i initial_capacity] [-m min_capacity] [-d downsize_load_factor]
+ *             [-u upsize_load_factor] [-g heap_growth] [-n repeat] RECORD
+ *
+ * The options are passed to gc_start_opts. Every object the record knows
+ * to be alive is held in a root table scanned by the collector; it is
+ * dropped from the table where the recording collector reclaimed it, so
+ * the replaying collector finds it dead at its next collection, whenever
+ * its parameters make that happen. Recorded pointer stores are repeated
+ * in the replayed objects, so marking traces a graph of the same shape.
+ *
+ * Objects allocated before the recording started are unknown to the
+ * replay, events that refer to them are skipped. With -n, the record is
+ * replayed that many times in a row against the same collector.
+ */
+#include <fcntl.h>
+#include <getopt.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+#include "gc.h"
+
+/*
+ * Replayed objects by recorded address. The map is an open-addressing
+ * table of indices into the root table, which is registered as a root
+ * range and holds the only pointers to the objects.
+ */
+typedef struct Object {
+    void* ptr;
+    size_t size;
+    bool is_static;           // allocated with gc_malloc_static
+} Object;
+
+static GarbageCollector collector;
+
+static Object* objects;       // root table, the first object is unused
+static size_t nobjects = 1;
+static size_t objects_capacity;
+static uint32_t* free_objects; // unused entries of the root table
+static size_t nfree_objects;
+
+static uint64_t* keys;        // recorded addresses
+static uint32_t* values;      // root table index, 0 for empty
+static size_t map_capacity;
+static size_t map_size;
+
+static void die(const char* msg) {
+    fprintf(stderr, "gc_replay: %s\n", msg);
+    exit(1);
+}
+
+static size_t slot_of(uint64_t key) {
+    return (size_t) ((key >> 4) * 0x9e3779b97f4a7c15u) & (map_capacity - 1);
+}
+
+static size_t map_find(uint64_t key) {
+    size_t i = slot_of(key);
+    while (values[i] && keys[i] != key) {
+        i = (i + 1) & (map_capacity - 1);
+    }
+    return i;
+}
+
+static Object* lookup(uint64_t key) {
+    size_t i = map_find(key);
+    return values[i] ? &objects[values[i]] : NULL;
+}
+
+static void map_grow(void) {
+    uint64_t* old_keys = keys;
+    uint32_t* old_values = values;
+    size_t old_capacity = map_capacity;
+    map_capacity = map_capacity ? 2 * map_capacity : 1024;
+    keys = calloc(map_capacity, sizeof(uint64_t));
+    values = calloc(map_capacity, sizeof(uint32_t));
+    if (!keys || !values) {
+        die("out of memory");
+    }
+    for (size_t i = 0; i < old_capacity; ++i) {
+        if (old_values[i]) {
+            size_t j = map_find(old_keys[i]);
+            keys[j] = old_keys[i];
+            values[j] = old_values[i];
+        }
+    }
+    free(old_keys);
+    free(old_values);
+}
+
+/*
+ * Takes an object out of the map and the root table, leaving it to the
+ * collector.
+ */
+static void forget(uint64_t key) {
+    size_t i = map_find(key);
+    if (!values[i]) {
+        return;
+    }
+    objects[values[i]].ptr = NULL;
+    free_objects[nfree_objects++] = values[i];
+    values[i] = 0;
+    map_size--;
+    /* backward shift deletion keeps probe sequences unbroken */
+    size_t j = i;
+    for (;;) {
+        j = (j + 1) & (map_capacity - 1);
+        if (!values[j]) {
+            break;
+        }
+        size_t home = slot_of(keys[j]);
+        if (((j - home) & (map_capacity - 1)) >= ((j - i) & (map_capacity - 1))) {
+            keys[i] = keys[j];
+            values[i] = values[j];
+            values[j] = 0;
+            i = j;
+        }
+    }
+}
+
+/*
+ * Doubles the root table. It moves, so its root range moves with it.
+ */
+static void table_grow(void) {
+    size_t capacity = objects_capacity ? 2 * objects_capacity : 1024;
+    Object* grown = calloc(capacity, sizeof(Object));
+    uint32_t* grown_free = malloc(capacity * sizeof(uint32_t));
+    if (!grown || !grown_free || !gc_add_root_range(&collector, grown, capacity * sizeof(Object))) {
+        die("out of memory");
+    }
+    if (objects) {
+        memcpy(grown, objects, nobjects * sizeof(Object));
+        gc_remove_root_range(&collector, objects, objects_capacity * sizeof(Object));
+    }
+    free(objects);
+    free(free_objects);
+    objects = grown;
+    free_objects = grown_free;
+    objects_capacity = capacity;
+}
+
+static void remember(uint64_t key, void* ptr, size_t size, bool is_static) {
+    forget(key);
+    if (2 * (map_size + 1) > map_capacity) {
+        map_grow();
+    }
+    if (!nfree_objects && nobjects == objects_capacity) {
+        table_grow();
+    }
+    uint32_t index = nfree_objects ? free_objects[--nfree_objects] : (uint32_t) nobjects++;
+    objects[index].ptr = ptr;
+    objects[index].size = size;
+    objects[index].is_static = is_static;
+    size_t i = map_find(key);
+    keys[i] = key;
+    values[i] = index;
+    map_size++;
+}
+
+static void dtor(void* ptr) {
+    (void) ptr;
+}
+
+static void store(const GcRecordEvent* e, void* value) {
+    Object* obj = lookup(e->addr);
+    if (obj && e->a + sizeof(void*) <= obj->size) {
+        memcpy((char*) obj->ptr + e->a, &value, sizeof(void*));
+        gc_write_barrier(&collector, obj->ptr, (char*) obj->ptr + e->a);
+    }
+}
+
+/*
+ * Replays one event. Returns false if it referred to an unknown object.
+ */
+static bool replay(const GcRecordEvent* e) {
+    void* ptr;
+    Object* obj;
+    switch (e->type) {
+    case GC_RECORD_ALLOC:
+        if (e->b & GC_RECORD_ALLOC_STATIC) {
+            ptr = gc_malloc_static(&collector, e->a, e->b & GC_RECORD_ALLOC_DTOR ? dtor : NULL);
+        } else if (e->b & GC_RECORD_ALLOC_ATOMIC) {
+            ptr = gc_malloc_atomic(&collector, e->a);
+        } else if (e->b & GC_RECORD_ALLOC_CALLOC) {
+            ptr = gc_calloc_ext(&collector, 1, e->a, e->b & GC_RECORD_ALLOC_DTOR ? dtor : NULL);
+        } else {
+            ptr = gc_malloc_ext(&collector, e->a, e->b & GC_RECORD_ALLOC_DTOR ? dtor : NULL);
+        }
+        if (!ptr) {
+            die("allocation failed");
+        }
+        remember(e->addr, ptr, e->a, e->b & GC_RECORD_ALLOC_STATIC);
+        return true;
+    case GC_RECORD_REALLOC:
+        if (!(obj = lookup(e->addr))) {
+            return false;
+        }
+        ptr = gc_realloc(&collector, obj->ptr, e->b);
+        if (!ptr) {
+            die("reallocation failed");
+        }
+        bool is_static = obj->is_static;
+        forget(e->addr);
+        remember(e->a, ptr, e->b, is_static);
+        return true;
+    case GC_RECORD_FREE:
+        if (!(obj = lookup(e->addr))) {
+            return false;
+        }
+        gc_free(&collector, obj->ptr);
+        forget(e->addr);
+        return true;
+    case GC_RECORD_DEATH:
+        if (!(obj = lookup(e->addr))) {
+            return false;
+        }
+        if (obj->is_static) {
+            /* the program made it collectable again */
+            gc_unmake_static(&collector, obj->ptr);
+        }
+        forget(e->addr);
+        return true;
+    case GC_RECORD_EDGE:
+        obj = lookup(e->b);
+        store(e, obj ? obj->ptr : NULL);
+        return true;
+    case GC_RECORD_CLEAR:
+        store(e, NULL);
+        return true;
+    case GC_RECORD_RUN:
+        if (e->a) {
+            gc_run_minor(&collector);
+        } else {
+            gc_run(&collector);
+        }
+        return true;
+    }
+    return false;
+}
+
+static uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000u + (uint64_t) ts.tv_nsec;
+}
+
+int main(int argc, char** argv) {
+    size_t initial_capacity = 1024;
+    size_t min_capacity = 1024;
+    double downsize_load_factor = 0.2;
+    double upsize_load_factor = 0.8;
+    double heap_growth = 1.0;
+    size_t repeat = 1;
+    int opt;
+    while ((opt = getopt(argc, argv, "i:m:d:u:g:n:")) != -1) {
+        switch (opt) {
+        case 'i': initial_capacity = strtoul(optarg, NULL, 10); break;
+        case 'm': min_capacity = strtoul(optarg, NULL, 10); break;
+        case 'd': downsize_load_factor = strtod(optarg, NULL); break;
+        case 'u': upsize_load_factor = strtod(optarg, NULL); break;
+        case 'g': heap_growth = strtod(optarg, NULL); break;
+        case 'n': repeat = strtoul(optarg, NULL, 10); break;
+        default:
+            fprintf(stderr, "usage: %s [-i initial_capacity] [-m min_capacity] [-d downsize_load_factor]\n"
+                            "       [-u upsize_load_factor] [-g heap_growth] [-n repeat] RECORD\n", argv[0]);
+            return 2;
+        }
+    }
+    if (optind != argc - 1) {
+        fprintf(stderr, "%s: expected one record file\n", argv[0]);
+        return 2;
+    }
+    int fd = open(argv[optind], O_RDONLY);
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st) != 0) {
+        perror(argv[optind]);
+        return 1;
+    }
+    size_t len = (size_t) st.st_size;
+    const size_t header = sizeof(GC_RECORD_MAGIC) - 1;
+    const char* data = len ? mmap(NULL, len, PROT_READ, MAP_PRIVATE, fd, 0) : MAP_FAILED;
+    if (data == MAP_FAILED || len < header || memcmp(data, GC_RECORD_MAGIC, header) != 0) {
+        fprintf(stderr, "%s: not an allocation record\n", argv[optind]);
+        return 1;
+    }
+
+    GarbageCollectorOptions opts;
+    gc_options_init(&opts);
+    opts.initial_capacity = initial_capacity;
+    opts.min_capacity = min_capacity;
+    opts.downsize_load_factor = downsize_load_factor;
+    opts.upsize_load_factor = upsize_load_factor;
+    opts.heap_growth = heap_growth;
+    gc_start_opts(&collector, __builtin_frame_address(0), &opts);
+    table_grow();
+    map_grow();
+    size_t events = 0;
+    size_t skipped = 0;
+    size_t pos = header;
+    uint64_t start = now_ns();
+    for (size_t round = 0; round < (repeat ? repeat : 1); ++round) {
+        uintptr_t last = 0;
+        GcRecordEvent e;
+        size_t n;
+        for (pos = header; (n = gc_record_decode(data + pos, len - pos, &last, &e)); pos += n) {
+            events++;
+            skipped += !replay(&e);
+        }
+        /* a later round starts without the objects of this one */
+        for (size_t i = 1; i < nobjects; ++i) {
+            objects[i].ptr = NULL;
+        }
+        memset(values, 0, map_capacity * sizeof(uint32_t));
+        map_size = 0;
+        nobjects = 1;
+        nfree_objects = 0;
+    }
+    double seconds = (double) (now_ns() - start) / 1e9;
+    GcStats stats;
+    gc_get_stats(&collector, &stats);
+    printf("{\"events\":%zu,\"skipped\":%zu,\"truncated\":%s,\"seconds\":%.6f,"
+           "\"initial_capacity\":%zu,\"min_capacity\":%zu,\"downsize_load_factor\":%g,"
+           "\"upsize_load_factor\":%g,\"heap_growth\":%g,"
+           "\"collections\":%zu,\"pause_total_us\":%.3f,\"pause_max_us\":%.3f,"
+           "\"mark_us\":%.3f,\"sweep_us\":%.3f,\"resize_us\":%.3f,"
+           "\"allocated_bytes\":%zu,\"freed_bytes\":%zu,\"live_bytes\":%zu,\"map_load\":%.3f}\n",
+           events, skipped, pos < len ? "true" : "false", seconds,
+           initial_capacity, min_capacity, downsize_load_factor, upsize_load_factor, heap_growth,
+           stats.collections, (double) stats.pause_total_ns / 1e3, (double) stats.pause_max_ns / 1e3,
+           (double) stats.mark_ns / 1e3, (double) stats.sweep_ns / 1e3, (double) stats.resize_ns / 1e3,
+           stats.allocated_bytes, stats.freed_bytes, stats.live_bytes, stats.map_load);
+    gc_stop(&collector);
+    munmap((void*) data, len);
+    close(fd);
+    free(objects);
+    free(free_objects);
+    free(keys);
+    free(values);
+    return 0;
+}
@@ -0,0 +1,69 @@
+/*
+ * Prints a trace written by gc_trace_write, one event per line:
+ *
+ *   gc_trace_dump trace.bin
+ *
+ * Times are relative to the first event in the file, in microseconds.
+ * Events are grouped by thread, so times of different threads interleave.
+ */
+#include <stdio.h>
+#include <string.h>
+#include "gc.h"
+
+static const char* event_names[] = { "?", "alloc", "free", "begin", "end", "phase", "resize" };
+static const char* phase_names[] = { "stack", "roots", "mark", "sweep", "resize" };
+
+static void print_event(const GcTraceEvent* e, uint64_t t0) {
+    const char* name = e->type < sizeof(event_names) / sizeof(*event_names) ? event_names[e->type] : "?";
+    printf("%12.3f %4u %-6s ", (double) (int64_t) (e->time_ns - t0) / 1e3, e->thread, name);
+    switch (e->type) {
+    case GC_EVENT_ALLOC:
+    case GC_EVENT_FREE:
+        printf("ptr=0x%llx size=%llu\n", (unsigned long long) e->a, (unsigned long long) e->b);
+        break;
+    case GC_EVENT_BEGIN:
+        printf("minor=%llu used=%llu\n", (unsigned long long) e->a, (unsigned long long) e->b);
+        break;
+    case GC_EVENT_END:
+        printf("freed=%llu used=%llu\n", (unsigned long long) e->a, (unsigned long long) e->b);
+        break;
+    case GC_EVENT_PHASE:
+        printf("%s %.3fus\n", e->a < sizeof(phase_names) / sizeof(*phase_names) ? phase_names[e->a] : "?",
+               (double) e->b / 1e3);
+        break;
+    case GC_EVENT_RESIZE:
+        printf("capacity=%llu->%llu\n", (unsigned long long) e->a, (unsigned long long) e->b);
+        break;
+    default:
+        printf("a=%llu b=%llu\n", (unsigned long long) e->a, (unsigned long long) e->b);
+    }
+}
+
+int main(int argc, char** argv) {
+    if (argc != 2) {
+        fprintf(stderr, "usage: %s TRACE\n", argv[0]);
+        return 2;
+    }
+    FILE* in = fopen(argv[1], "rb");
+    if (!in) {
+        perror(argv[1]);
+        return 1;
+    }
+    char magic[sizeof(GC_TRACE_MAGIC) - 1];
+    if (fread(magic, 1, sizeof(magic), in) != sizeof(magic) || memcmp(magic, GC_TRACE_MAGIC, sizeof(magic))) {
+        fprintf(stderr, "%s: not a trace file\n", argv[1]);
+        fclose(in);
+        return 1;
+    }
+    GcTraceEvent e;
+    uint64_t t0 = 0;
+    size_t n = 0;
+    while (fread(&e, sizeof(e), 1, in) == 1) {
+        if (!n++) {
+            t0 = e.time_ns;
+        }
+        print_event(&e, t0);
+    }
+    fclose(in);
+    return 0;
+}
@@ -3,12 +3,21 @@ add_rules("plugin.compile_commands.autoupdate", {outputdir = "./"})
 
 add_requires("c-vector")
 
+-- USDT probes at the trace points, for perf and bpftrace (needs sys/sdt.h)
+option("usdt")
+    set_default(false)
+    set_showmenu(true)
+    set_description("Compile SDT probes into the trace points")
+    add_defines("GC_USDT")
+
 -- Library target
 target("gc")
     set_kind("static") -- or "shared"
     add_files("src/*.c")
     add_packages("c-vector")
+    add_syslinks("pthread", "m")
     add_includedirs("include", {public = true})
+    add_options("usdt")
 
 -- Example program
 target("basic_usage")
@@ -21,3 +30,27 @@ target("test_gc")
     set_kind("binary")
     add_files("tests/test_gc.c")
     add_deps("gc")
+
+-- Benchmarks against malloc/free, run with `xmake f -m release && xmake run bench_gc`
+target("bench_gc")
+    set_kind("binary")
+    add_files("bench/bench_gc.c")
+    add_deps("gc")
+
+-- Prints traces written by gc_trace_write
+target("gc_trace_dump")
+    set_kind("binary")
+    add_files("tools/gc_trace_dump.c")
+    add_includedirs("include")
+
+-- Replays allocation records written with gc_record_start
+target("gc_replay")
+    set_kind("binary")
+    add_files("tools/gc_replay.c")
+    add_deps("gc")
+
+-- Dominators and retained sizes of heap dumps written by gc_heap_dump
+target("gc_heap_analyze")
+    set_kind("binary")
+    add_files("tools/gc_heap_analyze.c")
+    add_includedirs("include")